@@ -116,26 +116,33 @@ kvaddr_to_paddr(vaddr_t vaddr){
  * ram_stealmem can be used before ram_getsize is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
+ *
+ * ram_getstats reports the number of pages of memory managed and how
+ * many of them are free. It may be called at any time.
  */
 
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
+void ram_getstats(unsigned *totalpages, unsigned *freepages);
 
 /*
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A ts_vaddr of TLBSHOOTDOWN_ALL means every page of ts_as.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space it's in */
+	vaddr_t ts_vaddr;		/* page to forget */
 };
 
+#define TLBSHOOTDOWN_ALL ((vaddr_t)-1)
+
 #define TLBSHOOTDOWN_MAX 16
 
 
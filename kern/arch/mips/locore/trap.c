@@ -193,8 +193,22 @@ mips_trap(struct trapframe *tf)
 			doadjust = false;
 		}
 
+		/* Note where we were, for the profiler. */
+		curcpu->c_intrpc = tf->tf_epc;
+		curcpu->c_intruser = !iskern;
+
+		/* Coming from user mode: charge the user time. */
+		if (!iskern) {
+			thread_charge(true);
+		}
+
 		mainbus_interrupt(tf);
 
+		/* Going back: charge the time spent in here. */
+		if (!iskern) {
+			thread_charge(false);
+		}
+
 		if (doadjust) {
 			KASSERT(curthread->t_curspl == IPL_HIGH);
 			KASSERT(curthread->t_iplhigh_count == 1);
@@ -220,6 +234,10 @@ mips_trap(struct trapframe *tf)
 	spl = splhigh();
 	splx(spl);
 
+	if (!iskern) {
+		thread_charge(true);
+	}
+
 	/* Syscall? Call the syscall handler and return. */
 	if (code == EX_SYS) {
 		/* Interrupts should have been on while in user mode. */
@@ -323,6 +341,10 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	if (!iskern) {
+		thread_charge(false);
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -330,6 +352,14 @@ mips_trap(struct trapframe *tf)
 	cpu_irqoff();
  done2:
 
+	/*
+	 * If another thread is taking the process down (exit or exec),
+	 * this one leaves instead of going back to user mode.
+	 */
+	if (!iskern && curproc->p_stopping) {
+		proc_threadexit();
+	}
+
 	/*
 	 * The boot thread can get here (e.g. on interrupt return) but
 	 * since it doesn't go to userlevel, it can't be returning to
@@ -381,7 +411,10 @@ mips_usermode(struct trapframe *tf)
 	 * user mode. However, while in user mode, interrupts should
 	 * be on. To interact properly with the spl-handling logic
 	 * above, we explicitly call spl0() and then call cpu_irqoff().
+	 *
+	 * Everything up to here counts as kernel time.
 	 */
+	thread_charge(false);
 	spl0();
 	cpu_irqoff();
 
@@ -444,3 +477,29 @@ enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 	mips_usermode(&tf);
 }
+
+/*
+ * enter_new_thread: go to user mode in a new thread of the current
+ * process, starting at ENTRY on the user stack STACK, with ARG0 and
+ * ARG1 as its first two arguments.
+ */
+void
+enter_new_thread(vaddr_t entry, vaddr_t stack, userptr_t arg0, userptr_t arg1)
+{
+	struct trapframe tf;
+
+	bzero(&tf, sizeof(tf));
+
+	tf.tf_status = CST_IRQMASK | CST_IEp | CST_KUp;
+	tf.tf_epc = entry;
+	tf.tf_a0 = (vaddr_t)arg0;
+	tf.tf_a1 = (vaddr_t)arg1;
+	/*
+	 * STACK is the top of a fresh, empty stack. ENTRY is an ordinary
+	 * C function, so leave the 16 bytes the o32 calling convention
+	 * says the caller provides for it to home its argument registers.
+	 */
+	tf.tf_sp = stack - 16;
+
+	mips_usermode(&tf);
+}
@@ -113,6 +113,11 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 
 	    /* process calls */
 
@@ -142,6 +147,41 @@ syscall(struct trapframe *tf)
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_setaffinity:
+		err = sys_setaffinity(tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_profctl:
+		err = sys_profctl(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+				  &retval);
+		break;
+
+	    case SYS_getrusage:
+		err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS___threadfork:
+		err = sys___threadfork((userptr_t)tf->tf_a0,
+				       (userptr_t)tf->tf_a1,
+				       (userptr_t)tf->tf_a2, &retval);
+		break;
+
+	    case SYS_threadjoin:
+		err = sys_threadjoin(tf->tf_a0);
+		break;
+
+	    case SYS_threadexit:
+		sys_threadexit();
+		panic("Returning from threadexit\n");
+
+	    case SYS_futex_wait:
+		err = sys_futex_wait((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_futex_wake:
+		err = sys_futex_wake((userptr_t)tf->tf_a0, tf->tf_a1, &retval);
+		break;
+
 
 	    /* file calls */
 
@@ -251,6 +291,9 @@ syscall(struct trapframe *tf)
 	    case SYS_fsync:
 		err = sys_fsync(tf->tf_a0);
 		break;
+	    case SYS_ioctl:
+		err = sys_ioctl(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2);
+		break;
 	    case SYS_ftruncate:
 		{
 			/* Like lseek, the length is 64 bits and aligned */
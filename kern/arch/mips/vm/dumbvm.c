@@ -156,6 +156,36 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+int
+vm_translate(struct addrspace *as, vaddr_t va, paddr_t *ret)
+{
+	vaddr_t stackbase;
+
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+
+	if (va >= as->as_vbase1 &&
+	    va < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		*ret = (va - as->as_vbase1) + as->as_pbase1;
+	}
+	else if (va >= as->as_vbase2 &&
+		 va < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		*ret = (va - as->as_vbase2) + as->as_pbase2;
+	}
+	else if (va >= stackbase && va < USERSTACK) {
+		*ret = (va - stackbase) + as->as_stackpbase;
+	}
+	else {
+		return EFAULT;
+	}
+	return 0;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -400,6 +430,25 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * dumbvm has room for only the one stack, so no extra threads.
+ */
+int
+as_define_threadstack(struct addrspace *as, unsigned slot, vaddr_t *stackptr)
+{
+	if (slot == 0) {
+		return as_define_stack(as, stackptr);
+	}
+	return ENOSYS;
+}
+
+void
+as_remove_threadstack(struct addrspace *as, unsigned slot)
+{
+	(void)as;
+	(void)slot;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
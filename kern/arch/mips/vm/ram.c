@@ -38,6 +38,10 @@ vaddr_t firstfree;   /* first free virtual address; set by start.S */
 static paddr_t firstpaddr;  /* address of first free physical page */
 static paddr_t lastpaddr;   /* one past end of last free physical page */
 
+/* For ram_getstats; these outlive ram_getfirstfree. */
+static unsigned ram_totalpages;
+static unsigned ram_freepages;
+
 /*
  * Called very early in system boot to figure out how much physical
  * RAM is available.
@@ -69,6 +73,9 @@ ram_bootstrap(void)
 	 */
 	firstpaddr = firstfree - MIPS_KSEG0;
 
+	ram_totalpages = lastpaddr / PAGE_SIZE;
+	ram_freepages = (lastpaddr - firstpaddr) / PAGE_SIZE;
+
 	kprintf("%uk physical memory available\n",
 		(lastpaddr-firstpaddr)/1024);
 }
@@ -105,10 +112,26 @@ ram_stealmem(unsigned long npages)
 
 	paddr = firstpaddr;
 	firstpaddr += size;
+	ram_freepages -= npages;
 
 	return paddr;
 }
 
+/*
+ * Report memory usage. "Free" is whatever ram_stealmem hasn't handed
+ * out yet. Once the VM system takes over with ram_getfirstfree we no
+ * longer see what happens to it, so we go on reporting the numbers
+ * as they were at that point.
+ *
+ * Not synchronized, for the same reasons as ram_stealmem.
+ */
+void
+ram_getstats(unsigned *totalpages, unsigned *freepages)
+{
+	*totalpages = ram_totalpages;
+	*freepages = ram_freepages;
+}
+
 /*
  * This function is intended to be called by the VM system when it
  * initializes in order to find out what memory it has available to
@@ -31,7 +31,7 @@
 #include <lib.h>
 #include <vm.h>
 #include <mainbus.h>
-#include <spinlock.h>
+#include <ticketlock.h>
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -50,16 +50,21 @@ static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
 static uint32_t last_frame;
 
+/* Number of frames we manage, and how many of them are free. */
+static uint32_t total_frames;
+static uint32_t free_frame_count;
+
 #define PAGE_BITS 12
 #define TRUE 1
 #define FALSE 0
 
 
 /* frame_table protected by spinlock (interrupt disabling on
- * uniprocessor) as this implementation does not block.
+ * uniprocessor) as this implementation does not block. It's a ticket
+ * lock so that no cpu can be starved of frames under contention.
  */ 
 
-static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
+static struct ticketlock frame_table_spinlock = TICKETLOCK_INITIALIZER;
 
 /*
  * Called very early in system boot to figure out how much physical
@@ -142,6 +147,9 @@ ram_bootstrap(void)
                 frame_table[i].allocated = FALSE;
         }
 
+        total_frames = (lastpaddr >> PAGE_BITS) - first_frame;
+        free_frame_count = total_frames;
+
         
 }
 
@@ -188,6 +196,17 @@ ram_getfirstfree(void)
 	return ret;
 }
 
+/*
+ * Report how many frames we manage and how many are free. The counts
+ * are read without the lock, so may be very slightly stale.
+ */
+void
+ram_getstats(unsigned *totalpages, unsigned *freepages)
+{
+        *totalpages = total_frames;
+        *freepages = free_frame_count;
+}
+
 /*
  * This is a relatively inefficient first-fit allocator. Single pages
  * always fit. Multiframe allocations can suffer from external
@@ -207,13 +226,14 @@ static paddr_t alloc_one_frame(unsigned int npages)
         
         KASSERT(npages == 1);
 
-        spinlock_acquire(&frame_table_spinlock);
+        ticketlock_acquire(&frame_table_spinlock);
         for (i =  first_frame; i < last_frame; i++) {
                 if (frame_table[i].allocated == FALSE) {
                         frame_table[i].allocated = TRUE;
                         frame_table[i].not_last = FALSE;
+                        free_frame_count--;
 
-                        spinlock_release(&frame_table_spinlock);
+                        ticketlock_release(&frame_table_spinlock);
 
                         return (paddr_t) (i << PAGE_BITS);
                 }
@@ -221,7 +241,7 @@ static paddr_t alloc_one_frame(unsigned int npages)
         
         /* Did not find an unallocated frame :-( */
 
-        spinlock_release(&frame_table_spinlock);
+        ticketlock_release(&frame_table_spinlock);
         return (paddr_t) 0;
 }
 
@@ -236,7 +256,7 @@ static paddr_t alloc_multiple_frames(unsigned int npages)
          */
         
 
-        spinlock_acquire(&frame_table_spinlock);
+        ticketlock_acquire(&frame_table_spinlock);
 
         i = first_frame; j = 0;
 
@@ -257,49 +277,66 @@ static paddr_t alloc_multiple_frames(unsigned int npages)
                 }
                 frame_table[j].allocated = TRUE;
                 frame_table[j].not_last = FALSE;
+                free_frame_count -= npages;
 
-                spinlock_release(&frame_table_spinlock);
+                ticketlock_release(&frame_table_spinlock);
                 
                 return (paddr_t) (i << PAGE_BITS);
         }
         
         /* Did not find an unallocated contiguous range of frames :-( */
 
-        spinlock_release(&frame_table_spinlock);
+        ticketlock_release(&frame_table_spinlock);
         return (paddr_t) 0;
 }
 
-static void free_frames(vaddr_t vaddr)
+/* Free one block of frames. Caller must hold frame_table_spinlock. */
+static void free_frames_locked(vaddr_t vaddr)
 {
         paddr_t paddr;
         uint32_t i;
 
         KASSERT(vaddr != (vaddr_t) NULL);
+        KASSERT(ticketlock_do_i_hold(&frame_table_spinlock));
 
         paddr = KVADDR_TO_PADDR(vaddr);
 
         i = paddr >> PAGE_BITS;
 
-        spinlock_acquire(&frame_table_spinlock);
-
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
         
         while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
                 frame_table[i].allocated = FALSE;
+                free_frame_count++;
                 if (frame_table[i].not_last == TRUE) {
                         i++;
                 }
         }
-        spinlock_release(&frame_table_spinlock);
+}
+
+static void free_frames(vaddr_t vaddr)
+{
+        ticketlock_acquire(&frame_table_spinlock);
+        free_frames_locked(vaddr);
+        ticketlock_release(&frame_table_spinlock);
 }
         
-/* Allocate/free some kernel-space virtual pages */
+/*
+ * Allocate/free some kernel-space virtual pages.
+ *
+ * If we run out, give the reclaim code (see vm/reclaim.c) one chance
+ * to free something up before failing. After every allocation, let
+ * it know how much is left so it can act before we run out.
+ */
 vaddr_t
 alloc_kpages(unsigned npages)
 {
         paddr_t paddr;
+        bool retried = FALSE;
+
+ again:
         if (npages > 1 ) {
                 paddr = alloc_multiple_frames(npages);
         }
@@ -308,8 +345,13 @@ alloc_kpages(unsigned npages)
         }
         
 	if (paddr == 0) {
+                if (!retried && reclaim_direct(npages) > 0) {
+                        retried = TRUE;
+                        goto again;
+                }
 		return 0;
 	}
+        reclaim_check(free_frame_count);
 	return PADDR_TO_KVADDR(paddr);
 }
 
@@ -319,3 +361,22 @@ free_kpages(vaddr_t addr)
         free_frames(addr);
 }
 
+/*
+ * Free several allocations, taking the frame table lock only once.
+ */
+void
+free_kpages_batch(const vaddr_t *addrs, unsigned n)
+{
+        unsigned i;
+
+        if (n == 0) {
+                return;
+        }
+
+        ticketlock_acquire(&frame_table_spinlock);
+        for (i = 0; i < n; i++) {
+                free_frames_locked(addrs[i]);
+        }
+        ticketlock_release(&frame_table_spinlock);
+}
+
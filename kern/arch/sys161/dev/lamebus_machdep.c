@@ -76,6 +76,41 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Reset the cycle counter, so the next interrupt comes a full
+ * interval after the next mips_timer_set.
+ */
+static
+void
+mips_timer_reset(void)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		);
+}
+
+/*
+ * Stop or restart the on-chip timer for tickless idle. "Stopping" it
+ * means pushing the next interrupt as far away as it will go, which
+ * is a couple of minutes; if it does go off, hardclock sees an idle
+ * cpu and does nothing.
+ */
+void
+mainbus_idle_timer(bool idle)
+{
+	mips_timer_reset();
+	if (idle) {
+		mips_timer_set(0xffffffff);
+	}
+	else {
+		mips_timer_set(CPU_FREQUENCY / HZ);
+	}
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -321,6 +356,9 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 
+	/* Now that the interrupt is cleared, act on any reschedule IPI. */
+	thread_check_resched();
+
 	if (!seen) {
 		if ((cause & CCA_IRQS) == 0) {
 			/*
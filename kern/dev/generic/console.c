@@ -134,21 +134,50 @@ putch_intr(struct con_softc *cs, int ch)
 }
 
 /*
- * Read a character, using interrupts to wait for I/O completion.
+ * Take a character from the input buffer, once cs_rsem says there
+ * is one.
  */
 static
 int
-getch_intr(struct con_softc *cs)
+getch_take(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
 	return ret;
 }
 
+/*
+ * Read a character, using interrupts to wait for I/O completion.
+ */
+static
+int
+getch_intr(struct con_softc *cs)
+{
+	P(cs->cs_rsem);
+	return getch_take(cs);
+}
+
+/*
+ * Same, for reads from userlevel: a thread that's being made to
+ * leave its process (see proc_stopthreads) gives up with EINTR.
+ */
+static
+int
+getch_user(struct con_softc *cs, char *ch)
+{
+	int result;
+
+	result = P_intr(cs->cs_rsem);
+	if (result) {
+		return result;
+	}
+	*ch = getch_take(cs);
+	return 0;
+}
+
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
@@ -262,7 +291,11 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
+			result = getch_user(the_console, &ch);
+			if (result) {
+				lock_release(lk);
+				return result;
+			}
 			if (ch=='\r') {
 				ch = '\n';
 			}
@@ -68,3 +68,16 @@ gettime(struct timespec *ts)
 	KASSERT(the_clock!=NULL);
 	the_clock->rtc_gettime(the_clock->rtc_devdata, ts);
 }
+
+uint64_t
+gettime_ns(void)
+{
+	struct timespec ts;
+
+	if (the_clock == NULL) {
+		/* Too early in boot. */
+		return 0;
+	}
+	the_clock->rtc_gettime(the_clock->rtc_devdata, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -43,6 +43,7 @@
  */
 
 #define SEMFS_ROOTDIR	0xffffffffU		/* semnum for root dir */
+#define SEMFS_NAMEHASH	64			/* buckets in name index */
 
 /*
  * A user-facing semaphore.
@@ -55,7 +56,7 @@ struct semfs_sem {
 	struct lock *sems_lock;			/* Lock to protect count */
 	struct cv *sems_cv;			/* CV to wait */
 	unsigned sems_count;			/* Semaphore count */
-	bool sems_hasvnode;			/* The vnode exists */
+	struct semfs_vnode *sems_vnode;		/* The vnode, if it exists */
 	bool sems_linked;			/* In the directory */
 };
 DECLARRAY(semfs_sem, SEMFS_INLINE);
@@ -66,6 +67,8 @@ DECLARRAY(semfs_sem, SEMFS_INLINE);
 struct semfs_direntry {
 	char *semd_name;			/* Name */
 	unsigned semd_semnum;			/* Which semaphore */
+	unsigned semd_slot;			/* Index in semfs_dents */
+	struct semfs_direntry *semd_hashnext;	/* Next in name index */
 };
 DECLARRAY(semfs_direntry, SEMFS_INLINE);
 
@@ -80,6 +83,7 @@ struct semfs_vnode {
 	struct vnode semv_absvn;		/* Abstract vnode */
 	struct semfs *semv_semfs;		/* Back-pointer to fs */
 	unsigned semv_semnum;			/* Which semaphore */
+	struct semfs_sem *semv_sem;		/* It (NULL for root dir) */
 };
 
 /*
@@ -95,6 +99,7 @@ struct semfs {
 
 	struct lock *semfs_dirlock;		/* Lock for following */
 	struct semfs_direntryarray *semfs_dents; /* The root directory */
+	struct semfs_direntry *semfs_names[SEMFS_NAMEHASH]; /* Name index */
 };
 
 /*
@@ -115,6 +120,9 @@ int semfs_sem_insert(struct semfs *, struct semfs_sem *, unsigned *);
 void semfs_sem_destroy(struct semfs_sem *);
 struct semfs_direntry *semfs_direntry_create(const char *name, unsigned semno);
 void semfs_direntry_destroy(struct semfs_direntry *);
+struct semfs_direntry *semfs_direntry_find(struct semfs *, const char *name);
+void semfs_direntry_hash(struct semfs *, struct semfs_direntry *);
+void semfs_direntry_unhash(struct semfs *, struct semfs_direntry *);
 
 /* in semfs_vnops.c */
 int semfs_getvnode(struct semfs *, unsigned, struct vnode **ret);
@@ -63,7 +63,7 @@ semfs_sem_create(const char *name)
 		goto fail_lock;
 	}
 	sem->sems_count = 0;
-	sem->sems_hasvnode = false;
+	sem->sems_vnode = NULL;
 	sem->sems_linked = false;
 	return sem;
 
@@ -131,6 +131,8 @@ semfs_direntry_create(const char *name, unsigned semnum)
 		return NULL;
 	}
 	dent->semd_semnum = semnum;
+	dent->semd_slot = 0;
+	dent->semd_hashnext = NULL;
 	return dent;
 }
 
@@ -143,3 +145,72 @@ semfs_direntry_destroy(struct semfs_direntry *dent)
 	kfree(dent->semd_name);
 	kfree(dent);
 }
+
+/*
+ * Name index. Directory entries are also chained into a hash table
+ * on their names, so looking one up doesn't mean scanning the whole
+ * directory. Protected by the directory lock.
+ */
+static
+unsigned
+semfs_namehash(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name != 0) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % SEMFS_NAMEHASH;
+}
+
+/*
+ * Find the directory entry for NAME, or return NULL.
+ */
+struct semfs_direntry *
+semfs_direntry_find(struct semfs *semfs, const char *name)
+{
+	struct semfs_direntry *dent;
+
+	KASSERT(lock_do_i_hold(semfs->semfs_dirlock));
+	for (dent = semfs->semfs_names[semfs_namehash(name)];
+	     dent != NULL; dent = dent->semd_hashnext) {
+		if (!strcmp(dent->semd_name, name)) {
+			return dent;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a directory entry to the name index.
+ */
+void
+semfs_direntry_hash(struct semfs *semfs, struct semfs_direntry *dent)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(semfs->semfs_dirlock));
+	h = semfs_namehash(dent->semd_name);
+	dent->semd_hashnext = semfs->semfs_names[h];
+	semfs->semfs_names[h] = dent;
+}
+
+/*
+ * Remove a directory entry from the name index.
+ */
+void
+semfs_direntry_unhash(struct semfs *semfs, struct semfs_direntry *dent)
+{
+	struct semfs_direntry **pd;
+
+	KASSERT(lock_do_i_hold(semfs->semfs_dirlock));
+	for (pd = &semfs->semfs_names[semfs_namehash(dent->semd_name)];
+	     *pd != NULL; pd = &(*pd)->semd_hashnext) {
+		if (*pd == dent) {
+			*pd = dent->semd_hashnext;
+			dent->semd_hashnext = NULL;
+			return;
+		}
+	}
+	panic("semfs: direntry %s not in name index\n", dent->semd_name);
+}
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/ioctl.h>
 #include <stat.h>
 #include <uio.h>
 #include <synch.h>
@@ -62,16 +63,6 @@ semfs_eachopen(struct vnode *vn, int openflags)
 	return 0;
 }
 
-static
-int
-semfs_ioctl(struct vnode *vn, int op, userptr_t data)
-{
-	(void)vn;
-	(void)op;
-	(void)data;
-	return EINVAL;
-}
-
 static
 int
 semfs_gettype(struct vnode *vn, mode_t *ret)
@@ -106,10 +97,6 @@ semfs_fsync(struct vnode *vn)
 ////////////////////////////////////////////////////////////
 // semaphore ops
 
-/*
- * XXX fold these two together
- */
-
 static
 struct semfs_sem *
 semfs_getsembynum(struct semfs *semfs, unsigned semnum)
@@ -123,13 +110,17 @@ semfs_getsembynum(struct semfs *semfs, unsigned semnum)
 	return sem;
 }
 
+/*
+ * A semaphore can't be destroyed while it has a vnode (see
+ * semfs_remove and semfs_reclaim), so the vnode keeps a pointer to
+ * it and P and V don't need the table lock.
+ */
 static
 struct semfs_sem *
 semfs_getsem(struct semfs_vnode *semv)
 {
-	struct semfs *semfs = semv->semv_semfs;
-
-	return semfs_getsembynum(semfs, semv->semv_semnum);
+	KASSERT(semv->semv_sem != NULL);
+	return semv->semv_sem;
 }
 
 /*
@@ -181,23 +172,27 @@ semfs_semstat(struct vnode *vn, struct stat *buf)
 }
 
 /*
- * Read. This is P(); decrease the count by the amount read.
- * Don't actually bother to transfer any data.
+ * P(): decrease the count by AMOUNT, waiting as needed.
+ *
+ * If the wait is interrupted (the process is exiting; see
+ * proc_stopthreads) put back whatever we already took and fail
+ * with EINTR.
  */
 static
 int
-semfs_read(struct vnode *vn, struct uio *uio)
+semfs_P(struct semfs_vnode *semv, unsigned amount)
 {
-	struct semfs_vnode *semv = vn->vn_data;
 	struct semfs_sem *sem;
-	size_t consume;
+	unsigned consume, consumed, newcount;
+	int result;
 
 	sem = semfs_getsem(semv);
+	consumed = 0;
 
 	lock_acquire(sem->sems_lock);
-	while (uio->uio_resid > 0) {
+	while (amount > 0) {
 		if (sem->sems_count > 0) {
-			consume = uio->uio_resid;
+			consume = amount;
 			if (consume > sem->sems_count) {
 				consume = sem->sems_count;
 			}
@@ -205,17 +200,23 @@ semfs_read(struct vnode *vn, struct uio *uio)
 			      semv->semv_semnum, sem->sems_count,
 			      sem->sems_count - consume);
 			sem->sems_count -= consume;
-			/* don't bother advancing the uio data pointers */
-			uio->uio_offset += consume;
-			uio->uio_resid -= consume;
+			amount -= consume;
+			consumed += consume;
 		}
-		if (uio->uio_resid == 0) {
+		if (amount == 0) {
 			break;
 		}
 		if (sem->sems_count == 0) {
 			DEBUG(DB_SEMFS, "semfs: sem%u: blocking\n",
 			      semv->semv_semnum);
-			cv_wait(sem->sems_cv, sem->sems_lock);
+			result = cv_wait_intr(sem->sems_cv, sem->sems_lock);
+			if (result) {
+				newcount = sem->sems_count + consumed;
+				semfs_wakeup(sem, newcount);
+				sem->sems_count = newcount;
+				lock_release(sem->sems_lock);
+				return result;
+			}
 		}
 	}
 	lock_release(sem->sems_lock);
@@ -223,38 +224,98 @@ semfs_read(struct vnode *vn, struct uio *uio)
 }
 
 /*
- * Write. This is V(); increase the count by the amount written.
- * Don't actually bother to transfer any data.
+ * V(): increase the count by AMOUNT.
  */
 static
 int
-semfs_write(struct vnode *vn, struct uio *uio)
+semfs_V(struct semfs_vnode *semv, unsigned amount)
 {
-	struct semfs_vnode *semv = vn->vn_data;
 	struct semfs_sem *sem;
 	unsigned newcount;
 
 	sem = semfs_getsem(semv);
 
 	lock_acquire(sem->sems_lock);
-	while (uio->uio_resid > 0) {
-		newcount = sem->sems_count + uio->uio_resid;
-		if (newcount < sem->sems_count) {
-			/* overflow */
-			lock_release(sem->sems_lock);
-			return EFBIG;
-		}
-		DEBUG(DB_SEMFS, "semfs: sem%u: V, count %u -> %u\n",
-		      semv->semv_semnum, sem->sems_count, newcount);
-		semfs_wakeup(sem, newcount);
-		sem->sems_count = newcount;
-		uio->uio_offset += uio->uio_resid;
-		uio->uio_resid = 0;
+	newcount = sem->sems_count + amount;
+	if (newcount < sem->sems_count) {
+		/* overflow */
+		lock_release(sem->sems_lock);
+		return EFBIG;
 	}
+	DEBUG(DB_SEMFS, "semfs: sem%u: V, count %u -> %u\n",
+	      semv->semv_semnum, sem->sems_count, newcount);
+	semfs_wakeup(sem, newcount);
+	sem->sems_count = newcount;
 	lock_release(sem->sems_lock);
 	return 0;
 }
 
+/*
+ * Read. This is P(); decrease the count by the amount read.
+ * Don't actually bother to transfer any data.
+ */
+static
+int
+semfs_read(struct vnode *vn, struct uio *uio)
+{
+	struct semfs_vnode *semv = vn->vn_data;
+	int result;
+
+	result = semfs_P(semv, uio->uio_resid);
+	if (result) {
+		return result;
+	}
+	/* don't bother advancing the uio data pointers */
+	uio->uio_offset += uio->uio_resid;
+	uio->uio_resid = 0;
+	return 0;
+}
+
+/*
+ * Write. This is V(); increase the count by the amount written.
+ * Don't actually bother to transfer any data.
+ */
+static
+int
+semfs_write(struct vnode *vn, struct uio *uio)
+{
+	struct semfs_vnode *semv = vn->vn_data;
+	int result;
+
+	result = semfs_V(semv, uio->uio_resid);
+	if (result) {
+		return result;
+	}
+	uio->uio_offset += uio->uio_resid;
+	uio->uio_resid = 0;
+	return 0;
+}
+
+/*
+ * Ioctl. SEMIOC_P and SEMIOC_V do P and V without the cost of a
+ * read or write call. The argument is the count itself rather than
+ * a pointer to it, so there's nothing to copy in either.
+ */
+static
+int
+semfs_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	struct semfs_vnode *semv = vn->vn_data;
+	unsigned amount = (vaddr_t)data;
+
+	if (semv->semv_semnum == SEMFS_ROOTDIR) {
+		return EINVAL;
+	}
+
+	switch (op) {
+	    case SEMIOC_P:
+		return semfs_P(semv, amount);
+	    case SEMIOC_V:
+		return semfs_V(semv, amount);
+	}
+	return EINVAL;
+}
+
 /*
  * Truncate. Set the count to the specified value.
  *
@@ -378,7 +439,7 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
 	struct semfs_sem *sem;
-	unsigned i, num, empty, semnum;
+	unsigned semnum;
 	int result;
 
 	(void)mode;
@@ -387,27 +448,15 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	empty = num;
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			if (empty == num) {
-				empty = i;
-			}
-			continue;
-		}
-		if (!strcmp(dent->semd_name, name)) {
-			/* found */
-			if (excl) {
-				lock_release(semfs->semfs_dirlock);
-				return EEXIST;
-			}
-			result = semfs_getvnode(semfs, dent->semd_semnum,
-						resultvn);
+	dent = semfs_direntry_find(semfs, name);
+	if (dent != NULL) {
+		if (excl) {
 			lock_release(semfs->semfs_dirlock);
-			return result;
+			return EEXIST;
 		}
+		result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
+		lock_release(semfs->semfs_dirlock);
+		return result;
 	}
 
 	/* create it */
@@ -425,19 +474,16 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 
 	dent = semfs_direntry_create(name, semnum);
 	if (dent == NULL) {
+		result = ENOMEM;
 		goto fail_uninsert;
 	}
 
-	if (empty < num) {
-		semfs_direntryarray_set(semfs->semfs_dents, empty, dent);
-	}
-	else {
-		result = semfs_direntryarray_add(semfs->semfs_dents, dent,
-						 &empty);
-		if (result) {
-			goto fail_undent;
-		}
+	result = semfs_direntryarray_add(semfs->semfs_dents, dent,
+					 &dent->semd_slot);
+	if (result) {
+		goto fail_undent;
 	}
+	semfs_direntry_hash(semfs, dent);
 
 	result = semfs_getvnode(semfs, semnum, resultvn);
 	if (result) {
@@ -449,7 +495,8 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	return 0;
 
  fail_undir:
-	semfs_direntryarray_set(semfs->semfs_dents, empty, NULL);
+	semfs_direntry_unhash(semfs, dent);
+	semfs_direntryarray_setsize(semfs->semfs_dents, dent->semd_slot);
  fail_undent:
 	semfs_direntry_destroy(dent);
  fail_uninsert:
@@ -473,49 +520,48 @@ semfs_remove(struct vnode *dirvn, const char *name)
 {
 	struct semfs_vnode *dirsemv = dirvn->vn_data;
 	struct semfs *semfs = dirsemv->semv_semfs;
-	struct semfs_direntry *dent;
+	struct semfs_direntry *dent, *last;
 	struct semfs_sem *sem;
-	unsigned i, num;
-	int result;
+	unsigned num;
 
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EINVAL;
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(name, dent->semd_name)) {
-			/* found */
-			sem = semfs_getsembynum(semfs, dent->semd_semnum);
-			lock_acquire(sem->sems_lock);
-			KASSERT(sem->sems_linked);
-			sem->sems_linked = false;
-			if (sem->sems_hasvnode == false) {
-				lock_acquire(semfs->semfs_tablelock);
-				semfs_semarray_set(semfs->semfs_sems,
-						   dent->semd_semnum, NULL);
-				lock_release(semfs->semfs_tablelock);
-				lock_release(sem->sems_lock);
-				semfs_sem_destroy(sem);
-			}
-			else {
-				lock_release(sem->sems_lock);
-			}
-			semfs_direntryarray_set(semfs->semfs_dents, i, NULL);
-			semfs_direntry_destroy(dent);
-			result = 0;
-			goto out;
-		}
+	dent = semfs_direntry_find(semfs, name);
+	if (dent == NULL) {
+		lock_release(semfs->semfs_dirlock);
+		return ENOENT;
+	}
+
+	sem = semfs_getsembynum(semfs, dent->semd_semnum);
+	lock_acquire(sem->sems_lock);
+	KASSERT(sem->sems_linked);
+	sem->sems_linked = false;
+	if (sem->sems_vnode == NULL) {
+		lock_acquire(semfs->semfs_tablelock);
+		semfs_semarray_set(semfs->semfs_sems,
+				   dent->semd_semnum, NULL);
+		lock_release(semfs->semfs_tablelock);
+		lock_release(sem->sems_lock);
+		semfs_sem_destroy(sem);
 	}
-	result = ENOENT;
- out:
+	else {
+		lock_release(sem->sems_lock);
+	}
+
+	/* Fill the hole with the last entry, so there are no holes. */
+	semfs_direntry_unhash(semfs, dent);
+	num = semfs_direntryarray_num(semfs->semfs_dents);
+	last = semfs_direntryarray_get(semfs->semfs_dents, num - 1);
+	semfs_direntryarray_set(semfs->semfs_dents, dent->semd_slot, last);
+	last->semd_slot = dent->semd_slot;
+	semfs_direntryarray_setsize(semfs->semfs_dents, num - 1);
+	semfs_direntry_destroy(dent);
+
 	lock_release(semfs->semfs_dirlock);
-	return result;
+	return 0;
 }
 
 /*
@@ -528,7 +574,6 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 	struct semfs_vnode *dirsemv = dirvn->vn_data;
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
-	unsigned i, num;
 	int result;
 
 	if (!strcmp(path, ".") || !strcmp(path, "..")) {
@@ -538,21 +583,15 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 	}
 
 	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(path, dent->semd_name)) {
-			result = semfs_getvnode(semfs, dent->semd_semnum,
-						resultvn);
-			lock_release(semfs->semfs_dirlock);
-			return result;
-		}
+	dent = semfs_direntry_find(semfs, path);
+	if (dent == NULL) {
+		result = ENOENT;
+	}
+	else {
+		result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
 	}
 	lock_release(semfs->semfs_dirlock);
-	return ENOENT;
+	return result;
 }
 
 /*
@@ -627,9 +666,9 @@ semfs_reclaim(struct vnode *vn)
 	}
 
 	if (semv->semv_semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semv->semv_semnum);
-		KASSERT(sem->sems_hasvnode);
-		sem->sems_hasvnode = false;
+		sem = semv->semv_sem;
+		KASSERT(sem->sems_vnode == semv);
+		sem->sems_vnode = NULL;
 		if (sem->sems_linked == false) {
 			semfs_semarray_set(semfs->semfs_sems,
 					   semv->semv_semnum, NULL);
@@ -716,7 +755,8 @@ static const struct vnode_ops semfs_semops = {
  */
 static
 struct semfs_vnode *
-semfs_vnode_create(struct semfs *semfs, unsigned semnum)
+semfs_vnode_create(struct semfs *semfs, unsigned semnum,
+		   struct semfs_sem *sem)
 {
 	const struct vnode_ops *optable;
 	struct semfs_vnode *semv;
@@ -736,6 +776,7 @@ semfs_vnode_create(struct semfs *semfs, unsigned semnum)
 
 	semv->semv_semfs = semfs;
 	semv->semv_semnum = semnum;
+	semv->semv_sem = sem;
 
 	result = vnode_init(&semv->semv_absvn, optable,
 			    &semfs->semfs_absfs, semv);
@@ -761,21 +802,35 @@ semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 	/* Lock the vnode table */
 	lock_acquire(semfs->semfs_tablelock);
 
-	/* Look for it */
-	num = vnodearray_num(semfs->semfs_vnodes);
-	for (i=0; i<num; i++) {
-		vn = vnodearray_get(semfs->semfs_vnodes, i);
-		semv = vn->vn_data;
-		if (semv->semv_semnum == semnum) {
-			VOP_INCREF(vn);
-			lock_release(semfs->semfs_tablelock);
-			*ret = vn;
-			return 0;
+	/* Look for it: semaphores point to theirs; search for the root */
+	sem = NULL;
+	semv = NULL;
+	if (semnum != SEMFS_ROOTDIR) {
+		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
+		KASSERT(sem != NULL);
+		semv = sem->sems_vnode;
+	}
+	else {
+		num = vnodearray_num(semfs->semfs_vnodes);
+		for (i=0; i<num; i++) {
+			vn = vnodearray_get(semfs->semfs_vnodes, i);
+			if (((struct semfs_vnode *)vn->vn_data)->semv_semnum ==
+			    SEMFS_ROOTDIR) {
+				semv = vn->vn_data;
+				break;
+			}
 		}
 	}
+	if (semv != NULL) {
+		vn = &semv->semv_absvn;
+		VOP_INCREF(vn);
+		lock_release(semfs->semfs_tablelock);
+		*ret = vn;
+		return 0;
+	}
 
 	/* Make it */
-	semv = semfs_vnode_create(semfs, semnum);
+	semv = semfs_vnode_create(semfs, semnum, sem);
 	if (semv == NULL) {
 		lock_release(semfs->semfs_tablelock);
 		return ENOMEM;
@@ -786,11 +841,8 @@ semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 		lock_release(semfs->semfs_tablelock);
 		return ENOMEM;
 	}
-	if (semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-		KASSERT(sem != NULL);
-		KASSERT(sem->sems_hasvnode == false);
-		sem->sems_hasvnode = true;
+	if (sem != NULL) {
+		sem->sems_vnode = semv;
 	}
 	lock_release(semfs->semfs_tablelock);
 
@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -67,10 +68,15 @@ struct addrspace {
 #else
         /* Put stuff here for your VM system */
         paddr_t ***pt;
+        struct lock *as_lock;        /* for pt and regions; see vm_fault */
         // vaddr_t stack;
         // vaddr_t heap_start;
         // vaddr_t heap_end;
         struct region *regions;
+        struct addrspace *reap_next; /* on the reaper's list */
+        unsigned as_id;              /* never reused; see as_activate */
+        uint32_t as_cpumask;         /* cpus that may have it in the TLB */
+        struct spinlock as_cpulock;  /* for as_cpumask */
 #endif
 };
 
@@ -97,6 +103,8 @@ struct addrspace {
  *
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
+ *                The memory is actually freed later by the reaper
+ *                thread, which as_reaper_bootstrap starts.
  *
  *    as_define_region - set up a region of memory within the address
  *                space.
@@ -111,6 +119,15 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_threadstack - set up the user stack for thread slot
+ *                SLOT of a multithreaded process (see proc.h) and
+ *                hand back its initial stack pointer. Slot 0 is the
+ *                stack from as_define_stack.
+ *
+ *    as_remove_threadstack - remove the user stack for slot SLOT,
+ *                flushing it from every cpu's TLB before its memory
+ *                is reused.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -120,6 +137,7 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_reaper_bootstrap(void);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
@@ -129,6 +147,9 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_threadstack(struct addrspace *as, unsigned slot,
+                                        vaddr_t *initstackptr);
+void              as_remove_threadstack(struct addrspace *as, unsigned slot);
 
 
 /*
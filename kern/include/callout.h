@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _CALLOUT_H_
+#define _CALLOUT_H_
+
+/*
+ * Callouts: functions to be called from the clock interrupt some
+ * number of hardclocks in the future.
+ *
+ * The caller owns the struct callout (it is usually embedded in some
+ * other structure, or on the stack) and initializes it once with
+ * callout_init. After that it may be scheduled and stopped any
+ * number of times, but must not be freed while pending or running;
+ * callout_stop guarantees neither is true when it returns.
+ *
+ * The function is called in interrupt context, with no locks held,
+ * so it may not sleep. It may reschedule its own callout.
+ */
+
+struct callout {
+	struct callout *co_next;	/* Link in wheel slot */
+	struct callout **co_prevp;	/* Pointer to us in wheel slot */
+	uint32_t co_when;		/* Tick at which to fire */
+	bool co_pending;		/* True while on the wheel */
+	void (*co_func)(void *);	/* Function to call */
+	void *co_arg;			/* Argument for it */
+};
+
+/* The longest delay, in ticks, that can be scheduled directly. */
+#define CALLOUT_MAXTICKS	((1U << 24) - 1)
+
+/* Setup. Called from boot() on the boot cpu. */
+void callout_bootstrap(void);
+
+/* Set the function and argument. */
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+
+/*
+ * Arrange for the callout to fire on the TICKSth hardclock from now
+ * (1 <= TICKS <= CALLOUT_MAXTICKS). If it was already pending, it is
+ * rescheduled.
+ */
+void callout_schedule(struct callout *co, unsigned ticks);
+
+/*
+ * Cancel the callout. Returns true if it was pending (and therefore
+ * now won't fire), false if it had already fired or was never
+ * scheduled. If the function is running on another cpu, waits for
+ * it to finish. Must not be called from the callout's own function.
+ */
+bool callout_stop(struct callout *co);
+
+/* Convert a time in nanoseconds to ticks, rounding up. */
+unsigned callout_nstoticks(uint64_t ns);
+
+/* Current value of the tick counter that drives the wheel. */
+uint32_t callout_now(void);
+
+/*
+ * Called from hardclock() on every cpu. On the cpu that owns the
+ * wheel, advances it one tick and runs whatever has come due.
+ */
+void callout_hardclock(void);
+
+/*
+ * Returns true if the current cpu must keep its clock ticking while
+ * idle because callouts are pending on its wheel.
+ */
+bool callout_needtick(void);
+
+
+#endif /* _CALLOUT_H_ */
@@ -59,6 +59,13 @@ void timerclock(void);
  */
 void gettime(struct timespec *ret);
 
+/*
+ * gettime_ns() returns the same thing in nanoseconds, for timing
+ * intervals. Unlike gettime() it may be called before the clock has
+ * been found; it returns 0 until then.
+ */
+uint64_t gettime_ns(void);
+
 /*
  * arithmetic on times
  *
@@ -79,5 +86,18 @@ void timespec_sub(const struct timespec *t1,
  */
 void clocksleep(int seconds);
 
+/*
+ * thread_sleep_ns() suspends execution for at least the requested
+ * number of nanoseconds, rounded up to whole hardclocks.
+ */
+void thread_sleep_ns(uint64_t ns);
+
+/*
+ * thread_sleep_ns_intr() is the same, but interruptible: if the
+ * thread is interrupted it returns EINTR early and sets *left to the
+ * time still to go. Otherwise it returns 0.
+ */
+int thread_sleep_ns_intr(uint64_t ns, uint64_t *left);
+
 
 #endif /* _CLOCK_H_ */
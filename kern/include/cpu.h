@@ -32,9 +32,15 @@
 
 
 #include <spinlock.h>
+#include <ticketlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct wchan;
+
+/* Number of scheduling priority levels; 0 is the highest. */
+#define NPRIORITIES 4
+
 
 /*
  * Per-cpu structure
@@ -59,16 +65,36 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct wchan *c_reaperwchan;	/* Where the reaper thread sleeps */
+	struct spinlock c_reaperlock;	/* Goes with c_reaperwchan */
+	bool c_reaperidle;		/* Reaper is asleep */
+	struct threadlist c_misplaced;	/* Threads to send to other cpus */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	bool c_resched;			/* IPI_RESCHED received */
+	vaddr_t c_intrpc;		/* PC interrupted by current irq */
+	bool c_intruser;		/* ... and whether in user mode */
+	uint64_t c_acctstamp;		/* When curthread was last charged */
+	uint64_t c_idletime;		/* Nanoseconds spent idle */
+	unsigned c_tlbasid;		/* Address space the TLB holds (VM) */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * There is one run queue per priority level; see the
+	 * scheduler notes in thread.c.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
-	struct spinlock c_runqueue_lock;
+	struct threadlist c_runqueue[NPRIORITIES]; /* Run queues */
+	struct ticketlock c_runqueue_lock;
+
+	/*
+	 * Accessed by other cpus (reclaim drains it).
+	 * Protected by the thread cache lock.
+	 */
+	struct threadlist c_threadcache; /* Dead threads kept for reuse */
+	struct spinlock c_threadcachelock;
 
 	/*
 	 * Accessed by other cpus.
@@ -82,10 +108,19 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * If more than TLBSHOOTDOWN_MAX would be queued, the queue is
+	 * dropped and c_shootdown_all set instead: the CPU flushes
+	 * its whole TLB. c_shootdown_seq counts the batches of
+	 * requests queued; the CPU sets c_shootdown_done to it once
+	 * it has done them, so senders can wait for the work.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	bool c_shootdown_all;		/* Queue overflowed; flush it all */
+	unsigned c_shootdown_seq;	/* Batches queued so far */
+	volatile unsigned c_shootdown_done; /* Batches done (not locked) */
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -94,6 +129,12 @@ struct cpu {
 	HANGMAN_ACTOR(c_hangman);
 };
 
+/*
+ * CPU masks, for thread affinity: one bit per cpu number.
+ */
+#define CPUMASK_CPU(n)	((uint32_t)1 << (n))
+#define CPUMASK_ALL	((uint32_t)0xffffffff)
+
 /*
  * Initialization functions.
  *
@@ -102,12 +143,15 @@ struct cpu {
  *
  * cpu_create calls cpu_machdep_init.
  *
+ * cpu_count returns the number of cpus that have been created.
+ *
  * cpu_start_secondary is the platform-dependent assembly language
  * entry point for new CPUs; it can be found in start.S. It calls
  * cpu_hatch after having claimed the startup stack and thread created
  * for the cpu.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+unsigned cpu_count(void);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
@@ -155,6 +199,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_sync does the N shootdowns in MAPPINGS on every
+ * CPU in MASK (including the current one, if it is in MASK) and
+ * waits until they have all been done.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,10 +212,13 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_RESCHED		4	/* Higher-priority thread is ready */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_sync(uint32_t mask,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
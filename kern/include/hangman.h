@@ -33,37 +33,83 @@
 /*
  * Simple deadlock detector. Enable with "options hangman" in the
  * kernel config.
+ *
+ * With "options lockprof" as well, the same hooks also keep wait
+ * and hold times and contention counts for each place locks are
+ * acquired from; see hangman.c.
  */
 
 #include "opt-hangman.h"
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF && !OPT_HANGMAN
+#error "options lockprof requires options hangman"
+#endif
 
 #if OPT_HANGMAN
 
 struct hangman_actor {
 	const char *a_name;
 	const struct hangman_lockable *a_waiting;
+#if OPT_LOCKPROF
+	uint64_t a_waitstart;		/* when we began waiting, or 0 */
+	const void *a_waitsite;		/* who we're waiting on behalf of */
+	bool a_contended;		/* the lock was held at that point */
+#endif
 };
 
 struct hangman_lockable {
 	const char *l_name;
 	const struct hangman_actor *l_holding;
+#if OPT_LOCKPROF
+	uint64_t l_holdstart;		/* when it was acquired, or 0 */
+	const void *l_holdsite;		/* where it was acquired */
+#endif
 };
 
-void hangman_wait(struct hangman_actor *a, struct hangman_lockable *l);
+void hangman_wait(struct hangman_actor *a, struct hangman_lockable *l,
+		  const void *site);
 void hangman_acquire(struct hangman_actor *a, struct hangman_lockable *l);
 void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
+void hangman_acquire_shared(struct hangman_actor *a,
+			    struct hangman_lockable *l);
 
 #define HANGMAN_ACTOR(sym)	struct hangman_actor sym
 #define HANGMAN_LOCKABLE(sym)	struct hangman_lockable sym
 
+#if OPT_LOCKPROF
+#define HANGMAN_ACTORINIT(a, n)	    ((a)->a_name = (n), (a)->a_waiting = NULL, \
+				     (a)->a_waitstart = 0, \
+				     (a)->a_waitsite = NULL, \
+				     (a)->a_contended = false)
+#define HANGMAN_LOCKABLEINIT(l, n)  ((l)->l_name = (n), (l)->l_holding = NULL, \
+				     (l)->l_holdstart = 0, \
+				     (l)->l_holdsite = NULL)
+#else
 #define HANGMAN_ACTORINIT(a, n)	    ((a)->a_name = (n), (a)->a_waiting = NULL)
 #define HANGMAN_LOCKABLEINIT(l, n)  ((l)->l_name = (n), (l)->l_holding = NULL)
+#endif
 
-#define HANGMAN_LOCKABLE_INITIALIZER	{ "spinlock", NULL }
+#define HANGMAN_LOCKABLE_INITIALIZER	{ .l_name = "spinlock", \
+					  .l_holding = NULL }
 
-#define HANGMAN_WAIT(a, l)	hangman_wait(a, l)
+/* Used in the lock functions; the site is whoever called them. */
+#define HANGMAN_WAIT(a, l)	hangman_wait(a, l, \
+					     __builtin_return_address(0))
 #define HANGMAN_ACQUIRE(a, l)	hangman_acquire(a, l)
 #define HANGMAN_RELEASE(a, l)	hangman_release(a, l)
+#define HANGMAN_ACQUIRE_SHARED(a, l)	hangman_acquire_shared(a, l)
+
+#if OPT_LOCKPROF
+/*
+ * Lock profiler control. Profiling is off until lockprof_enable is
+ * called; lockprof_reset clears the numbers; lockprof_dump prints
+ * the most contended call sites (all of them if ALL is true).
+ */
+void lockprof_enable(bool on);
+void lockprof_reset(void);
+void lockprof_dump(bool all);
+#endif
 
 #else
 
@@ -78,6 +124,7 @@ void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
 #define HANGMAN_WAIT(a, l)
 #define HANGMAN_ACQUIRE(a, l)
 #define HANGMAN_RELEASE(a, l)
+#define HANGMAN_ACQUIRE_SHARED(a, l)
 
 #endif
 
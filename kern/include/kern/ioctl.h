@@ -34,6 +34,8 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/* semfs: P or V a semaphore; the argument is the count, not a pointer */
+#define SEMIOC_P	1
+#define SEMIOC_V	2
 
 #endif /* _KERN_IOCTL_H_*/
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2004, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KERN_PROF_H_
+#define _KERN_PROF_H_
+
+/*
+ * Definitions for the sampling profiler (profctl()).
+ *
+ * While profiling is on, every cpu records on each clock tick what
+ * it was doing when the tick arrived. PROF_READ copies out, and
+ * removes, the samples collected so far.
+ */
+
+/* Operations for profctl() */
+#define PROF_START	0	/* start sampling */
+#define PROF_STOP	1	/* stop sampling */
+#define PROF_READ	2	/* read samples into a buffer */
+
+struct profsample {
+	__u32 ps_pc;		/* interrupted program counter */
+	__pid_t ps_pid;		/* process that was running */
+	__u16 ps_cpu;		/* cpu number */
+	__u16 ps_flags;		/* see below */
+};
+
+/* Bits for ps_flags */
+#define PROF_USER	1	/* ps_pc is a user address */
+
+#endif /* _KERN_PROF_H_ */
@@ -86,7 +86,7 @@
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
 //#define SYS_wait4      34
-//#define SYS_getrusage  35
+#define SYS_getrusage   35
 //                              (resource limits)
 //#define SYS_getrlimit  36
 //#define SYS_setrlimit  37
@@ -196,6 +196,13 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS_setaffinity  121
+#define SYS_profctl      122
+#define SYS___threadfork 123
+#define SYS_threadjoin   124
+#define SYS_threadexit   125
+#define SYS_futex_wait   126
+#define SYS_futex_wake   127
 
 /*CALLEND*/
 
@@ -125,6 +125,10 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * kheap_profdump does nothing unless the kmprof option is enabled.
+ *
+ * kheap_getpages reports the number of pages held by the subpage
+ * allocator, currently and at peak; kheap_resetpeak resets the peak.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +136,9 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_profdump(bool all);
+void kheap_getpages(unsigned *curpages, unsigned *peakpages);
+void kheap_resetpeak(void);
 
 /*
  * C string functions.
@@ -55,6 +55,12 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Stop (if IDLE is true) or restart the current cpu's hardclock
+ * timer. Used to avoid taking clock ticks on idle cpus.
+ */
+void mainbus_idle_timer(bool idle);
+
 /* Request breaking into the debugger, where available. */
 void mainbus_debugger(void);
 
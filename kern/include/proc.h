@@ -42,6 +42,17 @@
 struct addrspace;
 struct vnode;
 
+/*
+ * User-level threads. Each thread of a process has a slot, which
+ * is its thread id and also picks its user stack (see
+ * as_define_threadstack). The first thread has slot 0.
+ */
+#define PROC_MAXTHREADS	16
+
+#define PT_FREE		0	/* slot unused */
+#define PT_RUNNING	1	/* thread alive */
+#define PT_EXITED	2	/* thread gone, not yet joined */
+
 /*
  * Process structure.
  *
@@ -50,14 +61,26 @@ struct vnode;
  *
  * Note: you can't protect p_threads with a spinlock because it needs
  * to be able to call kmalloc.
+ *
+ * p_threadslock also protects p_stopping and p_tslots, and goes with
+ * p_threadcv, which is signalled whenever a thread leaves.
  */
 struct proc {
 	char *p_name;			/* Name of this process */
 	struct lock *p_threadslock;	/* Lock for p_threads */
 	struct threadarray p_threads;	/* Threads in this process */
+	struct cv *p_threadcv;		/* Signalled when a thread leaves */
+	bool p_stopping;		/* Other threads must leave (exit/exec) */
+	uint8_t p_tslots[PROC_MAXTHREADS]; /* PT_* state of thread slots */
 	struct spinlock p_lock;		/* Lock for rest of this structure */
 	pid_t p_pid;			/* Process ID */
 
+	/* CPU time, in nanoseconds (see thread_charge) */
+	uint64_t p_utime;		/* user time of departed threads */
+	uint64_t p_stime;		/* kernel time of departed threads */
+	uint64_t p_cutime;		/* user time of waited-for children */
+	uint64_t p_cstime;		/* kernel time of waited-for children */
+
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
 
@@ -68,6 +91,16 @@ struct proc {
 	/* add more material here as needed */
 };
 
+/*
+ * Array of processes.
+ */
+#ifndef PROCINLINE
+#define PROCINLINE INLINE
+#endif
+
+DECLARRAY(proc, PROCINLINE);
+DEFARRAY(proc, PROCINLINE);
+
 /* This is the process structure for the kernel and for kernel-only threads. */
 extern struct proc *kproc;
 
@@ -101,6 +134,44 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/*
+ * User-level threads of the current process.
+ *
+ * proc_newthread allocates a slot and user stack for a new thread;
+ * proc_unnewthread gives them back if the thread couldn't be started.
+ *
+ * proc_threadjoin waits for the thread in slot TID to exit.
+ *
+ * proc_threadexit makes the current thread leave its process, which
+ * exits (with status 0) if it was the last. It also gets called on
+ * the way back to user mode by threads told to leave because another
+ * thread is exiting or execing.
+ *
+ * proc_stopthreads makes the current thread the only one in its
+ * process, failing with EINTR if another thread is already doing so.
+ * proc_threadexec makes it thread 0 once exec has loaded a new image.
+ */
+int proc_newthread(unsigned *tid, vaddr_t *stackptr);
+void proc_unnewthread(unsigned tid);
+int proc_threadjoin(unsigned tid);
+__DEAD void proc_threadexit(void);
+int proc_stopthreads(void);
+void proc_threadexec(void);
+
+/* Restrict a process's threads to the cpus in MASK. */
+int proc_setaffinity(struct proc *proc, uint32_t mask);
+
+/*
+ * Get the CPU time used by a process so far: its own if WHO is
+ * RUSAGE_SELF, or that of the children it has waited for if WHO is
+ * RUSAGE_CHILDREN.
+ */
+void proc_gettimes(struct proc *proc, int who,
+		   uint64_t *utime, uint64_t *stime);
+
+/* Print all processes and their threads, with their CPU times. */
+void proc_printall(void);
+
 /* Fetch the address space of the current process. */
 struct addrspace *proc_getas(void);
 
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PROF_H_
+#define _PROF_H_
+
+/*
+ * Sampling profiler.
+ *
+ * prof_hardclock is called from hardclock() and records a sample if
+ * profiling is on. Samples go into a ring buffer for each cpu; if a
+ * buffer fills up before anyone reads it, the oldest samples are
+ * overwritten.
+ *
+ * prof_start	Start sampling. Allocates the buffers the first time.
+ * prof_stop	Stop sampling. Samples already taken stay until read.
+ * prof_read	Remove up to MAX samples, oldest first for each cpu,
+ *		and return the number copied.
+ * prof_dump	Read all the samples and print where the time went.
+ *
+ * The interrupted PC and mode are left in the cpu structure by the
+ * machine-dependent interrupt code; see c_intrpc.
+ */
+
+#include <kern/prof.h>
+
+void prof_hardclock(void);
+int prof_start(void);
+void prof_stop(void);
+unsigned prof_read(struct profsample *buf, unsigned max);
+void prof_dump(void);
+
+#endif /* _PROF_H_ */
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SCHEDTRACE_H_
+#define _SCHEDTRACE_H_
+
+/*
+ * Scheduler tracing. Enable with "options schedtrace" in the kernel
+ * config.
+ *
+ * While tracing is on, the scheduler records context switches,
+ * wakeups, migrations, run queue changes, and IPIs (including TLB
+ * shootdowns), with the time, in a ring buffer
+ * belonging to the cpu where they happen. As with the profiler, if a
+ * buffer fills up before anyone reads it the oldest events are
+ * overwritten and counted as lost.
+ *
+ * The events can be printed from the menu ("strace"), or read as
+ * text, oldest first, from the device "trace:"; reading consumes
+ * them. With mirroring turned on each event is also passed to
+ * ltrace_debug, so a trace161 log shows it in line with everything
+ * else.
+ *
+ * schedtrace_start	Start tracing. Allocates the buffers the first time.
+ * schedtrace_stop	Stop tracing. Events stay until read.
+ * schedtrace_mirror	Turn mirroring to ltrace on or off.
+ * schedtrace_dump	Print and discard all the events.
+ * schedtrace_bootstrap	Create the trace: device.
+ *
+ * SCHEDTRACE(type, a1, a2, a3) records an event; it checks whether
+ * tracing is on before calling anything, and compiles to nothing
+ * without the option.
+ */
+
+#include "opt-schedtrace.h"
+
+/* Event types, and what the arguments are. */
+#define SCHEDTRACE_SWITCH	0	/* old thread, new thread, old state */
+#define SCHEDTRACE_WAKEUP	1	/* thread, cpu, priority */
+#define SCHEDTRACE_MIGRATE	2	/* thread, from cpu, to cpu */
+#define SCHEDTRACE_IPISEND	3	/* target cpu, ipi code, shootdowns */
+#define SCHEDTRACE_IPIRECV	4	/* pending ipi bits, -, - */
+#define SCHEDTRACE_ENQUEUE	5	/* thread, cpu, run queue length */
+#define SCHEDTRACE_DEQUEUE	6	/* thread, cpu, run queue length */
+#define SCHEDTRACE_NTYPES	7
+
+#if OPT_SCHEDTRACE
+
+extern volatile bool schedtrace_on;
+
+void schedtrace_record(unsigned type, uint32_t a1, uint32_t a2, uint32_t a3);
+int schedtrace_start(void);
+void schedtrace_stop(void);
+void schedtrace_mirror(bool on);
+void schedtrace_dump(void);
+void schedtrace_bootstrap(void);
+
+#define SCHEDTRACE(type, a1, a2, a3) \
+	(schedtrace_on ? schedtrace_record(type, (uint32_t)(uintptr_t)(a1), \
+					   (uint32_t)(uintptr_t)(a2), \
+					   (uint32_t)(uintptr_t)(a3)) \
+		       : (void)0)
+
+#else
+
+#define schedtrace_bootstrap()		((void)0)
+#define SCHEDTRACE(type, a1, a2, a3)	((void)0)
+
+#endif
+
+#endif /* _SCHEDTRACE_H_ */
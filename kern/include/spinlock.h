@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include "opt-spinstats.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -59,16 +60,26 @@ struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
+#if OPT_SPINSTATS
+	/* Contention statistics. Updated only while holding the lock. */
+	unsigned splk_acquires;		    /* Times acquired. */
+	unsigned splk_contended;	    /* Times we had to wait. */
+	unsigned splk_spins;		    /* Failed attempts while waiting. */
+	bool splk_listed;		    /* In the contended-lock table. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * Anything not mentioned (the statistics) starts out zero.
  */
-#ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#if OPT_HANGMAN
+#define SPINLOCK_INITIALIZER	{ .splk_lock = SPINLOCK_DATA_INITIALIZER, \
+				  .splk_holder = NULL, \
+				  .splk_hangman = HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ .splk_lock = SPINLOCK_DATA_INITIALIZER, \
+				  .splk_holder = NULL }
 #endif
 
 /*
@@ -81,6 +92,9 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print the locks that have been contended, most contended
+ *		first. Does nothing unless the spinstats option is enabled.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -91,5 +105,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_printstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
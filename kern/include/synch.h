@@ -62,6 +62,19 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * P_timeout is P but gives up if the count stays zero for NS
+ * nanoseconds (rounded up to whole hardclocks). Returns 0 on success
+ * and ETIMEDOUT on timeout; with NS of 0 it never waits.
+ */
+int P_timeout(struct semaphore *, uint64_t ns);
+
+/*
+ * P_intr is P but gives up with EINTR if the thread is interrupted
+ * (see thread_interrupt). Returns 0 on success.
+ */
+int P_intr(struct semaphore *);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -78,6 +91,13 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+        unsigned lk_waiters;            /* threads asleep for it */
+        bool lk_lent;                   /* holder has our waiters' priority */
+        /* statistics, protected by lk_lock */
+        unsigned lk_acquires;           /* times acquired */
+        unsigned lk_contended;          /* ...when already held */
+        unsigned lk_slept;              /* ...and we had to sleep */
+        unsigned lk_spins;              /* spin iterations waiting */
 };
 
 struct lock *lock_create(const char *name);
@@ -98,6 +118,16 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * A thread that finds the lock held spins while the holder is running
+ * on another cpu, and sleeps otherwise (or if it has spun too long).
+ *
+ *    lock_printstats  - Print the lock's contention counters.
+ *    lock_printtotals - Print contention totals over all locks.
+ */
+void lock_printstats(struct lock *);
+void lock_printtotals(void);
+
 
 /*
  * Condition variable.
@@ -129,6 +159,15 @@ void cv_destroy(struct cv *);
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
  *
+ *    cv_wait_timeout is cv_wait, but also wakes up after NS nanoseconds
+ *    (rounded up to whole hardclocks) if not signalled. It returns
+ *    ETIMEDOUT if the time ran out and 0 otherwise; the lock is held
+ *    again on return either way.
+ *
+ *    cv_wait_intr is cv_wait, but returns EINTR if the thread is
+ *    interrupted (see thread_interrupt) and 0 otherwise; again the
+ *    lock is held on return either way.
+ *
  * For all three operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
@@ -136,8 +175,61 @@ void cv_destroy(struct cv *);
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_wait_timeout(struct cv *cv, struct lock *lock, uint64_t ns);
+int cv_wait_intr(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads may hold the lock for reading at once, or one
+ * thread for writing. Waiting writers are preferred over new readers,
+ * but readers already waiting when a writer releases the lock go
+ * before the next writer, so neither side can starve.
+ *
+ * Readers are not tracked individually, so the deadlock detector can
+ * only see cycles through the writer, and only the writer can be
+ * asserted.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+
+struct rwlock {
+        char *rw_name;
+        HANGMAN_LOCKABLE(rw_hangman);   /* Deadlock detector hook. */
+        struct wchan *rw_readwchan;     /* readers wait here */
+        struct wchan *rw_writewchan;    /* writers wait here */
+        struct spinlock rw_lock;
+        unsigned rw_readers;            /* readers holding the lock */
+        unsigned rw_readwaiting;        /* readers waiting */
+        unsigned rw_writewaiting;       /* writers waiting */
+        unsigned rw_readpass;           /* readers let in ahead of writers */
+        struct thread *rw_writer;       /* writer holding the lock */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Release it after reading.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Release it after writing.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing.
+ *
+ * The lock is not recursive: don't acquire it again, in either mode,
+ * while holding it.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -33,6 +33,7 @@
 
 #include <cdefs.h> /* for __DEAD */
 struct trapframe; /* from <machine/trapframe.h> */
+struct proc; /* from <proc.h> */
 
 /*
  * The system call dispatcher.
@@ -51,9 +52,17 @@ void enter_forked_process(struct trapframe *tf);
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
 
+/* Enter user mode in a new thread of the current process. */
+__DEAD void enter_new_thread(vaddr_t entrypoint, vaddr_t stackptr,
+		       userptr_t arg0, userptr_t arg1);
+
 /* Setup function for exec. */
 void exec_bootstrap(void);
 
+/* Futex setup, and waking a process's futex waiters when it stops. */
+void futex_bootstrap(void);
+void futex_stop(struct proc *proc);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -64,12 +73,22 @@ void exec_bootstrap(void);
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t prog, userptr_t args);
 __DEAD void sys__exit(int code);
 int sys_waitpid(pid_t pid, userptr_t returncode, int flags, pid_t *retval);
 int sys_getpid(pid_t *retval);
+int sys_setaffinity(pid_t pid, uint32_t mask);
+int sys_profctl(int op, userptr_t buf, size_t len, int *retval);
+int sys_getrusage(int who, userptr_t usage);
+int sys___threadfork(userptr_t entry, userptr_t func, userptr_t arg,
+		     int *retval);
+int sys_threadjoin(int tid);
+__DEAD void sys_threadexit(void);
+int sys_futex_wait(userptr_t addr, uint32_t val);
+int sys_futex_wake(userptr_t addr, int n, int *retval);
 
 int sys_open(const_userptr_t filename, int flags, mode_t mode, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
@@ -89,6 +108,7 @@ int sys_link(userptr_t oldpath, userptr_t newpath);
 int sys_rename(userptr_t oldpath, userptr_t newpath);
 int sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval);
 int sys_fstat(int fd, userptr_t statptr);
+int sys_ioctl(int fd, int code, userptr_t data);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
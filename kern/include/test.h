@@ -53,10 +53,12 @@ int threadlisttest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int callouttest(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int pitest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -96,6 +98,11 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmallocbench1(int, char **);
+int kmallocbench2(int, char **);
+int kmallocbench3(int, char **);
+int kmallocbench4(int, char **);
+int spinbench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
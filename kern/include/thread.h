@@ -41,6 +41,8 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
+struct callout;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -84,6 +86,31 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
+	unsigned t_priority;		/* Scheduling level, 0 = highest */
+	unsigned t_ownpriority;		/* Same, not counting loans */
+	unsigned t_quantum;		/* Hardclocks left in time slice */
+	uint64_t t_lastran;		/* gettime_ns() when it last ran */
+	struct wchan *t_wchan;		/* Wait channel, if sleeping */
+	bool t_timedsleep;		/* Sleeping with a callout */
+	uint32_t t_affinity;		/* CPUMASK of cpus it may run on */
+	unsigned t_tid;			/* Thread slot in its process */
+	uint64_t t_utime;		/* Nanoseconds run in user mode */
+	uint64_t t_stime;		/* Nanoseconds run in the kernel */
+
+	/*
+	 * Priority inheritance; see lock_acquire. t_waitlock is
+	 * protected by the lock code's PI spinlock; t_loans, like the
+	 * priorities, by the runqueue lock of t_cpu.
+	 */
+	struct lock *t_waitlock;	/* Lock we're asleep waiting for */
+	unsigned t_loans;		/* Locks held that lent us priority */
+
+	/*
+	 * Interruptible sleeps; see wchan_sleep_intr. Protected by a
+	 * spinlock in thread.c.
+	 */
+	bool t_interrupted;		/* thread_interrupt was called */
+	struct callout *t_intrco;	/* Wakes us, if in wchan_sleep_intr */
 
 	/*
 	 * Interrupt state fields.
@@ -158,6 +185,61 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for a clock tick, and switch to another
+ * thread if its time slice is used up or a higher-priority thread is
+ * waiting. Called from the timer interrupt.
+ */
+void thread_timeslice(void);
+
+/*
+ * Charge the time since the last call to the current thread, as user
+ * time if USER is true and kernel time otherwise. (If the cpu is
+ * idle it goes to the cpu's idle time instead.) Called on the way
+ * into and out of user mode and when switching threads.
+ */
+void thread_charge(bool user);
+
+/*
+ * Print each cpu's idle time.
+ */
+void thread_printidle(void);
+
+/*
+ * Restrict thread T to the cpus in MASK (see CPUMASK_* in cpu.h).
+ * Cpus that don't exist are ignored; if that leaves none, fails with
+ * EINVAL. Threads created later inherit their creator's mask. If T
+ * is the current thread and may no longer use this cpu, it moves
+ * before this returns; other threads move the next time they are
+ * woken or give up a cpu they may no longer use.
+ */
+int thread_setaffinity(struct thread *t, uint32_t mask);
+
+/*
+ * Make T give up waiting: if it's in an interruptible sleep (see
+ * wchan_sleep_intr) it wakes up with EINTR, and any it tries later
+ * fail the same way. There's no undoing this; it's for threads that
+ * have to leave (see proc_stopthreads).
+ */
+void thread_interrupt(struct thread *t);
+
+/*
+ * Priority inheritance, for the lock code. thread_lendpriority
+ * raises T to priority PRIO if that's higher than what it has; if
+ * NEWLOAN is true it also counts a new loan. While T has loans the
+ * scheduler only moves its own level, t_ownpriority.
+ * thread_unlendpriority ends one of the current thread's loans, and
+ * after the last drops it back to its own level.
+ */
+void thread_lendpriority(struct thread *t, unsigned prio, bool newloan);
+void thread_unlendpriority(void);
+
+/*
+ * Switch threads if another cpu has asked us to (with IPI_RESCHED).
+ * Called at the end of interrupt handling.
+ */
+void thread_check_resched(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
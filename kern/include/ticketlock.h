@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TICKETLOCK_H_
+#define _TICKETLOCK_H_
+
+/*
+ * Ticket locks.
+ *
+ * A ticket lock is a spinlock that is granted in the order it was
+ * asked for: each cpu that wants the lock takes the next number from
+ * tl_next, and waits until tl_serving reaches it. Releasing the lock
+ * advances tl_serving. So unlike an ordinary spinlock no cpu can be
+ * starved by others that keep winning the race for the lock word, and
+ * on release only the cpu whose turn it is has anything to do.
+ *
+ * Ticket locks behave like spinlocks otherwise (they are held by
+ * CPUs, disable interrupts, and count in c_spinlocks) and can be used
+ * in place of one for hot locks, except that they can't be handed to
+ * wchan functions.
+ */
+
+#include <spinlock.h>
+
+struct ticketlock {
+	volatile spinlock_data_t tl_next;    /* Next ticket to hand out. */
+	volatile spinlock_data_t tl_serving; /* Ticket that holds the lock. */
+	struct cpu *tl_holder;		     /* CPU holding this lock. */
+	HANGMAN_LOCKABLE(tl_hangman);	     /* Deadlock detector hook. */
+};
+
+/*
+ * Initializer for cases where a ticket lock needs to be static or
+ * global.
+ */
+#if OPT_HANGMAN
+#define TICKETLOCK_INITIALIZER	{ .tl_next = SPINLOCK_DATA_INITIALIZER, \
+				  .tl_serving = SPINLOCK_DATA_INITIALIZER, \
+				  .tl_holder = NULL, \
+				  .tl_hangman = HANGMAN_LOCKABLE_INITIALIZER }
+#else
+#define TICKETLOCK_INITIALIZER	{ .tl_next = SPINLOCK_DATA_INITIALIZER, \
+				  .tl_serving = SPINLOCK_DATA_INITIALIZER, \
+				  .tl_holder = NULL }
+#endif
+
+/*
+ * Ticket lock functions. Same as the spinlock functions.
+ */
+
+void ticketlock_init(struct ticketlock *tl);
+void ticketlock_cleanup(struct ticketlock *tl);
+
+void ticketlock_acquire(struct ticketlock *tl);
+void ticketlock_release(struct ticketlock *tl);
+
+bool ticketlock_do_i_hold(struct ticketlock *tl);
+
+
+#endif /* _TICKETLOCK_H_ */
@@ -54,12 +54,35 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Physical address of a (mapped) user address */
+int vm_translate(struct addrspace *as, vaddr_t va, paddr_t *ret);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Free N separate allocations at once (cheaper than N free_kpages) */
+void free_kpages_batch(const vaddr_t *addrs, unsigned n);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
+void vm_tlbshootdown_all(void);
+
+/* Flush the TLB on this cpu only */
+void vm_tlbflush(void);
+
+/* Drop AS (or N of its pages) from every cpu's TLB; wait until done */
+void vm_tlbshootdown_as(struct addrspace *as);
+void vm_tlbshootdown_pages(struct addrspace *as,
+			   const vaddr_t *vaddrs, unsigned n);
+
+/* Low-memory handling (see reclaim.c) */
+void reclaim_bootstrap(void);
+int reclaim_register(const char *name, unsigned (*func)(unsigned npages));
+void reclaim_check(unsigned freepages);
+unsigned reclaim_direct(unsigned npages);
+bool reclaim_lowmem(void);
+void reclaim_printstats(void);
 
 
 #endif /* _VM_H_ */
@@ -36,6 +36,7 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -66,15 +67,58 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_sleep, but give up after TICKS hardclocks (at least 1)
+ * if nobody wakes us first. Returns 0 if awakened and ETIMEDOUT if
+ * the time ran out. Either way the spinlock is relocked on return.
+ */
+int wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk,
+			unsigned ticks);
+
+/*
+ * Like wchan_sleep, but give up if the thread is interrupted (see
+ * thread_interrupt). Returns 0 if awakened and EINTR if interrupted,
+ * including if it already had been. Either way the spinlock is
+ * relocked on return.
+ */
+int wchan_sleep_intr(struct wchan *wc, struct spinlock *lk);
+
+/*
+ * Both of the above: returns 0 if awakened, ETIMEDOUT if TICKS
+ * hardclocks went by first (none, if TICKS is 0), and EINTR if
+ * interrupted.
+ */
+int wchan_sleep_timeout_intr(struct wchan *wc, struct spinlock *lk,
+			     unsigned ticks);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
  *
+ * wchan_wakeone returns the thread it woke, or NULL if there were
+ * none. That's only safe to look at while still holding the spinlock,
+ * which the thread has to get back before it can go anywhere.
+ *
  * The current implementation is FIFO but this is not promised by the
  * interface.
  */
-void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
+struct thread *wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Return the highest priority (lowest number; see thread.c) of the
+ * threads sleeping on a wait channel, or NPRIORITIES if none. The
+ * associated spinlock should be locked.
+ */
+unsigned wchan_toppriority(struct wchan *wc, struct spinlock *lk);
+
+/*
+ * Move up to MAX threads sleeping on FROM onto TO without waking
+ * them, skipping any in a timed or interruptible sleep. Both
+ * spinlocks should be locked. Returns the number moved.
+ */
+unsigned wchan_requeue(struct wchan *from, struct spinlock *fromlk,
+		       struct wchan *to, struct spinlock *tolk, unsigned max);
+
 
 #endif /* _WCHAN_H_ */
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <spl.h>
 #include <clock.h>
+#include <callout.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -50,6 +51,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <schedtrace.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -113,6 +115,7 @@ boot(void)
 	thread_bootstrap();
 	pid_bootstrap();
 	hardclock_bootstrap();
+	callout_bootstrap();
 	vfs_bootstrap();
 	kheap_nextgeneration();
 
@@ -128,8 +131,11 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	reclaim_bootstrap();
 	kprintf_bootstrap();
 	exec_bootstrap();
+	futex_bootstrap();
+	schedtrace_bootstrap();
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -43,10 +43,14 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <pid.h>
+#include <vm.h>
 #include <syscall.h>
+#include <prof.h>
+#include <schedtrace.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -459,6 +463,141 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+static
+int
+cmd_memstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	reclaim_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lock_printtotals();
+
+	return 0;
+}
+
+static
+int
+cmd_spinstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	spinlock_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printall();
+	thread_printidle();
+
+	return 0;
+}
+
+static
+int
+cmd_prof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		prof_dump();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = prof_start();
+		if (result) {
+			kprintf("prof: %s\n", strerror(result));
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		prof_stop();
+	}
+	else {
+		kprintf("Usage: prof [on|off]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_LOCKPROF
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockprof_dump(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "all")) {
+		lockprof_dump(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockprof_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockprof_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+	}
+	else {
+		kprintf("Usage: lkprof [on|off|reset|all]\n");
+	}
+
+	return 0;
+}
+#endif
+
+#if OPT_SCHEDTRACE
+static
+int
+cmd_schedtrace(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		schedtrace_dump();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = schedtrace_start();
+		if (result) {
+			kprintf("strace: %s\n", strerror(result));
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		schedtrace_stop();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "ltrace")) {
+		schedtrace_mirror(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "noltrace")) {
+		schedtrace_mirror(false);
+	}
+	else {
+		kprintf("Usage: strace [on|off|ltrace|noltrace]\n");
+	}
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -500,6 +639,23 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_profdump(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "all")) {
+		kheap_profdump(true);
+	}
+	else {
+		kprintf("Usage: khprof [all]\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,9 +722,15 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[kmb1] kmalloc size class benchmark ",
+	"[kmb2] kmalloc multi-cpu benchmark  ",
+	"[kmb3] kmalloc churn benchmark      ",
+	"[kmb4] kmalloc fragmentation bench  ",
+	"[spb] Spinlock vs ticket lock bench ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[ct]  Callout test                  ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -576,6 +738,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] Lock priority inheritance test",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -603,9 +766,21 @@ cmd_testmenu(int n, char **a)
 static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
+	"[mem] Physical memory stats         ",
+	"[lkstat] Lock contention totals     ",
+	"[spstat] Spinlock contention        ",
+	"[ps] Processes and CPU times        ",
+#if OPT_LOCKPROF
+	"[lkprof] Lock contention profiler   ",
+#endif
+	"[prof] Sampling profiler            ",
+#if OPT_SCHEDTRACE
+	"[strace] Scheduler event trace      ",
+#endif
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap by call site   ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -654,9 +829,21 @@ static struct {
 	{ "halt",	cmd_quit },
 
 	/* stats */
+	{ "mem",        cmd_memstats },
+	{ "lkstat",     cmd_lockstats },
+	{ "spstat",     cmd_spinstats },
+	{ "ps",         cmd_ps },
+#if OPT_LOCKPROF
+	{ "lkprof",     cmd_lockprof },
+#endif
+	{ "prof",       cmd_prof },
+#if OPT_SCHEDTRACE
+	{ "strace",     cmd_schedtrace },
+#endif
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprof },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,18 +854,25 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "kmb1",	kmallocbench1 },
+	{ "kmb2",	kmallocbench2 },
+	{ "kmb3",	kmallocbench3 },
+	{ "kmb4",	kmallocbench4 },
+	{ "spb",	spinbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "ct",		callouttest },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	pitest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
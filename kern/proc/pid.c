@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>	/* for kern/resource.h */
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
@@ -56,6 +58,8 @@ struct pidinfo {
 	pid_t pi_ppid;			// process id of parent thread
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
+	uint64_t pi_utime;		// total user time (ditto)
+	uint64_t pi_stime;		// total kernel time (ditto)
 	struct cv *pi_cv;		// use to wait for thread exit
 };
 
@@ -101,6 +105,8 @@ pidinfo_create(pid_t pid, pid_t ppid)
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	pi->pi_utime = 0;
+	pi->pi_stime = 0;
 
 	return pi;
 }
@@ -344,8 +350,16 @@ void
 pid_setexitstatus(int status)
 {
 	struct pidinfo *us;
+	uint64_t utime, stime, cutime, cstime;
 	int i;
 
+	/*
+	 * Total up our CPU time, including that of the children we
+	 * waited for, for our parent to collect.
+	 */
+	proc_gettimes(curproc, RUSAGE_SELF, &utime, &stime);
+	proc_gettimes(curproc, RUSAGE_CHILDREN, &cutime, &cstime);
+
 	lock_acquire(pidlock);
 	KASSERT(curproc->p_pid != INVALID_PID);
 
@@ -367,6 +381,8 @@ pid_setexitstatus(int status)
 	KASSERT(us != NULL);
 
 	us->pi_exitstatus = status;
+	us->pi_utime = utime + cutime;
+	us->pi_stime = stime + cstime;
 	us->pi_exited = true;
 
 	if (us->pi_ppid == INVALID_PID) {
@@ -439,7 +455,11 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 			return 0;
 		}
 		/* don't need to loop on this */
-		cv_wait(them->pi_cv, pidlock);
+		if (cv_wait_intr(them->pi_cv, pidlock)) {
+			/* we're being made to exit; see proc_stopthreads */
+			lock_release(pidlock);
+			return EINTR;
+		}
 		KASSERT(them->pi_exited == true);
 	}
 
@@ -457,6 +477,12 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		*ret = theirpid;
 	}
 
+	/* Collect its CPU time. */
+	spinlock_acquire(&curproc->p_lock);
+	curproc->p_cutime += them->pi_utime;
+	curproc->p_cstime += them->pi_stime;
+	spinlock_release(&curproc->p_lock);
+
 	them->pi_ppid = 0;
 	pi_drop(them->pi_pid);
 
@@ -42,9 +42,16 @@
  * process that will have more than one thread is the kernel process.
  */
 
+#define PROCINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/wait.h>
+#include <kern/time.h>	/* for kern/resource.h */
+#include <kern/resource.h>
+#include <lib.h>
 #include <spl.h>
+#include <cpu.h>
 #include <synch.h>
 #include <proc.h>
 #include <current.h>
@@ -52,12 +59,19 @@
 #include <vnode.h>
 #include <pid.h>
 #include <filetable.h>
+#include <syscall.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * All the processes, for ps. allprocs_lock comes before p_threadslock.
+ */
+static struct lock *allprocs_lock;
+static struct procarray allprocs;
+
 /*
  * Create a proc structure.
  */
@@ -66,6 +80,7 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+	int result;
 
 	proc = kmalloc(sizeof(*proc));
 	if (proc == NULL) {
@@ -83,10 +98,25 @@ proc_create(const char *name)
 		kfree(proc);
 		return NULL;
 	}
+	proc->p_threadcv = cv_create("p_threads");
+	if (proc->p_threadcv == NULL) {
+		lock_destroy(proc->p_threadslock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
 	threadarray_init(&proc->p_threads);
+	proc->p_stopping = false;
+	/* The first thread gets slot 0. */
+	bzero(proc->p_tslots, sizeof(proc->p_tslots));
+	proc->p_tslots[0] = PT_RUNNING;
 
 	spinlock_init(&proc->p_lock);
 	proc->p_pid = INVALID_PID;
+	proc->p_utime = 0;
+	proc->p_stime = 0;
+	proc->p_cutime = 0;
+	proc->p_cstime = 0;
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -95,6 +125,27 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 	proc->p_filetable = NULL;
 
+	/*
+	 * kproc is created before there is a curthread, so it can't
+	 * use lock_acquire; boot is single-threaded at that point.
+	 */
+	if (kproc != NULL) {
+		lock_acquire(allprocs_lock);
+	}
+	result = procarray_add(&allprocs, proc, NULL);
+	if (kproc != NULL) {
+		lock_release(allprocs_lock);
+	}
+	if (result) {
+		spinlock_cleanup(&proc->p_lock);
+		threadarray_cleanup(&proc->p_threads);
+		cv_destroy(proc->p_threadcv);
+		lock_destroy(proc->p_threadslock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
+
 	return proc;
 }
 
@@ -107,6 +158,8 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+	unsigned num, i;
+
 	/*
 	 * You probably want to destroy and null out much of the
 	 * process (particularly the address space) at exit time if
@@ -118,6 +171,17 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+	lock_acquire(allprocs_lock);
+	num = procarray_num(&allprocs);
+	for (i=0; i<num; i++) {
+		if (procarray_get(&allprocs, i) == proc) {
+			procarray_remove(&allprocs, i);
+			break;
+		}
+	}
+	KASSERT(i < num);
+	lock_release(allprocs_lock);
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -185,6 +249,7 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc->p_pid == INVALID_PID);
 	spinlock_cleanup(&proc->p_lock);
 	threadarray_cleanup(&proc->p_threads);
+	cv_destroy(proc->p_threadcv);
 	lock_destroy(proc->p_threadslock);
 
 	kfree(proc->p_name);
@@ -197,6 +262,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	allprocs_lock = lock_create("allprocs");
+	if (allprocs_lock == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+	procarray_init(&allprocs);
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -329,6 +400,13 @@ proc_fork(struct proc **ret)
 	}
 	spinlock_release(&curproc->p_lock);
 
+	/*
+	 * The new thread keeps running on the caller's user stack, so
+	 * it keeps the caller's slot too.
+	 */
+	newproc->p_tslots[0] = PT_FREE;
+	newproc->p_tslots[curthread->t_tid] = PT_RUNNING;
+
 	*ret = newproc;
 	return 0;
 }
@@ -355,6 +433,14 @@ proc_exit(int status)
 	/* The kernel isn't supposed to exit. */
 	KASSERT(proc != kproc);
 
+	/*
+	 * Get rid of any other threads first. If one of them is
+	 * already exiting (or execing), let it; just leave.
+	 */
+	if (proc_stopthreads()) {
+		proc_threadexit();
+	}
+
 	/* Set exit status and wake up anyone waiting for us. */
 	pid_setexitstatus(status);
 
@@ -427,19 +513,354 @@ proc_remthread(struct thread *t)
 	num = threadarray_num(&proc->p_threads);
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
-			threadarray_remove(&proc->p_threads, i);
-			lock_release(proc->p_threadslock);
-			goto finish;
+			goto found;
 		}
 	}
 	/* Did not find it. */
 	lock_release(proc->p_threadslock);
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 
-finish:
+found:
+	/* Hand its CPU time over to the process, and detach it. */
 	spl = splhigh();
+	if (t == curthread) {
+		thread_charge(false);
+	}
+	spinlock_acquire(&proc->p_lock);
+	proc->p_utime += t->t_utime;
+	proc->p_stime += t->t_stime;
+	spinlock_release(&proc->p_lock);
+	t->t_utime = 0;
+	t->t_stime = 0;
 	t->t_proc = NULL;
 	splx(spl);
+
+	threadarray_remove(&proc->p_threads, i);
+
+	/*
+	 * Tell anyone waiting for threads to leave. Once we let go of
+	 * the lock the process may be destroyed under us.
+	 */
+	cv_broadcast(proc->p_threadcv, proc->p_threadslock);
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Restrict all the threads in a process to the cpus in MASK (see
+ * thread_setaffinity). If the current thread is one of them, it goes
+ * last, since it may have to move.
+ */
+int
+proc_setaffinity(struct proc *proc, uint32_t mask)
+{
+	struct thread *t;
+	unsigned num, i;
+	bool self;
+	int result;
+
+	self = false;
+	lock_acquire(proc->p_threadslock);
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		if (t == curthread) {
+			self = true;
+			continue;
+		}
+		result = thread_setaffinity(t, mask);
+		if (result) {
+			lock_release(proc->p_threadslock);
+			return result;
+		}
+	}
+	lock_release(proc->p_threadslock);
+
+	if (self) {
+		return thread_setaffinity(curthread, mask);
+	}
+	return 0;
+}
+
+/*
+ * Allocate a slot and user stack for a new thread of the current
+ * process. Fails if the process is going away or has no free slots.
+ */
+int
+proc_newthread(unsigned *tid, vaddr_t *stackptr)
+{
+	struct proc *proc = curproc;
+	unsigned i;
+	int result;
+
+	lock_acquire(proc->p_threadslock);
+	if (proc->p_stopping) {
+		lock_release(proc->p_threadslock);
+		return EINTR;
+	}
+	for (i=0; i<PROC_MAXTHREADS; i++) {
+		if (proc->p_tslots[i] == PT_FREE) {
+			break;
+		}
+	}
+	if (i == PROC_MAXTHREADS) {
+		lock_release(proc->p_threadslock);
+		return EAGAIN;
+	}
+	result = as_define_threadstack(proc_getas(), i, stackptr);
+	if (result) {
+		lock_release(proc->p_threadslock);
+		return result;
+	}
+	proc->p_tslots[i] = PT_RUNNING;
+	lock_release(proc->p_threadslock);
+
+	*tid = i;
+	return 0;
+}
+
+/*
+ * Undo proc_newthread if the thread never got going.
+ */
+void
+proc_unnewthread(unsigned tid)
+{
+	struct proc *proc = curproc;
+
+	lock_acquire(proc->p_threadslock);
+	KASSERT(proc->p_tslots[tid] == PT_RUNNING);
+	as_remove_threadstack(proc_getas(), tid);
+	proc->p_tslots[tid] = PT_FREE;
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Wait for thread TID of the current process to exit, and free its
+ * slot. Gives up with EINTR if the process is going away.
+ */
+int
+proc_threadjoin(unsigned tid)
+{
+	struct proc *proc = curproc;
+	int result;
+
+	if (tid >= PROC_MAXTHREADS || tid == curthread->t_tid) {
+		return EINVAL;
+	}
+
+	lock_acquire(proc->p_threadslock);
+	while (proc->p_tslots[tid] == PT_RUNNING && !proc->p_stopping) {
+		cv_wait(proc->p_threadcv, proc->p_threadslock);
+	}
+	if (proc->p_stopping) {
+		result = EINTR;
+	}
+	else if (proc->p_tslots[tid] == PT_EXITED) {
+		proc->p_tslots[tid] = PT_FREE;
+		result = 0;
+	}
+	else {
+		result = ESRCH;
+	}
+	lock_release(proc->p_threadslock);
+	return result;
+}
+
+/*
+ * Make the current thread leave its process. Its user stack goes
+ * away, unless the whole process is going, in which case there's no
+ * point. If it was the last thread, the process exits.
+ */
+void
+proc_threadexit(void)
+{
+	struct proc *proc = curproc;
+	unsigned tid = curthread->t_tid;
+	unsigned i;
+
+	KASSERT(proc != kproc);
+
+	lock_acquire(proc->p_threadslock);
+	if (!proc->p_stopping) {
+		proc->p_tslots[tid] = PT_EXITED;
+		for (i=0; i<PROC_MAXTHREADS; i++) {
+			if (proc->p_tslots[i] == PT_RUNNING) {
+				break;
+			}
+		}
+		if (i == PROC_MAXTHREADS) {
+			/* Last one out. */
+			proc->p_tslots[tid] = PT_RUNNING;
+			lock_release(proc->p_threadslock);
+			proc_exit(_MKWAIT_EXIT(0));
+		}
+		as_remove_threadstack(proc_getas(), tid);
+	}
+	lock_release(proc->p_threadslock);
+
+	proc_remthread(curthread);
+	proc_addthread(kproc, curthread);
+	thread_exit();
+}
+
+/*
+ * Make the current thread the only one in its process. The others
+ * notice on their way back to user mode (see mips_trap) and leave
+ * with proc_threadexit; ones waiting in proc_threadjoin or on a futex
+ * are woken to do so. Interruptible sleeps elsewhere in the kernel
+ * (console reads, waitpid, semfs P, nanosleep) are interrupted and
+ * fail with EINTR; waits for locks are short, and we wait for them.
+ *
+ * Fails with EINTR if another thread is already doing this, in which
+ * case the caller should leave too.
+ */
+int
+proc_stopthreads(void)
+{
+	struct proc *proc = curproc;
+	struct thread *t;
+	unsigned i, num;
+
+	lock_acquire(proc->p_threadslock);
+	if (proc->p_stopping) {
+		lock_release(proc->p_threadslock);
+		return EINTR;
+	}
+	proc->p_stopping = true;
+	cv_broadcast(proc->p_threadcv, proc->p_threadslock);
+	futex_stop(proc);
+	/* holding p_threadslock keeps them from going away under us */
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		if (t != curthread) {
+			thread_interrupt(t);
+		}
+	}
+	while (threadarray_num(&proc->p_threads) > 1) {
+		cv_wait(proc->p_threadcv, proc->p_threadslock);
+	}
+	for (i=0; i<PROC_MAXTHREADS; i++) {
+		if (i != curthread->t_tid) {
+			proc->p_tslots[i] = PT_FREE;
+		}
+	}
+	proc->p_stopping = false;
+	lock_release(proc->p_threadslock);
+	return 0;
+}
+
+/*
+ * After exec: the current thread, alone in a new image, is running
+ * on the main stack and becomes thread 0.
+ */
+void
+proc_threadexec(void)
+{
+	struct proc *proc = curproc;
+
+	lock_acquire(proc->p_threadslock);
+	KASSERT(threadarray_num(&proc->p_threads) == 1);
+	proc->p_tslots[curthread->t_tid] = PT_FREE;
+	proc->p_tslots[0] = PT_RUNNING;
+	curthread->t_tid = 0;
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Get the CPU time used by PROC or by its waited-for children. For
+ * the process itself that's what its departed threads left behind
+ * plus what its live ones have used so far.
+ */
+void
+proc_gettimes(struct proc *proc, int who, uint64_t *utime, uint64_t *stime)
+{
+	struct thread *t;
+	uint64_t u, s;
+	unsigned num, i;
+
+	if (who == RUSAGE_CHILDREN) {
+		spinlock_acquire(&proc->p_lock);
+		*utime = proc->p_cutime;
+		*stime = proc->p_cstime;
+		spinlock_release(&proc->p_lock);
+		return;
+	}
+
+	KASSERT(who == RUSAGE_SELF);
+
+	if (proc == curproc) {
+		/* Bring our own time up to date. */
+		thread_charge(false);
+	}
+
+	u = s = 0;
+	lock_acquire(proc->p_threadslock);
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		u += t->t_utime;
+		s += t->t_stime;
+	}
+	spinlock_acquire(&proc->p_lock);
+	u += proc->p_utime;
+	s += proc->p_stime;
+	spinlock_release(&proc->p_lock);
+	lock_release(proc->p_threadslock);
+
+	*utime = u;
+	*stime = s;
+}
+
+/*
+ * Print a time in nanoseconds as seconds.
+ */
+static
+void
+proc_printns(uint64_t ns)
+{
+	kprintf(" %6llu.%03llu", ns / 1000000000ULL, (ns / 1000000ULL) % 1000);
+}
+
+/*
+ * Print all processes and their threads, with their CPU times.
+ */
+void
+proc_printall(void)
+{
+	static const char *const statenames[] = {
+		"run", "ready", "sleep", "zombie",
+	};
+	struct proc *proc;
+	struct thread *t;
+	uint64_t utime, stime;
+	unsigned nprocs, nthreads, i, j;
+
+	kprintf("  PID       USER(s)     SYS(s)  NAME\n");
+
+	lock_acquire(allprocs_lock);
+	nprocs = procarray_num(&allprocs);
+	for (i=0; i<nprocs; i++) {
+		proc = procarray_get(&allprocs, i);
+		proc_gettimes(proc, RUSAGE_SELF, &utime, &stime);
+		kprintf("%5d   ", (int)proc->p_pid);
+		proc_printns(utime);
+		proc_printns(stime);
+		kprintf("  %s\n", proc->p_name);
+
+		lock_acquire(proc->p_threadslock);
+		nthreads = threadarray_num(&proc->p_threads);
+		for (j=0; j<nthreads; j++) {
+			t = threadarray_get(&proc->p_threads, j);
+			kprintf("        ");
+			proc_printns(t->t_utime);
+			proc_printns(t->t_stime);
+			kprintf("    %s (%s, cpu%u)\n", t->t_name,
+				statenames[t->t_state],
+				t->t_cpu == NULL ? 0 : t->t_cpu->c_number);
+		}
+		lock_release(proc->p_threadslock);
+	}
+	lock_release(allprocs_lock);
 }
 
 /*
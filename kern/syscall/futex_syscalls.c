@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futexes: waiting on a word of user memory.
+ *
+ * A user-level lock keeps its state in an ordinary word of memory and
+ * only calls into the kernel when it has to wait, or when someone
+ * might be waiting. futex_wait(addr, val) sleeps if *addr still holds
+ * VAL; futex_wake(addr, n) wakes up to N threads sleeping on ADDR.
+ *
+ * Waiters are hashed on the physical address of the word, so they are
+ * found whatever mapping the waker uses. Each bucket has a spinlock, a
+ * wait channel, and a list of the waiters in it saying which word each
+ * is waiting on; a waker takes the ones it picks off the list and
+ * marks them woken. (Others that hash to the same bucket wake too, see
+ * they haven't been picked, and go back to sleep.)
+ *
+ * futex_wait checks the word with the bucket lock held, reading it
+ * through the kernel's direct mapping of physical memory, so a wake
+ * issued after the word changes can't slip in between the check and
+ * the sleep.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+#define FUTEX_HASHSIZE 64
+
+struct futex_waiter {
+	paddr_t fw_paddr;		/* word waited on */
+	struct proc *fw_proc;		/* process waiting */
+	bool fw_woken;			/* taken off the list by a waker */
+	int fw_result;			/* what futex_wait returns */
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;
+	struct wchan *fb_wchan;
+	struct futex_waiter *fb_waiters;	/* in arrival order */
+};
+
+static struct futex_bucket futex_table[FUTEX_HASHSIZE];
+
+/*
+ * Set up the hash table.
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		spinlock_init(&futex_table[i].fb_lock);
+		futex_table[i].fb_wchan = wchan_create("futex");
+		if (futex_table[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(paddr_t pa)
+{
+	return &futex_table[((pa >> 2) ^ (pa >> 12)) % FUTEX_HASHSIZE];
+}
+
+/*
+ * Check that ADDR is a word of the current process's memory, fault it
+ * in if needed, and find its physical address.
+ */
+static
+int
+futex_lookup(userptr_t addr, paddr_t *ret)
+{
+	uint32_t junk;
+	int result;
+
+	if ((vaddr_t)addr % sizeof(uint32_t) != 0) {
+		return EINVAL;
+	}
+	result = copyin(addr, &junk, sizeof(junk));
+	if (result) {
+		return result;
+	}
+	return vm_translate(proc_getas(), (vaddr_t)addr, ret);
+}
+
+/*
+ * Take up to N waiters for the word at PA (or, if PROC isn't NULL,
+ * all waiters belonging to PROC) off FB's list, and wake them with
+ * RESULT. Returns the number woken.
+ */
+static
+unsigned
+futex_takewaiters(struct futex_bucket *fb, paddr_t pa, struct proc *proc,
+		  unsigned n, int result)
+{
+	struct futex_waiter **pw, *w;
+	unsigned count = 0;
+
+	KASSERT(spinlock_do_i_hold(&fb->fb_lock));
+
+	pw = &fb->fb_waiters;
+	while (*pw != NULL && count < n) {
+		w = *pw;
+		if (proc != NULL ? w->fw_proc != proc : w->fw_paddr != pa) {
+			pw = &w->fw_next;
+			continue;
+		}
+		*pw = w->fw_next;
+		w->fw_woken = true;
+		w->fw_result = result;
+		count++;
+	}
+	if (count > 0) {
+		wchan_wakeall(fb->fb_wchan, &fb->fb_lock);
+	}
+	return count;
+}
+
+/*
+ * futex_wait: sleep until woken if *ADDR == VAL. Fails with EAGAIN if
+ * it doesn't, and with EINTR if the process is stopping its threads
+ * (for exit or exec).
+ */
+int
+sys_futex_wait(userptr_t addr, uint32_t val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter w, **pw;
+	paddr_t pa;
+	int result;
+
+	result = futex_lookup(addr, &pa);
+	if (result) {
+		return result;
+	}
+	fb = futex_hash(pa);
+
+	w.fw_paddr = pa;
+	w.fw_proc = curproc;
+	w.fw_woken = false;
+	w.fw_result = 0;
+	w.fw_next = NULL;
+
+	spinlock_acquire(&fb->fb_lock);
+	if (*(volatile uint32_t *)PADDR_TO_KVADDR(pa) != val) {
+		spinlock_release(&fb->fb_lock);
+		return EAGAIN;
+	}
+	if (curproc->p_stopping) {
+		/* futex_stop may already have been and gone. */
+		spinlock_release(&fb->fb_lock);
+		return EINTR;
+	}
+	for (pw = &fb->fb_waiters; *pw != NULL; pw = &(*pw)->fw_next) {
+		/* nothing */
+	}
+	*pw = &w;
+	while (!w.fw_woken) {
+		wchan_sleep(fb->fb_wchan, &fb->fb_lock);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	return w.fw_result;
+}
+
+/*
+ * futex_wake: wake up to N threads waiting on ADDR. Returns the number
+ * woken.
+ */
+int
+sys_futex_wake(userptr_t addr, int n, int *retval)
+{
+	struct futex_bucket *fb;
+	paddr_t pa;
+	int result;
+
+	if (n < 0) {
+		return EINVAL;
+	}
+	result = futex_lookup(addr, &pa);
+	if (result) {
+		return result;
+	}
+	fb = futex_hash(pa);
+
+	spinlock_acquire(&fb->fb_lock);
+	*retval = futex_takewaiters(fb, pa, NULL, n, 0);
+	spinlock_release(&fb->fb_lock);
+
+	return 0;
+}
+
+/*
+ * Wake all of PROC's threads that are waiting on futexes, with EINTR.
+ * Called by proc_stopthreads after setting p_stopping.
+ */
+void
+futex_stop(struct proc *proc)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		spinlock_acquire(&futex_table[i].fb_lock);
+		futex_takewaiters(&futex_table[i], 0, proc, (unsigned)-1,
+				  EINTR);
+		spinlock_release(&futex_table[i].fb_lock);
+	}
+}
@@ -368,6 +368,26 @@ sys_fstat(int fd, userptr_t statptr)
 	return copyout(&kbuf, statptr, sizeof(struct stat));
 }
 
+/*
+ * ioctl - call VOP_IOCTL
+ */
+int
+sys_ioctl(int fd, int code, userptr_t data)
+{
+	struct openfile *file;
+	int err;
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	/* As for fstat, no need to lock the openfile. */
+	err = VOP_IOCTL(file->of_vnode, code, data);
+	filetable_put(curproc->p_filetable, fd, file);
+	return err;
+}
+
 /*
  * fsync - call VOP_FSYNC
  */
@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>	/* for kern/resource.h */
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <machine/trapframe.h>
@@ -58,6 +60,46 @@ sys_getpid(pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_setaffinity
+ * Restrict a process to the cpus in MASK. We can't look processes up
+ * by pid, so PID must be the caller's own (or 0, meaning the same);
+ * children inherit the mask when they fork.
+ */
+int
+sys_setaffinity(pid_t pid, uint32_t mask)
+{
+	if (pid != 0 && pid != curproc->p_pid) {
+		return ESRCH;
+	}
+	return proc_setaffinity(curproc, mask);
+}
+
+/*
+ * sys_getrusage
+ * Report CPU time used by the caller, or by the children it has
+ * waited for. Only the times are kept; the rest reads as zero.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct rusage ru;
+	uint64_t utime, stime;
+
+	if (who != RUSAGE_SELF && who != RUSAGE_CHILDREN) {
+		return EINVAL;
+	}
+	proc_gettimes(curproc, who, &utime, &stime);
+
+	bzero(&ru, sizeof(ru));
+	ru.ru_utime.tv_sec = utime / 1000000000ULL;
+	ru.ru_utime.tv_usec = (utime / 1000) % 1000000;
+	ru.ru_stime.tv_sec = stime / 1000000000ULL;
+	ru.ru_stime.tv_usec = (stime / 1000) % 1000000;
+
+	return copyout(&ru, usage, sizeof(ru));
+}
+
 /*
  * sys__exit()
  *
@@ -81,12 +123,13 @@ sys__exit(int status)
 
 static
 void
-fork_newthread(void *vtf, unsigned long junk)
+fork_newthread(void *vtf, unsigned long tid)
 {
 	struct trapframe mytf;
 	struct trapframe *ntf = vtf;
 
-	(void)junk;
+	/* Same thread slot (and user stack) as in the parent. */
+	curthread->t_tid = tid;
 
 	/*
 	 * Now copy the trapframe to our stack, so we can free the one
@@ -127,7 +170,7 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	*retval = newproc->p_pid;
 
 	result = thread_fork(curthread->t_name, newproc,
-			     fork_newthread, ntf, 0);
+			     fork_newthread, ntf, curthread->t_tid);
 	if (result) {
 		proc_unfork(newproc);
 		kfree(ntf);
@@ -137,6 +180,92 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys___threadfork
+ *
+ * Create a new thread in the current process, which begins executing
+ * at ENTRY, on a user stack of its own, with FUNC and ARG as its
+ * arguments. (The C library passes a startup function as ENTRY, which
+ * calls FUNC(ARG) and then threadexit.) Returns the new thread's id.
+ */
+
+struct threadstart {
+	vaddr_t ts_entry;
+	vaddr_t ts_stack;
+	userptr_t ts_func;
+	userptr_t ts_arg;
+};
+
+static
+void
+threadfork_newthread(void *vts, unsigned long tid)
+{
+	struct threadstart ts;
+
+	ts = *(struct threadstart *)vts;
+	kfree(vts);
+
+	curthread->t_tid = tid;
+	enter_new_thread(ts.ts_entry, ts.ts_stack, ts.ts_func, ts.ts_arg);
+}
+
+int
+sys___threadfork(userptr_t entry, userptr_t func, userptr_t arg, int *retval)
+{
+	struct threadstart *ts;
+	unsigned tid;
+	int result;
+
+	ts = kmalloc(sizeof(*ts));
+	if (ts == NULL) {
+		return ENOMEM;
+	}
+	ts->ts_entry = (vaddr_t)entry;
+	ts->ts_func = func;
+	ts->ts_arg = arg;
+
+	result = proc_newthread(&tid, &ts->ts_stack);
+	if (result) {
+		kfree(ts);
+		return result;
+	}
+
+	result = thread_fork(curthread->t_name, NULL,
+			     threadfork_newthread, ts, tid);
+	if (result) {
+		proc_unnewthread(tid);
+		kfree(ts);
+		return result;
+	}
+
+	*retval = tid;
+	return 0;
+}
+
+/*
+ * sys_threadjoin
+ * Wait for a thread of the current process to exit.
+ */
+int
+sys_threadjoin(int tid)
+{
+	if (tid < 0) {
+		return EINVAL;
+	}
+	return proc_threadjoin(tid);
+}
+
+/*
+ * sys_threadexit
+ * The current thread exits; if it was the last, so does the process.
+ */
+__DEAD
+void
+sys_threadexit(void)
+{
+	proc_threadexit();
+}
+
 /*
  * sys_waitpid
  * just pass off the work to the pid code.
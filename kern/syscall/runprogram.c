@@ -394,6 +394,7 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	if (oldvm) {
 		as_destroy(oldvm);
 	}
+	proc_threadexec();
 
 	/*
 	 * Now that we know we're succeeding, change the current thread's
@@ -583,6 +584,18 @@ sys_execv(userptr_t prog, userptr_t uargv)
 		return result;
 	}
 
+	/*
+	 * Other threads can't stay in an address space that's about to
+	 * vanish, so get rid of them first. (Unlike Unix, we do this
+	 * before knowing if the exec will work.)
+	 */
+	result = proc_stopthreads();
+	if (result) {
+		argbuf_cleanup(&kargv);
+		kfree(path);
+		return result;
+	}
+
 	/* Load the executable. Note: must not fail after this succeeds. */
 	result = loadexec(path, &entrypoint, &stackptr);
 	if (result) {
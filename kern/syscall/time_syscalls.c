@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +57,44 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the requested time. There are no signals, but the sleep
+ * is cut short with EINTR if another thread exits or execs the
+ * process (see proc_stopthreads); then the time not slept goes in
+ * REM, if given. Otherwise REM is set to zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	/* Longest sleep whose length fits in 64 bits of nanoseconds. */
+	const uint64_t maxsecs = (~(uint64_t)0 / 1000000000) - 1;
+	struct timespec req, rem;
+	uint64_t secs, left;
+	int result, err;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	secs = req.tv_sec;
+	if (secs > maxsecs) {
+		secs = maxsecs;
+	}
+	left = 0;
+	err = thread_sleep_ns_intr(secs * 1000000000 + req.tv_nsec, &left);
+
+	if (user_rem != NULL) {
+		rem.tv_sec = left / 1000000000;
+		rem.tv_nsec = left % 1000000000;
+		result = copyout(&rem, user_rem, sizeof(rem));
+		if (result) {
+			return result;
+		}
+	}
+	return err;
+}
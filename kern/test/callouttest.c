@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for callouts and the timed sleeps built on them.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <callout.h>
+#include <synch.h>
+#include <test.h>
+
+#define CT_NCALLOUTS	64	/* callouts in the wheel test */
+#define CT_MAXDELAY	200	/* longest delay there, in ticks */
+#define CT_SLEEPNS	50000000ULL	/* 50 ms */
+
+struct ct_item {
+	struct callout ci_callout;
+	uint32_t ci_due;		/* tick it should fire on */
+	uint32_t ci_fired;		/* tick it did fire on */
+	bool ci_stopped;		/* cancelled; must not fire */
+	unsigned ci_count;		/* times fired */
+};
+
+static struct ct_item ct_items[CT_NCALLOUTS];
+static struct semaphore *ct_donesem;
+
+static
+void
+ct_fire(void *data)
+{
+	struct ct_item *ci = data;
+
+	ci->ci_fired = callout_now();
+	ci->ci_count++;
+	V(ct_donesem);
+}
+
+static
+uint64_t
+ct_elapsed_ns(const struct timespec *before)
+{
+	struct timespec after, diff;
+
+	gettime(&after);
+	timespec_sub(&after, before, &diff);
+	return (uint64_t)diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+}
+
+/*
+ * Schedule a lot of callouts across the first two levels of the
+ * wheel, cancel some, and check that the rest fire exactly when due
+ * and the cancelled ones don't fire at all.
+ */
+static
+void
+ct_wheel(void)
+{
+	unsigned i, nlive, delay;
+	uint32_t now;
+
+	ct_donesem = sem_create("ct_done", 0);
+	if (ct_donesem == NULL) {
+		panic("callouttest: sem_create failed\n");
+	}
+
+	for (i=0; i<CT_NCALLOUTS; i++) {
+		callout_init(&ct_items[i].ci_callout, ct_fire, &ct_items[i]);
+		ct_items[i].ci_fired = 0;
+		ct_items[i].ci_stopped = false;
+		ct_items[i].ci_count = 0;
+	}
+
+	/*
+	 * callout_now() can't advance under us while the wheel's cpu
+	 * is blocked on callout_lock, but it can between calls; so
+	 * read the clock and schedule, then check the due time is
+	 * within the right window.
+	 */
+	for (i=0; i<CT_NCALLOUTS; i++) {
+		delay = 1 + random() % CT_MAXDELAY;
+		now = callout_now();
+		callout_schedule(&ct_items[i].ci_callout, delay);
+		ct_items[i].ci_due = ct_items[i].ci_callout.co_when;
+		KASSERT(ct_items[i].ci_due - now >= delay);
+		KASSERT(ct_items[i].ci_due - callout_now() <= delay);
+	}
+
+	nlive = 0;
+	for (i=0; i<CT_NCALLOUTS; i++) {
+		if (i % 4 == 0 && callout_stop(&ct_items[i].ci_callout)) {
+			ct_items[i].ci_stopped = true;
+		}
+		else {
+			nlive++;
+		}
+	}
+
+	for (i=0; i<nlive; i++) {
+		P(ct_donesem);
+	}
+	/* Give any stray cancelled ones time to misfire. */
+	thread_sleep_ns(CT_SLEEPNS);
+
+	for (i=0; i<CT_NCALLOUTS; i++) {
+		if (ct_items[i].ci_stopped) {
+			KASSERT(ct_items[i].ci_count == 0);
+		}
+		else {
+			KASSERT(ct_items[i].ci_count == 1);
+			KASSERT(ct_items[i].ci_fired == ct_items[i].ci_due);
+		}
+		KASSERT(!ct_items[i].ci_callout.co_pending);
+	}
+	sem_destroy(ct_donesem);
+	ct_donesem = NULL;
+	kprintf("  %u callouts fired on time, %u cancelled\n",
+		nlive, CT_NCALLOUTS - nlive);
+}
+
+/*
+ * Check that the timed sleeps sleep at least as long as asked and
+ * report timeouts correctly.
+ */
+static
+void
+ct_timed(void)
+{
+	struct timespec before;
+	struct semaphore *sem;
+	struct lock *lock;
+	struct cv *cv;
+	uint64_t ns;
+	int result;
+
+	gettime(&before);
+	thread_sleep_ns(CT_SLEEPNS);
+	ns = ct_elapsed_ns(&before);
+	KASSERT(ns >= CT_SLEEPNS);
+	kprintf("  thread_sleep_ns(%llu): slept %llu ns\n",
+		CT_SLEEPNS, ns);
+
+	sem = sem_create("ct_sem", 1);
+	lock = lock_create("ct_lock");
+	cv = cv_create("ct_cv");
+	if (sem == NULL || lock == NULL || cv == NULL) {
+		panic("callouttest: Out of memory\n");
+	}
+
+	result = P_timeout(sem, CT_SLEEPNS);
+	KASSERT(result == 0);
+	result = P_timeout(sem, 0);
+	KASSERT(result == ETIMEDOUT);
+
+	gettime(&before);
+	result = P_timeout(sem, CT_SLEEPNS);
+	ns = ct_elapsed_ns(&before);
+	KASSERT(result == ETIMEDOUT);
+	kprintf("  P_timeout(%llu): timed out after %llu ns\n",
+		CT_SLEEPNS, ns);
+
+	lock_acquire(lock);
+	gettime(&before);
+	result = cv_wait_timeout(cv, lock, CT_SLEEPNS);
+	ns = ct_elapsed_ns(&before);
+	KASSERT(result == ETIMEDOUT);
+	KASSERT(lock_do_i_hold(lock));
+	lock_release(lock);
+	kprintf("  cv_wait_timeout(%llu): timed out after %llu ns\n",
+		CT_SLEEPNS, ns);
+
+	cv_destroy(cv);
+	lock_destroy(lock);
+	sem_destroy(sem);
+}
+
+int
+callouttest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kprintf("Testing callouts...\n");
+	ct_wheel();
+	ct_timed();
+	kprintf("Done.\n");
+	return 0;
+}
@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Benchmarks for kmalloc.
+ *
+ * Unlike the km tests, these don't check much; they time things and
+ * print the results, so that changes to the allocator can be
+ * compared.
+ *
+ *    kmb1 - alloc/free throughput and latency for each size class
+ *    kmb2 - alloc/free throughput from one thread per cpu at once
+ *    kmb3 - throughput of random mixed-size churn
+ *    kmb4 - fragmentation left behind by churn
+ *
+ * Each takes an optional argument to change the number of
+ * operations. "Heap pages" is the number of pages held by the
+ * subpage allocator (see kheap_getpages); whole-page allocations
+ * are not included.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <vm.h> /* for PAGE_SIZE */
+#include <test.h>
+
+/* Sizes benchmarked by kmb1; one per subpage size class, then pages. */
+static const size_t kmb_sizes[] = {
+	16, 32, 64, 128, 256, 512, 1024, 2000,
+	PAGE_SIZE, 3 * PAGE_SIZE,
+};
+#define KMB_NSIZES (sizeof(kmb_sizes) / sizeof(kmb_sizes[0]))
+
+#define KMB_COUNT	256	/* blocks per size in kmb1 */
+#define KMB_BIGCOUNT	32	/* ... for whole-page sizes */
+#define KMB_THREADITERS	20000	/* alloc/free pairs per thread in kmb2 */
+#define KMB_THREADSLOTS	8	/* blocks each kmb2 thread holds */
+#define KMB_CHURNITERS	50000	/* operations in kmb3/kmb4 */
+#define KMB_CHURNSLOTS	512	/* live blocks in kmb3/kmb4 */
+
+////////////////////////////////////////////////////////////
+// common code
+
+static
+uint64_t
+kmb_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/*
+ * Print OPS operations over ELAPSED nanoseconds as a rate.
+ */
+static
+void
+kmb_report(const char *what, unsigned long ops, uint64_t elapsed)
+{
+	uint64_t rate;
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	rate = (uint64_t)ops * 1000000000ULL / elapsed;
+	kprintf("%-14s %8lu ops %10llu ops/sec %8llu ns/op\n",
+		what, ops, rate, elapsed / (ops ? ops : 1));
+}
+
+/*
+ * Parse an optional count argument.
+ */
+static
+unsigned long
+kmb_getcount(int nargs, char **args, unsigned long dflt)
+{
+	int val;
+
+	if (nargs < 2) {
+		return dflt;
+	}
+	val = atoi(args[1]);
+	return val > 0 ? (unsigned long)val : dflt;
+}
+
+static
+void
+kmb_printpages(void)
+{
+	unsigned cur, peak;
+
+	kheap_getpages(&cur, &peak);
+	kprintf("Heap pages: %u now, %u peak\n", cur, peak);
+}
+
+/*
+ * Pick a random allocation size for the churn tests. Mostly small
+ * things, which is what the kernel mostly allocates, with a tail of
+ * larger ones up to the biggest subpage size.
+ */
+static
+size_t
+kmb_randsize(void)
+{
+	uint32_t r = random();
+
+	switch (r % 8) {
+	    case 0: case 1: case 2: case 3:
+		return 8 + (r / 8) % 57;	/* 8-64 */
+	    case 4: case 5:
+		return 65 + (r / 8) % 192;	/* 65-256 */
+	    case 6:
+		return 257 + (r / 8) % 768;	/* 257-1024 */
+	    default:
+		return 1025 + (r / 8) % 976;	/* 1025-2000 */
+	}
+}
+
+////////////////////////////////////////////////////////////
+// kmb1
+
+/*
+ * For each size, allocate COUNT blocks, then free them, timing each
+ * phase. Then allocate and free one block at a time, timing each
+ * allocation separately to find the worst case (this includes
+ * the cost of reading the clock, so only the maximum is meaningful).
+ */
+int
+kmallocbench1(int nargs, char **args)
+{
+	unsigned long count, n, i;
+	unsigned s;
+	void **ptrs;
+	struct timespec before, after;
+	uint64_t elapsed, worst;
+	char label[32];
+
+	count = kmb_getcount(nargs, args, KMB_COUNT);
+	ptrs = kmalloc(count * sizeof(void *));
+	if (ptrs == NULL) {
+		kprintf("kmb1: Out of memory\n");
+		return ENOMEM;
+	}
+
+	kprintf("Starting kmalloc size class benchmark...\n");
+	for (s=0; s<KMB_NSIZES; s++) {
+		n = kmb_sizes[s] >= PAGE_SIZE && count > KMB_BIGCOUNT ?
+			KMB_BIGCOUNT : count;
+		kheap_resetpeak();
+
+		gettime(&before);
+		for (i=0; i<n; i++) {
+			ptrs[i] = kmalloc(kmb_sizes[s]);
+			if (ptrs[i] == NULL) {
+				break;
+			}
+		}
+		gettime(&after);
+		if (i < n) {
+			kprintf("kmb1: kmalloc(%zu) failed after %lu\n",
+				kmb_sizes[s], i);
+			n = i;
+		}
+		timespec_sub(&after, &before, &after);
+		snprintf(label, sizeof(label), "alloc %zu", kmb_sizes[s]);
+		kmb_report(label, n, kmb_ns(&after));
+
+		gettime(&before);
+		for (i=0; i<n; i++) {
+			kfree(ptrs[i]);
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &after);
+		snprintf(label, sizeof(label), "free %zu", kmb_sizes[s]);
+		kmb_report(label, n, kmb_ns(&after));
+
+		worst = 0;
+		for (i=0; i<n; i++) {
+			gettime(&before);
+			ptrs[0] = kmalloc(kmb_sizes[s]);
+			gettime(&after);
+			kfree(ptrs[0]);
+			timespec_sub(&after, &before, &after);
+			elapsed = kmb_ns(&after);
+			if (elapsed > worst) {
+				worst = elapsed;
+			}
+		}
+		kprintf("%-14s worst alloc %llu ns\n", "", worst);
+		kmb_printpages();
+	}
+
+	kfree(ptrs);
+	kprintf("kmb1 done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// kmb2
+
+static struct semaphore *kmb_startsem;
+static struct semaphore *kmb_donesem;
+
+static
+void
+kmb_thread(void *junk, unsigned long iters)
+{
+	void *slots[KMB_THREADSLOTS];
+	unsigned long i;
+	unsigned slot;
+
+	(void)junk;
+
+	for (slot=0; slot<KMB_THREADSLOTS; slot++) {
+		slots[slot] = NULL;
+	}
+
+	P(kmb_startsem);
+	for (i=0; i<iters; i++) {
+		slot = i % KMB_THREADSLOTS;
+		kfree(slots[slot]);
+		slots[slot] = kmalloc(kmb_sizes[i % 8]);
+	}
+	for (slot=0; slot<KMB_THREADSLOTS; slot++) {
+		kfree(slots[slot]);
+	}
+	V(kmb_donesem);
+}
+
+/*
+ * Start one thread per cpu (or as many as asked for in the second
+ * argument), release them all at once, and time until the last one
+ * finishes. Each does a stream of alloc/free pairs over the subpage
+ * size classes.
+ */
+int
+kmallocbench2(int nargs, char **args)
+{
+	unsigned long iters;
+	unsigned nthreads, i;
+	struct timespec before, after;
+	int result;
+
+	iters = kmb_getcount(nargs, args, KMB_THREADITERS);
+	nthreads = cpu_count();
+	if (nargs > 2 && atoi(args[2]) > 0) {
+		nthreads = atoi(args[2]);
+	}
+
+	kmb_startsem = sem_create("kmb2 start", 0);
+	kmb_donesem = sem_create("kmb2 done", 0);
+	if (kmb_startsem == NULL || kmb_donesem == NULL) {
+		panic("kmb2: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc benchmark with %u threads...\n", nthreads);
+	kheap_resetpeak();
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmb2", NULL, kmb_thread, NULL, iters);
+		if (result) {
+			panic("kmb2: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(kmb_startsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(kmb_donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	kmb_report("alloc+free", iters * nthreads, kmb_ns(&after));
+	kmb_printpages();
+
+	sem_destroy(kmb_startsem);
+	sem_destroy(kmb_donesem);
+	kmb_startsem = kmb_donesem = NULL;
+
+	kprintf("kmb2 done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// kmb3/kmb4
+
+/*
+ * Churn: ITERS times, pick a random slot, free whatever is there,
+ * and put a new block of random size in it. Keeps *LIVEBYTES up to
+ * date. Returns the number of allocations that failed.
+ */
+static
+unsigned long
+kmb_churn(void **slots, size_t *sizes, unsigned long iters,
+	  size_t *livebytes)
+{
+	unsigned long i, failures;
+	unsigned slot;
+
+	failures = 0;
+	for (i=0; i<iters; i++) {
+		slot = random() % KMB_CHURNSLOTS;
+		if (slots[slot] != NULL) {
+			kfree(slots[slot]);
+			*livebytes -= sizes[slot];
+		}
+		sizes[slot] = kmb_randsize();
+		slots[slot] = kmalloc(sizes[slot]);
+		if (slots[slot] == NULL) {
+			failures++;
+			sizes[slot] = 0;
+		}
+		*livebytes += sizes[slot];
+	}
+	return failures;
+}
+
+static
+void
+kmb_freeslots(void **slots, size_t *sizes, size_t *livebytes)
+{
+	unsigned i;
+
+	for (i=0; i<KMB_CHURNSLOTS; i++) {
+		kfree(slots[i]);
+		slots[i] = NULL;
+		*livebytes -= sizes[i];
+		sizes[i] = 0;
+	}
+}
+
+/*
+ * Set up the slot arrays for kmb3/kmb4.
+ */
+static
+int
+kmb_churnsetup(void ***slots, size_t **sizes)
+{
+	unsigned i;
+
+	*slots = kmalloc(KMB_CHURNSLOTS * sizeof(void *));
+	*sizes = kmalloc(KMB_CHURNSLOTS * sizeof(size_t));
+	if (*slots == NULL || *sizes == NULL) {
+		kfree(*slots);
+		kfree(*sizes);
+		return ENOMEM;
+	}
+	for (i=0; i<KMB_CHURNSLOTS; i++) {
+		(*slots)[i] = NULL;
+		(*sizes)[i] = 0;
+	}
+	return 0;
+}
+
+int
+kmallocbench3(int nargs, char **args)
+{
+	void **slots;
+	size_t *sizes;
+	size_t livebytes;
+	unsigned long iters, failures;
+	struct timespec before, after;
+
+	iters = kmb_getcount(nargs, args, KMB_CHURNITERS);
+	if (kmb_churnsetup(&slots, &sizes)) {
+		kprintf("kmb3: Out of memory\n");
+		return ENOMEM;
+	}
+
+	kprintf("Starting kmalloc churn benchmark...\n");
+	kheap_resetpeak();
+	livebytes = 0;
+
+	gettime(&before);
+	failures = kmb_churn(slots, sizes, iters, &livebytes);
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	kmb_report("churn", iters, kmb_ns(&after));
+	if (failures > 0) {
+		kprintf("%lu allocations failed\n", failures);
+	}
+	kmb_printpages();
+
+	kmb_freeslots(slots, sizes, &livebytes);
+	KASSERT(livebytes == 0);
+	kfree(slots);
+	kfree(sizes);
+
+	kprintf("kmb3 done\n");
+	return 0;
+}
+
+/*
+ * Print how well the live data fills the subpage allocator's pages.
+ */
+static
+void
+kmb_printfrag(const char *when, size_t livebytes, unsigned basepages)
+{
+	unsigned cur, peak, used;
+
+	kheap_getpages(&cur, &peak);
+	used = cur > basepages ? cur - basepages : 0;
+	kprintf("%s: %zu bytes live in %u pages (%u%% used)\n", when,
+		livebytes, used,
+		used ? (unsigned)(livebytes * 100 / (used * PAGE_SIZE)) : 100);
+}
+
+/*
+ * Run churn, then free a random half of what is left, and report how
+ * much of the heap is actually in use at each stage. Then free
+ * everything and check that the pages were given back.
+ */
+int
+kmallocbench4(int nargs, char **args)
+{
+	void **slots;
+	size_t *sizes;
+	size_t livebytes;
+	unsigned long iters;
+	unsigned basepages, peak, cur, i;
+
+	iters = kmb_getcount(nargs, args, KMB_CHURNITERS);
+	if (kmb_churnsetup(&slots, &sizes)) {
+		kprintf("kmb4: Out of memory\n");
+		return ENOMEM;
+	}
+
+	kprintf("Starting kmalloc fragmentation benchmark...\n");
+	kheap_resetpeak();
+	kheap_getpages(&basepages, &peak);
+	livebytes = 0;
+
+	kmb_churn(slots, sizes, iters, &livebytes);
+	kmb_printfrag("After churn", livebytes, basepages);
+
+	for (i=0; i<KMB_CHURNSLOTS; i++) {
+		if (random() % 2) {
+			kfree(slots[i]);
+			slots[i] = NULL;
+			livebytes -= sizes[i];
+			sizes[i] = 0;
+		}
+	}
+	kmb_printfrag("After freeing half", livebytes, basepages);
+
+	kmb_freeslots(slots, sizes, &livebytes);
+	kheap_getpages(&cur, &peak);
+	kprintf("After freeing all: %u pages (started with %u, peak %u)\n",
+		cur, basepages, peak);
+	if (cur > basepages) {
+		kprintf("kmb4: FAILED: %u pages not given back\n",
+			cur - basepages);
+	}
+
+	kfree(slots);
+	kfree(sizes);
+
+	kprintf("kmb4 done\n");
+	return 0;
+}
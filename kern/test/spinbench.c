@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock benchmark.
+ *
+ *    spb - ordinary spinlocks against ticket locks under contention
+ *
+ * One thread per cpu (or as many as asked for in the second argument,
+ * spread over the cpus) fights over a single lock, holding it briefly
+ * each time, until the threads have acquired it COUNT times between
+ * them (the first argument). This is done once with a spinlock and
+ * once with a ticket lock. As well as the overall rate we print how
+ * the acquisitions were shared out; with a fair lock every thread
+ * should get about the same number.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <ticketlock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define SPB_COUNT	100000	/* acquisitions per run */
+#define SPB_MAXTHREADS	32
+#define SPB_HOLD	20	/* loop iterations with the lock held */
+#define SPB_GAP		10	/* loop iterations between acquisitions */
+
+static struct spinlock spb_spinlock = SPINLOCK_INITIALIZER;
+static struct ticketlock spb_ticketlock = TICKETLOCK_INITIALIZER;
+
+static bool spb_useticket;		/* which lock this run uses */
+static unsigned long spb_target;	/* acquisitions wanted */
+static unsigned long spb_total;		/* acquisitions so far */
+static unsigned long spb_counts[SPB_MAXTHREADS]; /* ... by each thread */
+
+static struct semaphore *spb_startsem;
+static struct semaphore *spb_donesem;
+
+static
+uint64_t
+spb_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static
+void
+spb_delay(unsigned n)
+{
+	volatile unsigned i;
+
+	for (i=0; i<n; i++) {
+		/* nothing */
+	}
+}
+
+static
+void
+spb_lock(void)
+{
+	if (spb_useticket) {
+		ticketlock_acquire(&spb_ticketlock);
+	}
+	else {
+		spinlock_acquire(&spb_spinlock);
+	}
+}
+
+static
+void
+spb_unlock(void)
+{
+	if (spb_useticket) {
+		ticketlock_release(&spb_ticketlock);
+	}
+	else {
+		spinlock_release(&spb_spinlock);
+	}
+}
+
+static
+void
+spb_thread(void *junk, unsigned long num)
+{
+	bool done;
+
+	(void)junk;
+
+	/* stay on one cpu so the threads really do run at once */
+	thread_setaffinity(curthread, CPUMASK_CPU(num % cpu_count()));
+
+	P(spb_startsem);
+	do {
+		spb_lock();
+		done = spb_total >= spb_target;
+		if (!done) {
+			spb_total++;
+			spb_counts[num]++;
+			spb_delay(SPB_HOLD);
+		}
+		spb_unlock();
+		spb_delay(SPB_GAP);
+	} while (!done);
+	V(spb_donesem);
+}
+
+/*
+ * Do one run and print the results.
+ */
+static
+void
+spb_run(const char *what, bool useticket, unsigned nthreads)
+{
+	struct timespec before, after;
+	unsigned long least, most;
+	uint64_t elapsed, rate;
+	unsigned i;
+	int result;
+
+	spb_useticket = useticket;
+	spb_total = 0;
+	for (i=0; i<nthreads; i++) {
+		spb_counts[i] = 0;
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spb", NULL, spb_thread, NULL, i);
+		if (result) {
+			panic("spb: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(spb_startsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(spb_donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	least = most = spb_counts[0];
+	for (i=1; i<nthreads; i++) {
+		if (spb_counts[i] < least) {
+			least = spb_counts[i];
+		}
+		if (spb_counts[i] > most) {
+			most = spb_counts[i];
+		}
+	}
+
+	elapsed = spb_ns(&after);
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	rate = (uint64_t)spb_total * 1000000000ULL / elapsed;
+	kprintf("%-10s %8lu acquires %10llu/sec  per thread: "
+		"min %lu max %lu\n", what, spb_total, rate, least, most);
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	unsigned nthreads;
+
+	spb_target = SPB_COUNT;
+	if (nargs > 1 && atoi(args[1]) > 0) {
+		spb_target = atoi(args[1]);
+	}
+	nthreads = cpu_count();
+	if (nargs > 2 && atoi(args[2]) > 0) {
+		nthreads = atoi(args[2]);
+	}
+	if (nthreads > SPB_MAXTHREADS) {
+		nthreads = SPB_MAXTHREADS;
+	}
+
+	spb_startsem = sem_create("spb start", 0);
+	spb_donesem = sem_create("spb done", 0);
+	if (spb_startsem == NULL || spb_donesem == NULL) {
+		panic("spb: sem_create failed\n");
+	}
+
+	kprintf("Starting spinlock benchmark with %u threads...\n",
+		nthreads);
+	spb_run("spinlock", false, nthreads);
+	spb_run("ticketlock", true, nthreads);
+
+	sem_destroy(spb_startsem);
+	sem_destroy(spb_donesem);
+	spb_startsem = spb_donesem = NULL;
+
+	kprintf("spb done\n");
+	return 0;
+}
@@ -35,6 +35,7 @@
 #include <kern/wait.h>
 #include <lib.h>
 #include <clock.h>
+#include <current.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -216,6 +217,8 @@ locktest(int nargs, char **args)
 		P(donesem);
 	}
 
+	/* Show how the waiters fared: spinning vs. sleeping. */
+	lock_printstats(testlock);
 	kprintf("Lock test done.\n");
 
 	return 0;
@@ -400,3 +403,128 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Priority inheritance through nested locks.
+ *
+ * Three threads and two locks. The first only ever takes pilock1,
+ * and takes it again straight after releasing it, ahead of anyone
+ * just woken. The second takes pilock2 and then pilock1 under it, so
+ * while it's asleep for pilock1 the third, waiting for pilock2,
+ * lends its priority through it to whoever holds pilock1. That
+ * exercises loans made along a chain, holders changing while loans
+ * are out, and waiters woken and then beaten to the lock. At the end
+ * no thread should still have any loans.
+ */
+
+#define NPITHREADS 3
+static struct lock *pilock1;
+static struct lock *pilock2;
+static volatile unsigned long pival1;
+static volatile unsigned long pival2;
+static volatile bool pifailed;
+
+static
+void
+pitestthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NLOCKLOOPS; i++) {
+		switch (num) {
+		    case 0:
+			lock_acquire(pilock1);
+			pival1 = num;
+			thread_yield();
+			if (pival1 != num) {
+				pifailed = true;
+			}
+			lock_release(pilock1);
+			lock_acquire(pilock1);
+			thread_yield();
+			lock_release(pilock1);
+			break;
+		    case 1:
+			lock_acquire(pilock2);
+			pival2 = num;
+			lock_acquire(pilock1);
+			pival1 = num;
+			thread_yield();
+			if (pival1 != num || pival2 != num) {
+				pifailed = true;
+			}
+			lock_release(pilock1);
+			lock_release(pilock2);
+			break;
+		    default:
+			lock_acquire(pilock2);
+			pival2 = num;
+			thread_yield();
+			if (pival2 != num) {
+				pifailed = true;
+			}
+			lock_release(pilock2);
+			break;
+		}
+	}
+
+	/* Holding no locks, we should have our own priority back. */
+	if (curthread->t_loans != 0 ||
+	    curthread->t_priority != curthread->t_ownpriority) {
+		kprintf("thread %lu: %u loans left, priority %u (own %u)\n",
+			num, curthread->t_loans, curthread->t_priority,
+			curthread->t_ownpriority);
+		pifailed = true;
+	}
+	V(donesem);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	unsigned long i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (pilock1 == NULL) {
+		pilock1 = lock_create("pilock1");
+		if (pilock1 == NULL) {
+			panic("pitest: lock_create failed\n");
+		}
+	}
+	if (pilock2 == NULL) {
+		pilock2 = lock_create("pilock2");
+		if (pilock2 == NULL) {
+			panic("pitest: lock_create failed\n");
+		}
+	}
+	pifailed = false;
+
+	kprintf("Starting priority inheritance test...\n");
+
+	for (i=0; i<NPITHREADS; i++) {
+		result = thread_fork("pitest", NULL, pitestthread, NULL, i);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NPITHREADS; i++) {
+		P(donesem);
+	}
+
+	if (pifailed) {
+		kprintf("Test failed\n");
+	}
+	lock_printstats(pilock1);
+	lock_printstats(pilock2);
+	kprintf("Priority inheritance test done.\n");
+	return 0;
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Callouts, kept on a hierarchical timer wheel.
+ *
+ * The wheel has CALLOUT_LEVELS levels of CALLOUT_SLOTS slots each.
+ * Level 0 has one slot per tick; each slot of level N covers as many
+ * ticks as all of level N-1. A callout due in fewer than
+ * CALLOUT_SLOTS ticks goes on level 0 in the slot for the exact tick
+ * it is due; one further away goes on the lowest level whose span
+ * covers it, in the slot its due time falls in.
+ *
+ * Each tick we look at one slot of level 0 and run everything on
+ * it. When the level 0 index wraps to zero, the current slot of
+ * level 1 is emptied and its callouts are put back on the wheel,
+ * which now drops them to level 0 (and likewise upward when level
+ * 1 wraps, and so on). So scheduling and stopping a callout are
+ * O(1), and each callout is moved at most CALLOUT_LEVELS-1 times
+ * before it fires, however many are pending.
+ *
+ * There is one wheel, driven by the hardclock on the boot cpu. That
+ * cpu keeps its clock ticking while idle as long as anything is on
+ * the wheel (see callout_needtick); if the wheel goes from empty to
+ * nonempty while it's idle, we poke it with an IPI so it notices.
+ *
+ * The resolution is one hardclock, 1/HZ seconds.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <callout.h>
+
+#define CALLOUT_LEVELS		4
+#define CALLOUT_SLOTBITS	6
+#define CALLOUT_SLOTS		(1U << CALLOUT_SLOTBITS)
+#define CALLOUT_SLOTMASK	(CALLOUT_SLOTS - 1)
+
+#if CALLOUT_MAXTICKS >= (1U << (CALLOUT_LEVELS * CALLOUT_SLOTBITS))
+#error "CALLOUT_MAXTICKS is too large for the wheel"
+#endif
+
+static struct spinlock callout_lock = SPINLOCK_INITIALIZER;
+
+/* The wheel and its clock. Protected by callout_lock. */
+static struct callout *callout_wheel[CALLOUT_LEVELS][CALLOUT_SLOTS];
+static uint32_t callout_ticks;		/* Ticks processed so far */
+static unsigned callout_count;		/* Callouts on the wheel */
+static struct callout *callout_running;	/* Callout being run, if any */
+
+/* The cpu whose hardclock drives the wheel. Set at boot. */
+static struct cpu *callout_cpu;
+
+/*
+ * Put a callout on the wheel in the right slot for its due time.
+ * A callout due now (this can happen while cascading) goes in the
+ * level 0 slot about to be run.
+ */
+static
+void
+callout_insert(struct callout *co)
+{
+	uint32_t delta;
+	unsigned level, slot;
+	struct callout **head;
+
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+
+	delta = co->co_when - callout_ticks;
+	level = 0;
+	while (level < CALLOUT_LEVELS - 1 &&
+	       delta >= (1U << ((level + 1) * CALLOUT_SLOTBITS))) {
+		level++;
+	}
+	slot = (co->co_when >> (level * CALLOUT_SLOTBITS)) & CALLOUT_SLOTMASK;
+
+	head = &callout_wheel[level][slot];
+	co->co_next = *head;
+	co->co_prevp = head;
+	if (*head != NULL) {
+		(*head)->co_prevp = &co->co_next;
+	}
+	*head = co;
+}
+
+/*
+ * Take a callout off the wheel.
+ */
+static
+void
+callout_unlink(struct callout *co)
+{
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+
+	*co->co_prevp = co->co_next;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = co->co_prevp;
+	}
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+}
+
+/*
+ * Empty the current slot of LEVEL and put its callouts back on the
+ * wheel, which moves them down at least one level.
+ */
+static
+void
+callout_cascade(unsigned level)
+{
+	unsigned slot;
+	struct callout *co, *next;
+
+	slot = (callout_ticks >> (level * CALLOUT_SLOTBITS)) &
+		CALLOUT_SLOTMASK;
+	co = callout_wheel[level][slot];
+	callout_wheel[level][slot] = NULL;
+	while (co != NULL) {
+		next = co->co_next;
+		callout_insert(co);
+		co = next;
+	}
+}
+
+/*
+ * Setup.
+ */
+void
+callout_bootstrap(void)
+{
+	KASSERT(curcpu->c_number == 0);
+	callout_cpu = curcpu->c_self;
+}
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_when = 0;
+	co->co_pending = false;
+	co->co_func = func;
+	co->co_arg = arg;
+}
+
+void
+callout_schedule(struct callout *co, unsigned ticks)
+{
+	bool poke;
+
+	KASSERT(ticks > 0);
+	KASSERT(ticks <= CALLOUT_MAXTICKS);
+
+	spinlock_acquire(&callout_lock);
+	if (co->co_pending) {
+		callout_unlink(co);
+	}
+	else {
+		callout_count++;
+	}
+	co->co_when = callout_ticks + ticks;
+	co->co_pending = true;
+	callout_insert(co);
+
+	/*
+	 * If this is the first callout, the wheel's cpu may have
+	 * stopped its clock; make sure it starts it again.
+	 */
+	poke = callout_count == 1 && callout_cpu != NULL &&
+		callout_cpu != curcpu->c_self && callout_cpu->c_isidle;
+	spinlock_release(&callout_lock);
+
+	if (poke) {
+		ipi_send(callout_cpu, IPI_UNIDLE);
+	}
+}
+
+bool
+callout_stop(struct callout *co)
+{
+	bool pending;
+
+	spinlock_acquire(&callout_lock);
+	pending = co->co_pending;
+	if (pending) {
+		callout_unlink(co);
+		co->co_pending = false;
+		callout_count--;
+	}
+
+	/*
+	 * If it's running, it's running on the wheel's cpu and we're
+	 * somewhere else; it can't take long.
+	 */
+	while (callout_running == co) {
+		KASSERT(curcpu->c_self != callout_cpu);
+		spinlock_release(&callout_lock);
+		spinlock_acquire(&callout_lock);
+	}
+	spinlock_release(&callout_lock);
+
+	return pending;
+}
+
+unsigned
+callout_nstoticks(uint64_t ns)
+{
+	const uint64_t ns_per_tick = 1000000000 / HZ;
+	uint64_t ticks;
+
+	ticks = (ns + ns_per_tick - 1) / ns_per_tick;
+	if (ticks > CALLOUT_MAXTICKS) {
+		ticks = CALLOUT_MAXTICKS;
+	}
+	return ticks;
+}
+
+uint32_t
+callout_now(void)
+{
+	return callout_ticks;
+}
+
+void
+callout_hardclock(void)
+{
+	unsigned level, slot;
+	struct callout *co;
+
+	if (curcpu->c_self != callout_cpu) {
+		return;
+	}
+
+	spinlock_acquire(&callout_lock);
+	callout_ticks++;
+
+	/*
+	 * If the level 0 index wrapped, refill level 0 from level 1,
+	 * and so on up. Anything due right now comes down into the
+	 * level 0 slot we're about to run.
+	 */
+	level = 0;
+	while (level < CALLOUT_LEVELS - 1 &&
+	       ((callout_ticks >> (level * CALLOUT_SLOTBITS)) &
+		CALLOUT_SLOTMASK) == 0) {
+		level++;
+	}
+	while (level > 0) {
+		callout_cascade(level);
+		level--;
+	}
+
+	/* Run everything in this tick's slot. */
+	slot = callout_ticks & CALLOUT_SLOTMASK;
+	while ((co = callout_wheel[0][slot]) != NULL) {
+		KASSERT(co->co_when == callout_ticks);
+		callout_unlink(co);
+		co->co_pending = false;
+		callout_count--;
+		callout_running = co;
+		spinlock_release(&callout_lock);
+
+		co->co_func(co->co_arg);
+
+		spinlock_acquire(&callout_lock);
+		callout_running = NULL;
+	}
+	spinlock_release(&callout_lock);
+}
+
+bool
+callout_needtick(void)
+{
+	return curcpu->c_self == callout_cpu && callout_count > 0;
+}
@@ -28,19 +28,22 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
+#include <callout.h>
+#include <prof.h>
 #include <thread.h>
 #include <current.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * This is pretty primitive. Callbacks at specific points in the
+ * future, with a resolution of one hardclock, are handled by the
+ * callout wheel (see callout.c), which hardclock drives.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,7 +53,7 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	50	/* Age run queues every 50 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
@@ -59,6 +62,13 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * Threads in thread_sleep_ns sleep here; only their own callouts
+ * wake them.
+ */
+static struct wchan *nssleep;
+static struct spinlock nssleep_lock;
+
 /*
  * Setup.
  */
@@ -70,6 +80,12 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+
+	spinlock_init(&nssleep_lock);
+	nssleep = wchan_create("nssleep");
+	if (nssleep == NULL) {
+		panic("Couldn't create nssleep\n");
+	}
 }
 
 /*
@@ -97,13 +113,15 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	prof_hardclock();
+	callout_hardclock();
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_timeslice();
 }
 
 /*
@@ -119,3 +137,61 @@ clocksleep(int num_secs)
 	}
 	spinlock_release(&lbolt_lock);
 }
+
+/*
+ * Suspend execution for at least NS nanoseconds. The resolution is
+ * one hardclock.
+ */
+void
+thread_sleep_ns(uint64_t ns)
+{
+	const uint64_t maxchunk =
+		(uint64_t)(CALLOUT_MAXTICKS - 1) * (1000000000 / HZ);
+	uint64_t chunk;
+
+	spinlock_acquire(&nssleep_lock);
+	while (ns > 0) {
+		chunk = ns < maxchunk ? ns : maxchunk;
+		/* The current tick is already partly over, so add one. */
+		wchan_sleep_timeout(nssleep, &nssleep_lock,
+				    callout_nstoticks(chunk) + 1);
+		ns -= chunk;
+	}
+	spinlock_release(&nssleep_lock);
+}
+
+/*
+ * The same, but give up with EINTR if the thread is interrupted (see
+ * thread_interrupt), setting *LEFT to the part of the time that
+ * hadn't passed yet.
+ */
+int
+thread_sleep_ns_intr(uint64_t ns, uint64_t *left)
+{
+	const uint64_t maxchunk =
+		(uint64_t)(CALLOUT_MAXTICKS - 1) * (1000000000 / HZ);
+	uint64_t chunk, total, start, slept;
+	int result;
+
+	total = ns;
+	start = gettime_ns();
+	result = 0;
+	spinlock_acquire(&nssleep_lock);
+	while (ns > 0) {
+		chunk = ns < maxchunk ? ns : maxchunk;
+		result = wchan_sleep_timeout_intr(nssleep, &nssleep_lock,
+						  callout_nstoticks(chunk) + 1);
+		if (result == EINTR) {
+			break;
+		}
+		ns -= chunk;
+	}
+	spinlock_release(&nssleep_lock);
+
+	if (result != EINTR) {
+		return 0;
+	}
+	slept = gettime_ns() - start;
+	*left = slept < total ? total - slept : 0;
+	return EINTR;
+}
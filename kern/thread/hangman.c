@@ -34,11 +34,168 @@
 #include <types.h>
 #include <lib.h>
 #include <spl.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <hangman.h>
 
 static struct spinlock hangman_lock = SPINLOCK_INITIALIZER;
 
+#if OPT_LOCKPROF
+
+/*
+ * Lock profiler.
+ *
+ * Since every lock already reports to us when an actor starts
+ * waiting for it, gets it, and lets it go, we can time those and
+ * keep totals without touching the locks themselves. The totals are
+ * kept per acquire call site (the caller of spinlock_acquire,
+ * lock_acquire, etc., which HANGMAN_WAIT passes in) rather than per
+ * lock name, since all spinlocks and all ticketlocks share one name.
+ * They live in a fixed-size open hash table; sites that don't fit
+ * are lumped together in the last slot, which is printed as
+ * "(other)". Each entry also keeps (a possibly shortened copy of)
+ * the name of the first lock seen there, since the lock itself may
+ * be gone by the time the table is printed.
+ *
+ * A wait counts as contended if the lock was held when the actor
+ * started waiting. (Every acquisition goes through hangman_wait,
+ * contended or not.) Hold times are only kept for exclusive holds.
+ *
+ * Everything is protected by hangman_lock. Timing is off until
+ * lockprof_enable turns it on, since reading the clock on every lock
+ * operation is not cheap.
+ */
+
+#define LOCKPROF_NSITES		256	/* must be a power of 2 */
+#define LOCKPROF_OTHER		LOCKPROF_NSITES
+#define LOCKPROF_NAMELEN	24
+
+struct lockprof_entry {
+	const void *lp_site;		/* NULL if slot unused */
+	char lp_name[LOCKPROF_NAMELEN];	/* name of a lock seen there */
+	unsigned lp_acquires;		/* times acquired while timing */
+	unsigned lp_contended;		/* ... that had to wait */
+	uint64_t lp_waitns;		/* total time spent waiting */
+	uint64_t lp_maxwait;		/* longest single wait */
+	unsigned lp_holds;		/* exclusive holds timed */
+	uint64_t lp_holdns;		/* total time held */
+	uint64_t lp_maxhold;		/* longest single hold */
+};
+
+static struct lockprof_entry lockprof_table[LOCKPROF_NSITES + 1];
+static bool lockprof_on;
+
+static
+uint64_t
+lockprof_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Find the entry for call site SITE, adding it if need be with the
+ * name of lockable L.
+ */
+static
+struct lockprof_entry *
+lockprof_find(const void *site, const struct hangman_lockable *l)
+{
+	struct lockprof_entry *lp;
+	unsigned i, hash, probe;
+
+	KASSERT(spinlock_do_i_hold(&hangman_lock));
+
+	if (site == NULL) {
+		return &lockprof_table[LOCKPROF_OTHER];
+	}
+
+	/* code addresses are word-aligned */
+	hash = (uintptr_t)site >> 2;
+
+	for (probe = 0; probe < LOCKPROF_NSITES; probe++) {
+		lp = &lockprof_table[(hash + probe) & (LOCKPROF_NSITES - 1)];
+		if (lp->lp_site == NULL) {
+			lp->lp_site = site;
+			for (i=0; i<LOCKPROF_NAMELEN-1 && l->l_name[i] != 0;
+			     i++) {
+				lp->lp_name[i] = l->l_name[i];
+			}
+			lp->lp_name[i] = 0;
+			return lp;
+		}
+		if (lp->lp_site == site) {
+			return lp;
+		}
+	}
+	return &lockprof_table[LOCKPROF_OTHER];
+}
+
+/*
+ * Actor A has got lockable L, having started waiting at
+ * a->a_waitstart. If SHARED, it's not the exclusive holder.
+ */
+static
+void
+lockprof_acquired(struct hangman_actor *a, struct hangman_lockable *l,
+		  bool shared)
+{
+	struct lockprof_entry *lp;
+	uint64_t now, wait;
+
+	if (a->a_waitstart == 0) {
+		/* timing started since we began waiting */
+		return;
+	}
+
+	now = lockprof_now();
+	wait = now - a->a_waitstart;
+	a->a_waitstart = 0;
+
+	lp = lockprof_find(a->a_waitsite, l);
+	lp->lp_acquires++;
+	if (a->a_contended) {
+		lp->lp_contended++;
+		lp->lp_waitns += wait;
+		if (wait > lp->lp_maxwait) {
+			lp->lp_maxwait = wait;
+		}
+	}
+	if (!shared) {
+		l->l_holdstart = now;
+		l->l_holdsite = a->a_waitsite;
+	}
+}
+
+/*
+ * Lockable L is being let go.
+ */
+static
+void
+lockprof_released(struct hangman_lockable *l)
+{
+	struct lockprof_entry *lp;
+	uint64_t hold;
+
+	if (l->l_holdstart == 0) {
+		return;
+	}
+
+	hold = lockprof_now() - l->l_holdstart;
+	l->l_holdstart = 0;
+
+	lp = lockprof_find(l->l_holdsite, l);
+	lp->lp_holds++;
+	lp->lp_holdns += hold;
+	if (hold > lp->lp_maxhold) {
+		lp->lp_maxhold = hold;
+	}
+}
+
+#endif /* OPT_LOCKPROF */
+
 /*
  * Look for a path through the waits-for graph that goes from START to
  * TARGET.
@@ -94,7 +251,8 @@ hangman_check(const struct hangman_lockable *start,
 }
 
 /*
- * Note that a is about to wait for l.
+ * Note that a is about to wait for l, on behalf of the code at SITE
+ * (for the lock profiler).
  *
  * Note that there's no point calling this if a isn't going to wait,
  * because in that case l->l_holding will be null and the check
@@ -108,7 +266,8 @@ hangman_check(const struct hangman_lockable *start,
  */
 void
 hangman_wait(struct hangman_actor *a,
-	     struct hangman_lockable *l)
+	     struct hangman_lockable *l,
+	     const void *site)
 {
 	if (l == &hangman_lock.splk_hangman) {
 		/* don't recurse */
@@ -125,6 +284,16 @@ hangman_wait(struct hangman_actor *a,
 	hangman_check(l, a);
 	a->a_waiting = l;
 
+#if OPT_LOCKPROF
+	if (lockprof_on) {
+		a->a_waitstart = lockprof_now();
+		a->a_waitsite = site;
+		a->a_contended = (l->l_holding != NULL);
+	}
+#else
+	(void)site;
+#endif
+
 	spinlock_release(&hangman_lock);
 }
 
@@ -153,6 +322,37 @@ hangman_acquire(struct hangman_actor *a,
 	l->l_holding = a;
 	a->a_waiting = NULL;
 
+#if OPT_LOCKPROF
+	lockprof_acquired(a, l, false);
+#endif
+
+	spinlock_release(&hangman_lock);
+}
+
+/*
+ * Note that a got l in shared mode (e.g. as a reader of a rwlock).
+ * Shared holders aren't recorded, since a lockable has only one
+ * holder; so we can't see cycles that go through one, only cycles
+ * through l's exclusive holder.
+ */
+void
+hangman_acquire_shared(struct hangman_actor *a,
+		       struct hangman_lockable *l)
+{
+	spinlock_acquire(&hangman_lock);
+
+	if (a->a_waiting != l) {
+		spinlock_release(&hangman_lock);
+		panic("hangman_acquire_shared: not waiting for lock %s (%p)\n",
+		      l->l_name, l);
+	}
+
+	a->a_waiting = NULL;
+
+#if OPT_LOCKPROF
+	lockprof_acquired(a, l, true);
+#endif
+
 	spinlock_release(&hangman_lock);
 }
 
@@ -178,5 +378,108 @@ hangman_release(struct hangman_actor *a,
 
 	l->l_holding = NULL;
 
+#if OPT_LOCKPROF
+	lockprof_released(l);
+#endif
+
 	spinlock_release(&hangman_lock);
 }
+
+#if OPT_LOCKPROF
+
+/*
+ * Turn timing on or off. Waits and holds already in progress when
+ * it's turned on aren't counted.
+ */
+void
+lockprof_enable(bool on)
+{
+	spinlock_acquire(&hangman_lock);
+	lockprof_on = on;
+	spinlock_release(&hangman_lock);
+}
+
+/*
+ * Forget everything recorded so far.
+ */
+void
+lockprof_reset(void)
+{
+	spinlock_acquire(&hangman_lock);
+	bzero(lockprof_table, sizeof(lockprof_table));
+	spinlock_release(&hangman_lock);
+}
+
+/*
+ * Print the call sites with the most contended acquisitions, most
+ * first. If ALL is false, print only the top few.
+ *
+ * The table is copied out first, because we can't hold hangman_lock
+ * while printing: kprintf takes locks, and those come through here.
+ */
+void
+lockprof_dump(bool all)
+{
+	const unsigned maxshown = all ? LOCKPROF_NSITES + 1 : 20;
+	struct lockprof_entry *copy, *lp;
+	unsigned i, shown, best;
+	bool on;
+
+	copy = kmalloc(sizeof(lockprof_table));
+	if (copy == NULL) {
+		kprintf("lockprof: Out of memory\n");
+		return;
+	}
+
+	spinlock_acquire(&hangman_lock);
+	memcpy(copy, lockprof_table, sizeof(lockprof_table));
+	on = lockprof_on;
+	spinlock_release(&hangman_lock);
+
+	kprintf("Lock contention by call site (profiling %s):\n",
+		on ? "on" : "off");
+	kprintf("   %-10s %-23s %9s %9s %11s %11s %11s %11s\n", "site",
+		"name", "acquires", "contended", "avg wait", "max wait",
+		"avg hold", "max hold");
+
+	/*
+	 * Selection sort by contended count, marking off each entry
+	 * as it's printed by zeroing its acquisitions.
+	 */
+	for (shown = 0; shown < maxshown; shown++) {
+		best = LOCKPROF_NSITES + 1;
+		for (i=0; i<=LOCKPROF_NSITES; i++) {
+			if (copy[i].lp_acquires == 0) {
+				continue;
+			}
+			if (best > LOCKPROF_NSITES ||
+			    copy[i].lp_contended > copy[best].lp_contended) {
+				best = i;
+			}
+		}
+		if (best > LOCKPROF_NSITES) {
+			break;
+		}
+		lp = &copy[best];
+		if (lp->lp_contended == 0 && !all) {
+			break;
+		}
+		if (best == LOCKPROF_OTHER) {
+			kprintf("   %-10s %-23s", "", "(other)");
+		}
+		else {
+			kprintf("   %-10p %-23s", lp->lp_site, lp->lp_name);
+		}
+		kprintf(" %9u %9u %9lluns %9lluns %9lluns %9lluns\n",
+			lp->lp_acquires, lp->lp_contended,
+			lp->lp_contended ? lp->lp_waitns / lp->lp_contended : 0,
+			lp->lp_maxwait,
+			lp->lp_holds ? lp->lp_holdns / lp->lp_holds : 0,
+			lp->lp_maxhold);
+		lp->lp_acquires = 0;
+	}
+
+	kfree(copy);
+}
+
+#endif /* OPT_LOCKPROF */
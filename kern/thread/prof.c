@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Sampling profiler.
+ *
+ * While profiling is on, each hardclock records the PC it
+ * interrupted, whether that was in user mode, and the current
+ * process, in a ring buffer belonging to the cpu. Only that cpu
+ * writes its buffer, with interrupts off; readers take the buffer's
+ * spinlock, as does the writer, so a read sees whole samples.
+ *
+ * The buffers are allocated the first time profiling is started and
+ * never freed. Each holds PROF_NSAMPLES samples, about ten seconds'
+ * worth; anything older than that is overwritten and counted as lost.
+ *
+ * prof_dump can only print raw kernel PCs, since the kernel has no
+ * symbol table; feed them to addr2line, or use the kprof program,
+ * which reads the kernel image and sums the samples by function.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <prof.h>
+
+#define PROF_NSAMPLES	1024	/* per cpu */
+#define PROF_NTALLY	256	/* distinct PCs/pids counted by prof_dump */
+#define PROF_NSHOWN	20	/* PCs/pids printed by prof_dump */
+
+struct profbuf {
+	struct spinlock pb_lock;
+	unsigned pb_start;		/* index of oldest sample */
+	unsigned pb_count;		/* number of samples held */
+	unsigned pb_lost;		/* samples overwritten */
+	struct profsample pb_samples[PROF_NSAMPLES];
+};
+
+/* Protected by prof_spinlock; prof_bufs never changes once set. */
+static struct spinlock prof_spinlock = SPINLOCK_INITIALIZER;
+static struct profbuf **prof_bufs;
+static unsigned prof_nbufs;
+static volatile bool prof_on;
+
+/*
+ * Take a sample. Called from hardclock() with interrupts off.
+ */
+void
+prof_hardclock(void)
+{
+	struct profbuf *pb;
+	struct profsample *ps;
+	struct proc *p;
+
+	if (!prof_on) {
+		return;
+	}
+
+	KASSERT(curcpu->c_number < prof_nbufs);
+	pb = prof_bufs[curcpu->c_number];
+	p = curthread->t_proc;
+
+	spinlock_acquire(&pb->pb_lock);
+	if (pb->pb_count == PROF_NSAMPLES) {
+		pb->pb_start = (pb->pb_start + 1) % PROF_NSAMPLES;
+		pb->pb_count--;
+		pb->pb_lost++;
+	}
+	ps = &pb->pb_samples[(pb->pb_start + pb->pb_count) % PROF_NSAMPLES];
+	pb->pb_count++;
+
+	ps->ps_pc = curcpu->c_intrpc;
+	ps->ps_pid = p != NULL ? p->p_pid : 0;
+	ps->ps_cpu = curcpu->c_number;
+	ps->ps_flags = curcpu->c_intruser ? PROF_USER : 0;
+	spinlock_release(&pb->pb_lock);
+}
+
+/*
+ * Start sampling.
+ */
+int
+prof_start(void)
+{
+	struct profbuf **bufs;
+	unsigned i, n;
+
+	if (prof_bufs == NULL) {
+		n = cpu_count();
+		bufs = kmalloc(n * sizeof(*bufs));
+		if (bufs == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<n; i++) {
+			bufs[i] = kmalloc(sizeof(*bufs[i]));
+			if (bufs[i] == NULL) {
+				while (i > 0) {
+					kfree(bufs[--i]);
+				}
+				kfree(bufs);
+				return ENOMEM;
+			}
+			spinlock_init(&bufs[i]->pb_lock);
+			bufs[i]->pb_start = 0;
+			bufs[i]->pb_count = 0;
+			bufs[i]->pb_lost = 0;
+		}
+
+		spinlock_acquire(&prof_spinlock);
+		if (prof_bufs == NULL) {
+			prof_nbufs = n;
+			prof_bufs = bufs;
+			bufs = NULL;
+		}
+		spinlock_release(&prof_spinlock);
+
+		if (bufs != NULL) {
+			/* someone else got there first */
+			for (i=0; i<n; i++) {
+				spinlock_cleanup(&bufs[i]->pb_lock);
+				kfree(bufs[i]);
+			}
+			kfree(bufs);
+		}
+	}
+
+	spinlock_acquire(&prof_spinlock);
+	prof_on = true;
+	spinlock_release(&prof_spinlock);
+	return 0;
+}
+
+/*
+ * Stop sampling.
+ */
+void
+prof_stop(void)
+{
+	spinlock_acquire(&prof_spinlock);
+	prof_on = false;
+	spinlock_release(&prof_spinlock);
+}
+
+/*
+ * Remove up to MAX samples from the buffers and copy them to BUF.
+ */
+unsigned
+prof_read(struct profsample *buf, unsigned max)
+{
+	struct profbuf *pb;
+	unsigned i, got;
+
+	if (prof_bufs == NULL) {
+		return 0;
+	}
+
+	got = 0;
+	for (i=0; i<prof_nbufs && got < max; i++) {
+		pb = prof_bufs[i];
+		spinlock_acquire(&pb->pb_lock);
+		while (pb->pb_count > 0 && got < max) {
+			buf[got++] = pb->pb_samples[pb->pb_start];
+			pb->pb_start = (pb->pb_start + 1) % PROF_NSAMPLES;
+			pb->pb_count--;
+		}
+		spinlock_release(&pb->pb_lock);
+	}
+	return got;
+}
+
+////////////////////////////////////////////////////////////
+// prof_dump
+
+struct proftally {
+	uint32_t pt_key;		/* PC or pid */
+	unsigned pt_count;		/* 0 if slot unused */
+};
+
+/*
+ * Count one more for KEY in TABLE, an open hash table of PROF_NTALLY
+ * slots. Returns false if it's full.
+ */
+static
+bool
+prof_tally(struct proftally *table, uint32_t key)
+{
+	unsigned i, slot;
+
+	for (i=0; i<PROF_NTALLY; i++) {
+		slot = (key / 4 + i) % PROF_NTALLY;
+		if (table[slot].pt_count == 0) {
+			table[slot].pt_key = key;
+			table[slot].pt_count = 1;
+			return true;
+		}
+		if (table[slot].pt_key == key) {
+			table[slot].pt_count++;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Print the biggest PROF_NSHOWN entries of TABLE, biggest first,
+ * consuming the table as we go.
+ */
+static
+void
+prof_printtally(struct proftally *table, const char *fmt, unsigned total)
+{
+	unsigned i, shown, best;
+
+	for (shown = 0; shown < PROF_NSHOWN; shown++) {
+		best = PROF_NTALLY;
+		for (i=0; i<PROF_NTALLY; i++) {
+			if (table[i].pt_count > 0 && (best == PROF_NTALLY ||
+			    table[i].pt_count > table[best].pt_count)) {
+				best = i;
+			}
+		}
+		if (best == PROF_NTALLY) {
+			break;
+		}
+		kprintf(fmt, table[best].pt_key);
+		kprintf(" %8u %3u%%\n", table[best].pt_count,
+			table[best].pt_count * 100 / total);
+		table[best].pt_count = 0;
+	}
+}
+
+/*
+ * Read all the samples and print a summary: the kernel PCs that were
+ * seen most, and the processes that spent most time in user mode.
+ */
+void
+prof_dump(void)
+{
+	struct profsample *samples;
+	struct proftally *kpcs, *upids;
+	unsigned i, n, max, nuser, lost, overflow;
+
+	if (prof_bufs == NULL) {
+		kprintf("prof: no samples (profiling never started)\n");
+		return;
+	}
+
+	max = prof_nbufs * PROF_NSAMPLES;
+	samples = kmalloc(max * sizeof(*samples));
+	kpcs = kmalloc(PROF_NTALLY * sizeof(*kpcs));
+	upids = kmalloc(PROF_NTALLY * sizeof(*upids));
+	if (samples == NULL || kpcs == NULL || upids == NULL) {
+		kprintf("prof: Out of memory\n");
+		kfree(samples);
+		kfree(kpcs);
+		kfree(upids);
+		return;
+	}
+	bzero(kpcs, PROF_NTALLY * sizeof(*kpcs));
+	bzero(upids, PROF_NTALLY * sizeof(*upids));
+
+	lost = 0;
+	for (i=0; i<prof_nbufs; i++) {
+		spinlock_acquire(&prof_bufs[i]->pb_lock);
+		lost += prof_bufs[i]->pb_lost;
+		prof_bufs[i]->pb_lost = 0;
+		spinlock_release(&prof_bufs[i]->pb_lock);
+	}
+	n = prof_read(samples, max);
+
+	nuser = overflow = 0;
+	for (i=0; i<n; i++) {
+		if (samples[i].ps_flags & PROF_USER) {
+			nuser++;
+			if (!prof_tally(upids, samples[i].ps_pid)) {
+				overflow++;
+			}
+		}
+		else {
+			if (!prof_tally(kpcs, samples[i].ps_pc)) {
+				overflow++;
+			}
+		}
+	}
+
+	kprintf("%u samples (%u kernel, %u user), %u lost\n",
+		n, n - nuser, nuser, lost);
+	if (n > nuser) {
+		kprintf("Top kernel PCs:\n");
+		prof_printtally(kpcs, "   0x%08x", n);
+	}
+	if (nuser > 0) {
+		kprintf("User time by process:\n");
+		prof_printtally(upids, "   pid %6d", n);
+	}
+	if (overflow > 0) {
+		kprintf("(%u samples not counted; too many distinct values)\n",
+			overflow);
+	}
+
+	kfree(samples);
+	kfree(kpcs);
+	kfree(upids);
+}
+
+////////////////////////////////////////////////////////////
+// system call
+
+/*
+ * profctl - start or stop profiling, or read samples. For PROF_READ,
+ * BUF has room for LEN bytes of struct profsample and the number of
+ * samples read is returned.
+ */
+int
+sys_profctl(int op, userptr_t buf, size_t len, int *retval)
+{
+	struct profsample *kbuf;
+	unsigned max, chunk, got, total;
+	int result;
+
+	switch (op) {
+	    case PROF_START:
+		*retval = 0;
+		return prof_start();
+	    case PROF_STOP:
+		prof_stop();
+		*retval = 0;
+		return 0;
+	    case PROF_READ:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	max = len / sizeof(struct profsample);
+	chunk = max < PROF_NSAMPLES ? max : PROF_NSAMPLES;
+	if (chunk == 0) {
+		*retval = 0;
+		return 0;
+	}
+	kbuf = kmalloc(chunk * sizeof(*kbuf));
+	if (kbuf == NULL) {
+		return ENOMEM;
+	}
+
+	total = 0;
+	while (total < max) {
+		got = prof_read(kbuf, chunk < max - total ?
+				chunk : max - total);
+		if (got == 0) {
+			break;
+		}
+		result = copyout(kbuf, buf, got * sizeof(*kbuf));
+		if (result) {
+			kfree(kbuf);
+			return result;
+		}
+		buf += got * sizeof(*kbuf);
+		total += got;
+	}
+
+	kfree(kbuf);
+	*retval = total;
+	return 0;
+}
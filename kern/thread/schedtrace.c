@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scheduler tracing.
+ *
+ * Each cpu has a ring buffer of events. Only that cpu writes its
+ * buffer, with interrupts off; readers take the buffer's spinlock, as
+ * does the writer, so a read sees whole events. The buffer locks are
+ * leaves: events are recorded with runqueue and IPI locks held.
+ *
+ * The buffers are allocated the first time tracing is started and
+ * never freed. Each holds SCHEDTRACE_NEVENTS events; on a busy
+ * system that's well under a second, so read them promptly or only
+ * trace for a moment.
+ *
+ * Threads are recorded by address, since names and pids can be gone
+ * by the time anyone looks.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <lamebus/ltrace.h>
+#include <schedtrace.h>
+
+#define SCHEDTRACE_NEVENTS	1024	/* per cpu */
+#define SCHEDTRACE_LINEMAX	80	/* longest formatted event */
+
+/*
+ * Code passed to ltrace_debug when mirroring: 0x5cTCxxxx, where T is
+ * the event type, C the cpu (mod 16), and xxxx the low half of the
+ * first argument.
+ */
+#define SCHEDTRACE_LTCODE(type, cpu, a1) \
+	(0x5c000000U | ((type) & 0xf) << 20 | ((cpu) & 0xf) << 16 | \
+	 ((a1) & 0xffff))
+
+struct schedevent {
+	uint64_t se_time;		/* gettime_ns() */
+	uint32_t se_args[3];
+	uint8_t se_type;
+	uint8_t se_cpu;
+};
+
+struct tracebuf {
+	struct spinlock tb_lock;
+	unsigned tb_start;		/* index of oldest event */
+	unsigned tb_count;		/* number of events held */
+	unsigned tb_lost;		/* events overwritten */
+	struct schedevent tb_events[SCHEDTRACE_NEVENTS];
+};
+
+/* Protected by schedtrace_spinlock; schedtrace_bufs never changes once set. */
+static struct spinlock schedtrace_spinlock = SPINLOCK_INITIALIZER;
+static struct tracebuf **schedtrace_bufs;
+static unsigned schedtrace_nbufs;
+volatile bool schedtrace_on;
+static volatile bool schedtrace_ltrace;
+
+static const char *const schedtrace_states[] = {
+	"run", "ready", "sleep", "zombie",
+};
+
+/*
+ * Record an event. Called through SCHEDTRACE() only when tracing is
+ * on, from anywhere in the scheduler.
+ */
+void
+schedtrace_record(unsigned type, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	struct tracebuf *tb;
+	struct schedevent *se;
+	unsigned cpunum;
+	int spl;
+
+	KASSERT(type < SCHEDTRACE_NTYPES);
+
+	/* Stay on this cpu while we find and fill its buffer. */
+	spl = splhigh();
+	cpunum = curcpu->c_number;
+	KASSERT(cpunum < schedtrace_nbufs);
+	tb = schedtrace_bufs[cpunum];
+
+	spinlock_acquire(&tb->tb_lock);
+	if (tb->tb_count == SCHEDTRACE_NEVENTS) {
+		tb->tb_start = (tb->tb_start + 1) % SCHEDTRACE_NEVENTS;
+		tb->tb_count--;
+		tb->tb_lost++;
+	}
+	se = &tb->tb_events[(tb->tb_start + tb->tb_count) % SCHEDTRACE_NEVENTS];
+	tb->tb_count++;
+
+	se->se_time = gettime_ns();
+	se->se_args[0] = a1;
+	se->se_args[1] = a2;
+	se->se_args[2] = a3;
+	se->se_type = type;
+	se->se_cpu = cpunum;
+	spinlock_release(&tb->tb_lock);
+
+	if (schedtrace_ltrace) {
+		ltrace_debug(SCHEDTRACE_LTCODE(type, cpunum, a1));
+	}
+	splx(spl);
+}
+
+/*
+ * Start tracing.
+ */
+int
+schedtrace_start(void)
+{
+	struct tracebuf **bufs;
+	unsigned i, n;
+
+	if (schedtrace_bufs == NULL) {
+		n = cpu_count();
+		bufs = kmalloc(n * sizeof(*bufs));
+		if (bufs == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<n; i++) {
+			bufs[i] = kmalloc(sizeof(*bufs[i]));
+			if (bufs[i] == NULL) {
+				while (i > 0) {
+					kfree(bufs[--i]);
+				}
+				kfree(bufs);
+				return ENOMEM;
+			}
+			spinlock_init(&bufs[i]->tb_lock);
+			bufs[i]->tb_start = 0;
+			bufs[i]->tb_count = 0;
+			bufs[i]->tb_lost = 0;
+		}
+
+		spinlock_acquire(&schedtrace_spinlock);
+		if (schedtrace_bufs == NULL) {
+			schedtrace_nbufs = n;
+			schedtrace_bufs = bufs;
+			bufs = NULL;
+		}
+		spinlock_release(&schedtrace_spinlock);
+
+		if (bufs != NULL) {
+			/* someone else got there first */
+			for (i=0; i<n; i++) {
+				spinlock_cleanup(&bufs[i]->tb_lock);
+				kfree(bufs[i]);
+			}
+			kfree(bufs);
+		}
+	}
+
+	spinlock_acquire(&schedtrace_spinlock);
+	schedtrace_on = true;
+	spinlock_release(&schedtrace_spinlock);
+	return 0;
+}
+
+/*
+ * Stop tracing.
+ */
+void
+schedtrace_stop(void)
+{
+	spinlock_acquire(&schedtrace_spinlock);
+	schedtrace_on = false;
+	spinlock_release(&schedtrace_spinlock);
+}
+
+/*
+ * Turn mirroring of events to ltrace_debug on or off.
+ */
+void
+schedtrace_mirror(bool on)
+{
+	spinlock_acquire(&schedtrace_spinlock);
+	schedtrace_ltrace = on;
+	spinlock_release(&schedtrace_spinlock);
+}
+
+/*
+ * Format SE as a line of text into BUF, which is at least
+ * SCHEDTRACE_LINEMAX bytes. Returns the length.
+ */
+static
+size_t
+schedtrace_format(const struct schedevent *se, char *buf)
+{
+	const uint32_t *a = se->se_args;
+	size_t len;
+
+	len = snprintf(buf, SCHEDTRACE_LINEMAX, "%llu.%09llu cpu%u ",
+		       se->se_time / 1000000000ULL,
+		       se->se_time % 1000000000ULL, se->se_cpu);
+
+	switch (se->se_type) {
+	    case SCHEDTRACE_SWITCH:
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+				"switch 0x%08x -> 0x%08x (%s)\n",
+				a[0], a[1], a[2] < 4 ?
+				schedtrace_states[a[2]] : "?");
+		break;
+	    case SCHEDTRACE_WAKEUP:
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+				"wakeup 0x%08x on cpu%u prio %u\n",
+				a[0], a[1], a[2]);
+		break;
+	    case SCHEDTRACE_MIGRATE:
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+				"migrate 0x%08x cpu%u -> cpu%u\n",
+				a[0], a[1], a[2]);
+		break;
+	    case SCHEDTRACE_IPISEND:
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+				"ipi to cpu%u code %u", a[0], a[1]);
+		if (a[1] == IPI_TLBSHOOTDOWN) {
+			len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+					" (%u shootdowns)", a[2]);
+		}
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len, "\n");
+		break;
+	    case SCHEDTRACE_IPIRECV:
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+				"ipi received 0x%x\n", a[0]);
+		break;
+	    case SCHEDTRACE_ENQUEUE:
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+				"enqueue 0x%08x on cpu%u, %u waiting\n",
+				a[0], a[1], a[2]);
+		break;
+	    case SCHEDTRACE_DEQUEUE:
+		len += snprintf(buf + len, SCHEDTRACE_LINEMAX - len,
+				"dequeue 0x%08x from cpu%u, %u waiting\n",
+				a[0], a[1], a[2]);
+		break;
+	    default:
+		panic("schedtrace: bad event type %u\n", se->se_type);
+	}
+	return len;
+}
+
+/*
+ * Remove the oldest event across all the cpus and format it into
+ * BUF, provided it takes no more than ROOM bytes. Returns the length,
+ * or 0 if there are no events or the next one doesn't fit.
+ *
+ * The cpus are compared without holding all their locks at once, so
+ * events recorded while this runs may come out slightly out of order.
+ */
+static
+size_t
+schedtrace_readline(char *buf, size_t room)
+{
+	struct tracebuf *tb;
+	unsigned i, best;
+	uint64_t besttime;
+	size_t len;
+
+	if (schedtrace_bufs == NULL) {
+		return 0;
+	}
+
+	best = schedtrace_nbufs;
+	besttime = 0;
+	for (i=0; i<schedtrace_nbufs; i++) {
+		tb = schedtrace_bufs[i];
+		spinlock_acquire(&tb->tb_lock);
+		if (tb->tb_count > 0 && (best == schedtrace_nbufs ||
+		    tb->tb_events[tb->tb_start].se_time < besttime)) {
+			best = i;
+			besttime = tb->tb_events[tb->tb_start].se_time;
+		}
+		spinlock_release(&tb->tb_lock);
+	}
+	if (best == schedtrace_nbufs) {
+		return 0;
+	}
+
+	tb = schedtrace_bufs[best];
+	spinlock_acquire(&tb->tb_lock);
+	if (tb->tb_count == 0) {
+		/* another reader got there first */
+		spinlock_release(&tb->tb_lock);
+		return 0;
+	}
+	len = schedtrace_format(&tb->tb_events[tb->tb_start], buf);
+	if (len <= room) {
+		tb->tb_start = (tb->tb_start + 1) % SCHEDTRACE_NEVENTS;
+		tb->tb_count--;
+	}
+	spinlock_release(&tb->tb_lock);
+	return len <= room ? len : 0;
+}
+
+/*
+ * Print and discard all the events.
+ */
+void
+schedtrace_dump(void)
+{
+	char buf[SCHEDTRACE_LINEMAX];
+	unsigned i, lost, n;
+
+	if (schedtrace_bufs == NULL) {
+		kprintf("schedtrace: no events (tracing never started)\n");
+		return;
+	}
+
+	lost = 0;
+	for (i=0; i<schedtrace_nbufs; i++) {
+		spinlock_acquire(&schedtrace_bufs[i]->tb_lock);
+		lost += schedtrace_bufs[i]->tb_lost;
+		schedtrace_bufs[i]->tb_lost = 0;
+		spinlock_release(&schedtrace_bufs[i]->tb_lock);
+	}
+
+	/*
+	 * If tracing is on, printing generates more events; stop after
+	 * what was there to begin with.
+	 */
+	for (n = 0; n < schedtrace_nbufs * SCHEDTRACE_NEVENTS; n++) {
+		if (schedtrace_readline(buf, sizeof(buf)) == 0) {
+			break;
+		}
+		kprintf("%s", buf);
+	}
+	kprintf("%u events, %u lost\n", n, lost);
+}
+
+////////////////////////////////////////////////////////////
+// trace: device
+
+/* For open() */
+static
+int
+schedtrace_devopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if ((openflags & O_ACCMODE) != O_RDONLY) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * For d_io(). Reading gives as many whole events as fit, oldest
+ * first, and removes them; EOF means there are none left for now.
+ */
+static
+int
+schedtrace_devio(struct device *dev, struct uio *uio)
+{
+	char buf[SCHEDTRACE_LINEMAX];
+	size_t len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EINVAL;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = schedtrace_readline(buf, uio->uio_resid);
+		if (len == 0) {
+			break;
+		}
+		result = uiomove(buf, len, uio);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/* For ioctl() */
+static
+int
+schedtrace_devioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops schedtrace_devops = {
+	.devop_eachopen = schedtrace_devopen,
+	.devop_io = schedtrace_devio,
+	.devop_ioctl = schedtrace_devioctl,
+};
+
+/*
+ * Create and attach trace:. Tracing itself stays off until started
+ * from the menu.
+ */
+void
+schedtrace_bootstrap(void)
+{
+	int result;
+	struct device *dev;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev == NULL) {
+		panic("Could not add trace device: out of memory\n");
+	}
+
+	dev->d_ops = &schedtrace_devops;
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+	dev->d_data = NULL;
+
+	result = vfs_adddev("trace", dev, 0);
+	if (result) {
+		panic("Could not add trace device: %s\n", strerror(result));
+	}
+}
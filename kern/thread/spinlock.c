@@ -43,6 +43,141 @@
  * Spinlocks.
  */
 
+/*
+ * Backoff. When the lock is busy we wait a while before looking at
+ * it again, doubling the wait each time up to SPINLOCK_BACKOFF_MAX.
+ * This keeps a crowd of cpus from all hammering the lock word (and
+ * the bus) the moment it is released.
+ */
+#define SPINLOCK_BACKOFF_MIN	1
+#define SPINLOCK_BACKOFF_MAX	1024
+
+#if OPT_SPINSTATS
+/*
+ * Contention statistics. Each spinlock counts its own acquisitions,
+ * contended acquisitions, and failed attempts; these are updated
+ * while the lock is held so they need no further protection. The
+ * first time a lock is contended it gets an entry in spinstat_table[],
+ * with its address and the caller that was made to wait, so
+ * spinlock_printstats can find it.
+ *
+ * Spinlocks live inside things that get freed, so the table must not
+ * be left pointing at one. spinlock_cleanup copies the final counts
+ * into the entry and clears ss_lock; from then on the entry stands
+ * on its own. If the table is full, a newly contended lock takes
+ * over the least contended entry whose lock is gone.
+ *
+ * The table is protected by spinstat_lock, which is itself never
+ * entered in the table.
+ */
+#define SPINSTAT_NLOCKS	64
+
+struct spinstat {
+	struct spinlock *ss_lock;	/* the lock, or NULL if gone */
+	const void *ss_addr;		/* where it was; NULL if unused */
+	const void *ss_site;		/* caller of first contention */
+	unsigned ss_acquires;		/* counts, once ss_lock is gone */
+	unsigned ss_contended;
+	unsigned ss_spins;
+};
+
+static struct spinlock spinstat_lock = SPINLOCK_INITIALIZER;
+static struct spinstat spinstat_table[SPINSTAT_NLOCKS];
+static unsigned spinstat_dropped;	/* contended but no room */
+
+static
+void
+spinstat_list(struct spinlock *splk, const void *site)
+{
+	struct spinstat *ss, *victim;
+	unsigned i;
+
+	spinlock_acquire(&spinstat_lock);
+	victim = NULL;
+	for (i=0; i<SPINSTAT_NLOCKS; i++) {
+		ss = &spinstat_table[i];
+		if (ss->ss_addr == NULL) {
+			victim = ss;
+			break;
+		}
+		if (ss->ss_lock == NULL &&
+		    (victim == NULL ||
+		     ss->ss_contended < victim->ss_contended)) {
+			victim = ss;
+		}
+	}
+	if (victim != NULL) {
+		if (victim->ss_addr != NULL) {
+			spinstat_dropped++;
+		}
+		victim->ss_lock = splk;
+		victim->ss_addr = splk;
+		victim->ss_site = site;
+	}
+	else {
+		spinstat_dropped++;
+	}
+	spinlock_release(&spinstat_lock);
+
+	/* Either way, don't try again. */
+	splk->splk_listed = true;
+}
+
+static
+void
+spinstat_unlist(struct spinlock *splk)
+{
+	struct spinstat *ss;
+	unsigned i;
+
+	spinlock_acquire(&spinstat_lock);
+	for (i=0; i<SPINSTAT_NLOCKS; i++) {
+		ss = &spinstat_table[i];
+		if (ss->ss_lock == splk) {
+			ss->ss_acquires = splk->splk_acquires;
+			ss->ss_contended = splk->splk_contended;
+			ss->ss_spins = splk->splk_spins;
+			ss->ss_lock = NULL;
+			break;
+		}
+	}
+	spinlock_release(&spinstat_lock);
+}
+
+/*
+ * Get the current counts for entry SS. Must hold spinstat_lock.
+ */
+static
+void
+spinstat_get(const struct spinstat *ss, unsigned *acquires,
+	     unsigned *contended, unsigned *spins)
+{
+	if (ss->ss_lock != NULL) {
+		*acquires = ss->ss_lock->splk_acquires;
+		*contended = ss->ss_lock->splk_contended;
+		*spins = ss->ss_lock->splk_spins;
+	}
+	else {
+		*acquires = ss->ss_acquires;
+		*contended = ss->ss_contended;
+		*spins = ss->ss_spins;
+	}
+}
+#endif /* OPT_SPINSTATS */
+
+/*
+ * Wait for roughly N loop iterations.
+ */
+static
+void
+spinlock_backoff(unsigned n)
+{
+	volatile unsigned i;
+
+	for (i=0; i<n; i++) {
+		/* nothing */
+	}
+}
 
 /*
  * Initialize spinlock.
@@ -53,6 +188,12 @@ spinlock_init(struct spinlock *splk)
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+#if OPT_SPINSTATS
+	splk->splk_acquires = 0;
+	splk->splk_contended = 0;
+	splk->splk_spins = 0;
+	splk->splk_listed = false;
+#endif
 }
 
 /*
@@ -63,6 +204,11 @@ spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
 	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+#if OPT_SPINSTATS
+	if (splk->splk_listed) {
+		spinstat_unlist(splk);
+	}
+#endif
 }
 
 /*
@@ -70,12 +216,14 @@ spinlock_cleanup(struct spinlock *splk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to wait for the lock to be free, backing off
+ * between attempts.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	unsigned backoff, spins;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,6 +241,8 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
+	backoff = SPINLOCK_BACKOFF_MIN;
+	spins = 0;
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -104,18 +254,33 @@ spinlock_acquire(struct spinlock *splk)
 		 * previously unheld and we now own it. If it was 1,
 		 * we don't.
 		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+		if (spinlock_data_get(&splk->splk_lock) == 0 &&
+		    spinlock_data_testandset(&splk->splk_lock) == 0) {
+			break;
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+		spins++;
+		spinlock_backoff(backoff);
+		if (backoff < SPINLOCK_BACKOFF_MAX) {
+			backoff *= 2;
 		}
-		break;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
 
+#if OPT_SPINSTATS
+	splk->splk_acquires++;
+	if (spins > 0) {
+		splk->splk_contended++;
+		splk->splk_spins += spins;
+		if (!splk->splk_listed && splk != &spinstat_lock) {
+			spinstat_list(splk, __builtin_return_address(0));
+		}
+	}
+#else
+	(void)spins;
+#endif
+
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
@@ -154,3 +319,82 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the contended-lock table, most contended first. Locks that
+ * have since been cleaned up are marked "(gone)".
+ *
+ * The entries are copied out one at a time so that we aren't holding
+ * spinstat_lock while printing; kprintf takes its own spinlock, which
+ * might need to get into the table.
+ */
+void
+spinlock_printstats(void)
+{
+#if OPT_SPINSTATS
+	const struct spinstat *ss;
+	unsigned i, shown, best, dropped;
+	unsigned bestcount, lastcount, lastindex;
+	unsigned acquires, contended, spins;
+	const void *addr, *site;
+	bool gone;
+
+	kprintf("Contended spinlocks:\n");
+	kprintf("   lock        first site     acquires  contended"
+		"      spins\n");
+
+	/*
+	 * Selection sort by (contended, index) descending, as in
+	 * kheap_profdump.
+	 */
+	lastcount = (unsigned)-1;
+	lastindex = SPINSTAT_NLOCKS;
+	for (shown = 0; shown < SPINSTAT_NLOCKS; shown++) {
+		spinlock_acquire(&spinstat_lock);
+		best = SPINSTAT_NLOCKS;
+		bestcount = 0;
+		for (i=0; i<SPINSTAT_NLOCKS; i++) {
+			ss = &spinstat_table[i];
+			if (ss->ss_addr == NULL) {
+				continue;
+			}
+			spinstat_get(ss, &acquires, &contended, &spins);
+			if (contended > lastcount ||
+			    (contended == lastcount && i <= lastindex)) {
+				/* already printed */
+				continue;
+			}
+			if (best == SPINSTAT_NLOCKS ||
+			    contended > bestcount) {
+				best = i;
+				bestcount = contended;
+			}
+		}
+		if (best == SPINSTAT_NLOCKS) {
+			spinlock_release(&spinstat_lock);
+			break;
+		}
+		ss = &spinstat_table[best];
+		spinstat_get(ss, &acquires, &contended, &spins);
+		addr = ss->ss_addr;
+		site = ss->ss_site;
+		gone = (ss->ss_lock == NULL);
+		spinlock_release(&spinstat_lock);
+
+		kprintf("   %p  %p  %9u  %9u  %9u%s\n", addr, site,
+			acquires, contended, spins, gone ? " (gone)" : "");
+		lastcount = bestcount;
+		lastindex = best;
+	}
+
+	spinlock_acquire(&spinstat_lock);
+	dropped = spinstat_dropped;
+	spinlock_release(&spinstat_lock);
+	if (dropped > 0) {
+		kprintf("   (%u more contended locks not recorded, "
+			"or since forgotten)\n", dropped);
+	}
+#else
+	kprintf("Enable the spinstats option to use this functionality.\n");
+#endif
+}
@@ -33,12 +33,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <callout.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -120,6 +123,58 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+int
+P_timeout(struct semaphore *sem, uint64_t ns)
+{
+	uint32_t deadline, now;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	/*
+	 * Wake-ups that don't get us the semaphore mustn't restart
+	 * the clock, so work from a deadline on the callout clock.
+	 */
+	deadline = callout_now() + callout_nstoticks(ns);
+
+	spinlock_acquire(&sem->sem_lock);
+	while (sem->sem_count == 0) {
+		now = callout_now();
+		if ((int32_t)(deadline - now) <= 0) {
+			spinlock_release(&sem->sem_lock);
+			return ETIMEDOUT;
+		}
+		wchan_sleep_timeout(sem->sem_wchan, &sem->sem_lock,
+				    deadline - now);
+	}
+	KASSERT(sem->sem_count > 0);
+	sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
+int
+P_intr(struct semaphore *sem)
+{
+	int result;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&sem->sem_lock);
+	while (sem->sem_count == 0) {
+		result = wchan_sleep_intr(sem->sem_wchan, &sem->sem_lock);
+		if (result) {
+			spinlock_release(&sem->sem_lock);
+			return result;
+		}
+	}
+	KASSERT(sem->sem_count > 0);
+	sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -137,6 +192,52 @@ V(struct semaphore *sem)
 ////////////////////////////////////////////////////////////
 //
 // Lock.
+//
+// Locks are adaptive: a thread that finds the lock held spins for a
+// while if the holder is running (on another cpu, necessarily), on
+// the theory that it will let go before we could get to sleep and be
+// woken up again, and sleeps if the holder isn't running or we've
+// spun for too long.
+//
+// Whether the holder is running is checked under lk_lock; while we
+// hold that, the holder can't release the lock and so can't have
+// gone away. While actually spinning we don't hold lk_lock and only
+// compare the holder pointer, never dereference it.
+//
+// A thread that goes to sleep lends its priority to the holder (see
+// thread_lendpriority), and if the holder is itself asleep waiting
+// for a lock, to that lock's holder, and so on, up to LOCK_PI_MAXDEPTH
+// locks along. Walking this chain means looking at other locks and
+// threads whose lk_locks we don't hold, so it's done under one global
+// spinlock, lock_pi_lock, taken only on the slow paths:
+//
+//    - t_waitlock is only set or cleared holding lock_pi_lock, so a
+//      lock found that way can't be destroyed while we hold it (the
+//      waiter hasn't returned from lock_acquire). It's cleared by
+//      the thread that wakes the waiter, so it never outlives the
+//      sleep;
+//
+//    - while a lock has waiters (lk_waiters > 0) or has lent
+//      priority (lk_lent), its lk_holder only changes holding
+//      lock_pi_lock too, so the holder found that way is still the
+//      holder and can't go away.
+//
+// lock_pi_lock is taken after lk_lock and before the runqueue locks.
+
+/* Spin this many times between checks that the holder is running. */
+#define LOCK_SPIN_BATCH		64
+/* Give up spinning and sleep after this many spins in total. */
+#define LOCK_SPIN_MAX		4096
+/* Lend priority along chains of at most this many locks. */
+#define LOCK_PI_MAXDEPTH	8
+
+static struct spinlock lock_pi_lock = SPINLOCK_INITIALIZER;
+
+/* Totals over all locks, for contended acquisitions only. */
+static struct spinlock lock_totals_lock = SPINLOCK_INITIALIZER;
+static unsigned lock_total_contended;
+static unsigned lock_total_slept;
+static unsigned lock_total_spins;
 
 struct lock *
 lock_create(const char *name)
@@ -164,6 +265,12 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	lock->lk_waiters = 0;
+	lock->lk_lent = false;
+	lock->lk_acquires = 0;
+	lock->lk_contended = 0;
+	lock->lk_slept = 0;
+	lock->lk_spins = 0;
 
 	return lock;
 }
@@ -174,6 +281,7 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_waiters == 0);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,9 +289,138 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Spin until the lock is no longer held by HOLDER, for at most
+ * LOCK_SPIN_BATCH iterations. Returns the number of iterations.
+ */
+static
+unsigned
+lock_spin(struct lock *lock, struct thread *holder)
+{
+	unsigned i;
+
+	for (i=0; i<LOCK_SPIN_BATCH && lock->lk_holder == holder; i++) {
+		/* nothing */
+	}
+	return i;
+}
+
+/*
+ * Lend priority PRIO to the holder of LOCK, and on down the chain.
+ */
+static
+void
+lock_lendpriority(struct lock *lock, unsigned prio)
+{
+	struct thread *holder;
+	unsigned depth;
+
+	KASSERT(spinlock_do_i_hold(&lock_pi_lock));
+
+	for (depth = 0; depth < LOCK_PI_MAXDEPTH; depth++) {
+		holder = lock->lk_holder;
+		if (holder == NULL || holder->t_priority <= prio) {
+			break;
+		}
+		thread_lendpriority(holder, prio, !lock->lk_lent);
+		lock->lk_lent = true;
+
+		lock = holder->t_waitlock;
+		if (lock == NULL) {
+			break;
+		}
+	}
+}
+
+/*
+ * Set the holder of LOCK. Must hold lk_lock.
+ *
+ * Loans made through the lock belong to the holder that got them,
+ * so they end whenever the holder changes. If there are threads
+ * still asleep waiting for it, a new holder gets the best of their
+ * priorities straight away; otherwise one that took the lock ahead
+ * of them (being woken first, or barging in) would hold it at its
+ * own priority.
+ */
+static
+void
+lock_setholder(struct lock *lock, struct thread *t)
+{
+	unsigned prio;
+
+	if (lock->lk_waiters == 0 && !lock->lk_lent) {
+		lock->lk_holder = t;
+		return;
+	}
+
+	spinlock_acquire(&lock_pi_lock);
+	if (lock->lk_lent) {
+		/* Only a holder gets loans, and only it gives it up. */
+		KASSERT(lock->lk_holder == curthread);
+		lock->lk_lent = false;
+		thread_unlendpriority();
+	}
+	lock->lk_holder = t;
+	if (t != NULL && lock->lk_waiters > 0) {
+		prio = wchan_toppriority(lock->lk_wchan, &lock->lk_lock);
+		if (prio < NPRIORITIES) {
+			lock_lendpriority(lock, prio);
+		}
+	}
+	spinlock_release(&lock_pi_lock);
+}
+
+/*
+ * Sleep until LOCK might be free, lending our priority to whoever is
+ * in the way. Must hold lk_lock.
+ *
+ * Whoever wakes us takes us out of lk_waiters and clears t_waitlock
+ * (see lock_wakeone), so that from then on nobody lends through us
+ * to a lock we're no longer asleep on.
+ */
+static
+void
+lock_sleep(struct lock *lock)
+{
+	lock->lk_waiters++;
+	spinlock_acquire(&lock_pi_lock);
+	curthread->t_waitlock = lock;
+	lock_lendpriority(lock, curthread->t_priority);
+	spinlock_release(&lock_pi_lock);
+
+	wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+	KASSERT(curthread->t_waitlock == NULL);
+}
+
+/*
+ * Wake one thread asleep on LOCK, if there are any. Must hold
+ * lk_lock, which also keeps the woken thread from getting anywhere
+ * until we're done with it.
+ */
+static
+void
+lock_wakeone(struct lock *lock)
+{
+	struct thread *t;
+
+	t = wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	if (t == NULL) {
+		return;
+	}
+	spinlock_acquire(&lock_pi_lock);
+	KASSERT(lock->lk_waiters > 0);
+	lock->lk_waiters--;
+	t->t_waitlock = NULL;
+	spinlock_release(&lock_pi_lock);
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	unsigned spins;
+	bool contended, slept;
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,16 +430,47 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
-		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+	contended = (lock->lk_holder != NULL);
+	slept = false;
+	spins = 0;
+	while ((holder = lock->lk_holder) != NULL) {
+		if (spins < LOCK_SPIN_MAX && holder->t_state == S_RUN) {
+			/* Holder is on a cpu; wait for it without lk_lock. */
+			spinlock_release(&lock->lk_lock);
+			spins += lock_spin(lock, holder);
+			spinlock_acquire(&lock->lk_lock);
+		}
+		else {
+			/* As in the semaphore, but lending priority. */
+			slept = true;
+			lock_sleep(lock);
+		}
+	}
+	lock_setholder(lock, curthread);
+
+	lock->lk_acquires++;
+	if (contended) {
+		lock->lk_contended++;
+		lock->lk_spins += spins;
+		if (slept) {
+			lock->lk_slept++;
+		}
 	}
-	lock->lk_holder = curthread;
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
 
 	spinlock_release(&lock->lk_lock);
+
+	if (contended) {
+		spinlock_acquire(&lock_totals_lock);
+		lock_total_contended++;
+		lock_total_spins += spins;
+		if (slept) {
+			lock_total_slept++;
+		}
+		spinlock_release(&lock_totals_lock);
+	}
 }
 
 void
@@ -213,8 +481,8 @@ lock_release(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
-	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	lock_setholder(lock, NULL);
+	lock_wakeone(lock);
 
 	/* Call this (atomically) when the lock is released */
 	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
@@ -236,6 +504,34 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+void
+lock_printstats(struct lock *lock)
+{
+	unsigned acquires, contended, slept, spins;
+
+	spinlock_acquire(&lock->lk_lock);
+	acquires = lock->lk_acquires;
+	contended = lock->lk_contended;
+	slept = lock->lk_slept;
+	spins = lock->lk_spins;
+	spinlock_release(&lock->lk_lock);
+
+	kprintf("%s: %u acquired, %u contended (%u spun, %u slept), "
+		"%u spins\n", lock->lk_name, acquires, contended,
+		contended - slept, slept, spins);
+}
+
+void
+lock_printtotals(void)
+{
+	spinlock_acquire(&lock_totals_lock);
+	kprintf("Locks: %u contended acquisitions, %u got by spinning, "
+		"%u slept, %u spins\n", lock_total_contended,
+		lock_total_contended - lock_total_slept, lock_total_slept,
+		lock_total_spins);
+	spinlock_release(&lock_totals_lock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -298,20 +594,267 @@ cv_wait(struct cv *cv, struct lock *lock)
 	lock_acquire(lock);
 }
 
+int
+cv_wait_timeout(struct cv *cv, struct lock *lock, uint64_t ns)
+{
+	unsigned ticks;
+	int result;
+
+	ticks = callout_nstoticks(ns);
+	if (ticks == 0) {
+		return ETIMEDOUT;
+	}
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	lock_release(lock);
+	result = wchan_sleep_timeout(cv->cv_wchan, &cv->cv_wchanlock, ticks);
+	spinlock_release(&cv->cv_wchanlock);
+	lock_acquire(lock);
+	return result;
+}
+
+int
+cv_wait_intr(struct cv *cv, struct lock *lock)
+{
+	int result;
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	lock_release(lock);
+	result = wchan_sleep_intr(cv->cv_wchan, &cv->cv_wchanlock);
+	spinlock_release(&cv->cv_wchanlock);
+	lock_acquire(lock);
+	return result;
+}
+
+/*
+ * Wait morphing. If the caller holds the lock, waking waiters is
+ * pointless: the first thing they'll do is block on the lock. So
+ * instead move up to MAX of them straight onto the lock's wait
+ * channel, where lock_release will wake them one at a time; from
+ * then on they count as the lock's waiters. Returns the number
+ * moved, which is none if the caller doesn't hold the lock.
+ *
+ * Waiters in cv_wait_timeout or cv_wait_intr aren't moved (see
+ * wchan_requeue), so that they keep their timeout or stay
+ * interruptible; they have to be woken as usual.
+ *
+ * The order cv_wchanlock, then lk_lock, is the same as in cv_wait.
+ */
+static
+unsigned
+cv_morph(struct cv *cv, struct lock *lock, unsigned max)
+{
+	unsigned moved, prio;
+
+	KASSERT(spinlock_do_i_hold(&cv->cv_wchanlock));
+
+	moved = 0;
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		moved = wchan_requeue(cv->cv_wchan, &cv->cv_wchanlock,
+				      lock->lk_wchan, &lock->lk_lock, max);
+		if (moved > 0) {
+			/* They're waiting for the lock now; count them. */
+			spinlock_acquire(&lock_pi_lock);
+			lock->lk_waiters += moved;
+			prio = wchan_toppriority(lock->lk_wchan,
+						 &lock->lk_lock);
+			lock_lendpriority(lock, prio);
+			spinlock_release(&lock_pi_lock);
+		}
+	}
+	spinlock_release(&lock->lk_lock);
+	return moved;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
 	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	if (cv_morph(cv, lock, 1) == 0) {
+		wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	}
 	spinlock_release(&cv->cv_wchanlock);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
 	spinlock_acquire(&cv->cv_wchanlock);
+	cv_morph(cv, lock, (unsigned)-1);
+	/* Wake whoever couldn't be moved. */
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+//
+// Any number of readers, or one writer. Writers get preference: once
+// a writer is waiting, new readers wait behind it. But when a writer
+// releases the lock, the readers that were already waiting are let
+// in ahead of any other writer (rw_readpass), so that a steady stream
+// of writers can't starve readers either.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	HANGMAN_LOCKABLEINIT(&rw->rw_hangman, rw->rw_name);
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_readwaiting = 0;
+	rw->rw_writewaiting = 0;
+	rw->rw_readpass = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &rw->rw_hangman);
+
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL ||
+	       (rw->rw_writewaiting > 0 && rw->rw_readpass == 0)) {
+		rw->rw_readwaiting++;
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+		rw->rw_readwaiting--;
+	}
+	if (rw->rw_readpass > 0) {
+		rw->rw_readpass--;
+	}
+	rw->rw_readers++;
+
+	HANGMAN_ACQUIRE_SHARED(&curthread->t_hangman, &rw->rw_hangman);
+
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_writewaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &rw->rw_hangman);
+
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writewaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0 ||
+	       rw->rw_readpass > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_writewaiting--;
+	rw->rw_writer = curthread;
+
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &rw->rw_hangman);
+
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+
+	if (rw->rw_readwaiting > 0) {
+		/* Let the readers already waiting go next. */
+		rw->rw_readpass = rw->rw_readwaiting;
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+	else if (rw->rw_writewaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+
+	HANGMAN_RELEASE(&curthread->t_hangman, &rw->rw_hangman);
+
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
@@ -42,6 +42,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <ticketlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -50,9 +51,14 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
+#include <membar.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
+#include <clock.h>
+#include <callout.h>
+#include <schedtrace.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +78,20 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Maximum number of dead threads each cpu keeps for reuse. */
+#define THREAD_CACHE_MAX 8
+
+/* Zombies the reaper takes off the list at a time. */
+#define THREAD_REAP_BATCH 16
+
+/* Time slice, in hardclocks, at each priority level. */
+static const unsigned thread_quanta[NPRIORITIES] = { 2, 4, 8, 16 };
+
+static int thread_fork_mask(const char *name, struct proc *proc,
+			    uint32_t mask,
+			    void (*entrypoint)(void *data1, unsigned long data2),
+			    void *data1, unsigned long data2);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,39 +131,172 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Per-cpu cache of dead thread structures.
+ *
+ * Rather than freeing a dead thread and its stack, thread_destroy
+ * parks up to THREAD_CACHE_MAX of them on the current cpu's
+ * c_threadcache, still holding their stacks (with the magic numbers
+ * already in place), and thread_create takes them back from there.
+ * This saves a kmalloc/kfree pair and a whole-page allocation for
+ * every fork/exit.
+ *
+ * Each cpu uses its own cache, but the reclaim hook empties all of
+ * them, so each has a lock.
+ */
+static
+struct thread *
+thread_cache_get(void)
+{
+	struct cpu *c;
+	struct thread *thread;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	/* If we migrate in between, it's harmless. */
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadcachelock);
+	thread = threadlist_remhead(&c->c_threadcache);
+	spinlock_release(&c->c_threadcachelock);
+
+	if (thread != NULL) {
+		KASSERT(thread->t_stack != NULL);
+		thread_checkstack(thread);
+	}
+	return thread;
+}
+
+/*
+ * Put THREAD in the cache if there's room. Returns true if it was
+ * taken, in which case the caller should not free it.
+ */
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	struct cpu *c;
+	bool ret;
+
+	if (thread->t_stack == NULL) {
+		return false;
+	}
+
+	if (reclaim_lowmem()) {
+		/* Don't hang on to memory when it's short. */
+		return false;
+	}
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadcachelock);
+	if (c->c_threadcache.tl_count < THREAD_CACHE_MAX) {
+		threadlistnode_init(&thread->t_listnode, thread);
+		threadlist_addhead(&c->c_threadcache, thread);
+		ret = true;
+	}
+	else {
+		ret = false;
+	}
+	spinlock_release(&c->c_threadcachelock);
+	return ret;
+}
+
+/*
+ * Reclaim hook: free every cpu's cached threads. Returns the pages
+ * that come back, which are the stacks' own: the struct threads come
+ * from the subpage allocator and free no whole page we can count on.
+ */
+static
+unsigned
+thread_cache_reclaim(unsigned npages)
+{
+	struct threadlist victims;
+	struct thread *thread;
+	struct cpu *c;
+	unsigned i, numcpus, nthreads;
+
+	(void)npages;
+
+	threadlist_init(&victims);
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_threadcachelock);
+		while ((thread = threadlist_remhead(&c->c_threadcache))
+		       != NULL) {
+			threadlist_addtail(&victims, thread);
+		}
+		spinlock_release(&c->c_threadcachelock);
+	}
+
+	nthreads = 0;
+	while ((thread = threadlist_remhead(&victims)) != NULL) {
+		threadlistnode_cleanup(&thread->t_listnode);
+		kfree(thread->t_stack);
+		kfree(thread);
+		nthreads++;
+	}
+	threadlist_cleanup(&victims);
+	return nthreads * DIVROUNDUP(STACK_SIZE, PAGE_SIZE);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * If the thread came from the cache it already has a stack;
+ * otherwise t_stack is NULL.
  */
 static
 struct thread *
 thread_create(const char *name)
 {
 	struct thread *thread;
+	char *tname;
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
+	tname = kstrdup(name);
+	if (tname == NULL) {
 		return NULL;
 	}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+	thread = thread_cache_get();
+	if (thread == NULL) {
+		thread = kmalloc(sizeof(*thread));
+		if (thread == NULL) {
+			kfree(tname);
+			return NULL;
+		}
+		thread->t_stack = NULL;
 	}
+
+	thread->t_name = tname;
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread->t_priority = 0;
+	thread->t_quantum = thread_quanta[0];
+	thread->t_lastran = 0;
+	thread->t_wchan = NULL;
+	thread->t_affinity = CPUMASK_ALL;
+	thread->t_tid = 0;
+	thread->t_utime = 0;
+	thread->t_stime = 0;
+	thread->t_waitlock = NULL;
+	thread->t_timedsleep = false;
+	thread->t_interrupted = false;
+	thread->t_intrco = NULL;
+	thread->t_loans = 0;
+	thread->t_ownpriority = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -168,6 +321,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,15 +334,30 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	c->c_reaperwchan = NULL;
+	spinlock_init(&c->c_reaperlock);
+	c->c_reaperidle = false;
+	threadlist_init(&c->c_threadcache);
+	spinlock_init(&c->c_threadcachelock);
+	threadlist_init(&c->c_misplaced);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_resched = false;
+	c->c_acctstamp = 0;
+	c->c_idletime = 0;
+	c->c_tlbasid = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	for (i=0; i<NPRIORITIES; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	ticketlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_all = false;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -212,7 +381,7 @@ cpu_create(unsigned hardware_number)
 		 */
 		/*c->c_curthread->t_stack = ... */
 	}
-	else {
+	else if (c->c_curthread->t_stack == NULL) {
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
@@ -255,6 +424,15 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Return the number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * Destroy a thread.
  *
@@ -277,9 +455,6 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -287,6 +462,16 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	/* Keep the structure and its stack around for reuse if we can. */
+	if (thread_cache_put(thread)) {
+		return;
+	}
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
 	kfree(thread);
 }
 
@@ -294,18 +479,101 @@ thread_destroy(struct thread *thread)
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
  *
- * The list of zombies is per-cpu.
+ * The list of zombies is per-cpu, and so is the reaper thread that
+ * empties it. Freeing threads is not fast, and doing it right after
+ * every context switch, with interrupts off, made every switch that
+ * much slower during fork/exit storms. Instead, an exiting thread
+ * wakes the reaper if it's asleep (see thread_reaper_wake), and the
+ * reaper frees the zombies a batch at a time with interrupts on.
+ * While it's busy, or waiting for the cpu, more zombies just pile up
+ * for its next batch; the context switch itself does nothing.
+ *
+ * The reaper never leaves its cpu, so by the time it runs, the
+ * zombies on its list have all been switched away from for good.
+ * c_zombies is still only touched by its own cpu with interrupts
+ * off; c_reaperlock (which raises the spl) is what lets the reaper
+ * check the list and go to sleep atomically.
  */
 static
 void
-exorcise(void)
+thread_reaper(void *vcpu, unsigned long junk)
 {
+	struct cpu *c = vcpu;
+	struct threadlist batch;
 	struct thread *z;
 
-	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
-		KASSERT(z != curthread);
-		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+	(void)junk;
+
+	KASSERT(curcpu->c_self == c);
+	threadlist_init(&batch);
+
+	while (1) {
+		spinlock_acquire(&c->c_reaperlock);
+		while (threadlist_isempty(&c->c_zombies)) {
+			c->c_reaperidle = true;
+			wchan_sleep(c->c_reaperwchan, &c->c_reaperlock);
+		}
+		while (batch.tl_count < THREAD_REAP_BATCH &&
+		       (z = threadlist_remhead(&c->c_zombies)) != NULL) {
+			threadlist_addtail(&batch, z);
+		}
+		spinlock_release(&c->c_reaperlock);
+
+		while ((z = threadlist_remhead(&batch)) != NULL) {
+			KASSERT(z != curthread);
+			KASSERT(z->t_state == S_ZOMBIE);
+			thread_destroy(z);
+		}
+	}
+}
+
+/*
+ * Wake this cpu's reaper if it's asleep. Called with interrupts off.
+ *
+ * thread_exit calls this for the zombie the current thread is about
+ * to become; the reaper can't run here until we've switched away, by
+ * which time we're on the list. Until the reaper exists (early in
+ * boot) zombies just wait for it.
+ *
+ * thread_switch also calls this to make sure there is some other
+ * thread to run when the current one needs to leave the cpu; if
+ * there are no zombies the reaper just goes back to sleep.
+ */
+static
+void
+thread_reaper_wake(void)
+{
+	struct cpu *c = curcpu->c_self;
+
+	if (!c->c_reaperidle) {
+		return;
+	}
+
+	spinlock_acquire(&c->c_reaperlock);
+	c->c_reaperidle = false;
+	wchan_wakeone(c->c_reaperwchan, &c->c_reaperlock);
+	spinlock_release(&c->c_reaperlock);
+}
+
+/*
+ * Start the reaper for cpu C, pinned there.
+ */
+static
+void
+thread_reaper_start(struct cpu *c)
+{
+	int result;
+
+	c->c_reaperwchan = wchan_create("reaper");
+	if (c->c_reaperwchan == NULL) {
+		panic("thread_reaper_start: Out of memory\n");
+	}
+
+	result = thread_fork_mask("reaper", NULL, CPUMASK_CPU(c->c_number),
+				  thread_reaper, c, 0);
+	if (result) {
+		panic("thread_reaper_start: thread_fork_mask: %s\n",
+		      strerror(result));
 	}
 }
 
@@ -317,6 +585,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -331,9 +601,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<NPRIORITIES; i++) {
+		struct threadlist *rq = &curcpu->c_runqueue[i];
+
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -394,6 +668,10 @@ thread_bootstrap(void)
 	KASSERT(curthread->t_proc != NULL);
 	KASSERT(curthread->t_proc == kproc);
 
+	if (reclaim_register("thread cache", thread_cache_reclaim)) {
+		panic("thread_bootstrap: reclaim_register failed\n");
+	}
+
 	/* Done */
 }
 
@@ -424,7 +702,8 @@ cpu_hatch(unsigned software_number)
 }
 
 /*
- * Start up secondary cpus. Called from boot().
+ * Start up secondary cpus, and a reaper thread for each cpu. Called
+ * from boot().
  */
 void
 thread_start_cpus(void)
@@ -443,128 +722,622 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		thread_reaper_start(cpuarray_get(&allcpus, i));
+	}
 }
 
+////////////////////////////////////////////////////////////
+
 /*
- * Make a thread runnable.
+ * Run queues.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * Each cpu has one run queue per priority level. Threads are queued
+ * at the level given by t_priority and always taken from the
+ * highest-priority nonempty queue. These must all be called with the
+ * cpu's runqueue lock held.
  */
+
+static unsigned runqueue_count(struct cpu *c);
+
 static
 void
-thread_make_runnable(struct thread *target, bool already_have_lock)
+runqueue_add(struct cpu *c, struct thread *t)
 {
-	struct cpu *targetcpu;
+	KASSERT(ticketlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_priority < NPRIORITIES);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	SCHEDTRACE(SCHEDTRACE_ENQUEUE, t, c->c_number, runqueue_count(c));
+}
 
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
+/*
+ * Remove the next thread to run: the first one at the highest
+ * priority.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
 
-	if (already_have_lock) {
-		/* The target thread's cpu should be already locked. */
-		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
-	}
-	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+	KASSERT(ticketlock_do_i_hold(&c->c_runqueue_lock));
+	for (i=0; i<NPRIORITIES; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			SCHEDTRACE(SCHEDTRACE_DEQUEUE, t, c->c_number,
+				   runqueue_count(c));
+			return t;
+		}
 	}
+	return NULL;
+}
 
-	/* Target thread is now ready to run; put it on the run queue. */
-	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+/*
+ * Remove the thread that would run last: the last one at the lowest
+ * priority.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
 
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
+	KASSERT(ticketlock_do_i_hold(&c->c_runqueue_lock));
+	for (i=NPRIORITIES; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			SCHEDTRACE(SCHEDTRACE_DEQUEUE, t, c->c_number,
+				   runqueue_count(c));
+			return t;
+		}
 	}
+	return NULL;
+}
 
-	if (!already_have_lock) {
-		spinlock_release(&targetcpu->c_runqueue_lock);
+/*
+ * Return the number of threads waiting to run.
+ */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	KASSERT(ticketlock_do_i_hold(&c->c_runqueue_lock));
+	count = 0;
+	for (i=0; i<NPRIORITIES; i++) {
+		count += c->c_runqueue[i].tl_count;
 	}
+	return count;
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Return the highest priority (lowest number) of any waiting thread,
+ * or NPRIORITIES if there are none.
  */
-int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+static
+unsigned
+runqueue_toppriority(struct cpu *c)
 {
-	struct thread *newthread;
-	int result;
+	unsigned i;
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
+	KASSERT(ticketlock_do_i_hold(&c->c_runqueue_lock));
+	for (i=0; i<NPRIORITIES; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			break;
+		}
 	}
+	return i;
+}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
+/*
+ * CPU affinity.
+ *
+ * Each thread has a mask of the cpus it may run on, t_affinity.
+ * Migration and work stealing never move a thread to a cpu outside
+ * its mask, and a thread that is forked or woken up on such a cpu is
+ * sent to an allowed one instead.
+ *
+ * A thread running on a cpu it may no longer use can't be moved
+ * until it's off that cpu and its context is saved. So when it
+ * yields, it goes on the cpu's c_misplaced list instead of the run
+ * queue, and the next thread to run there sends it on its way (see
+ * thread_rehome). That needs some other thread to run, of course;
+ * thread_setaffinity makes sure there is one.
+ */
 
-	/*
-	 * Now we clone various fields from the parent thread.
-	 */
+/*
+ * Check if thread T may run on cpu C.
+ */
+static
+bool
+thread_cpu_ok(struct thread *t, struct cpu *c)
+{
+	return (t->t_affinity & CPUMASK_CPU(c->c_number)) != 0;
+}
 
-	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+/*
+ * Choose a cpu for thread T: its own if allowed, otherwise the
+ * allowed cpu with the fewest waiting threads. Must not hold any
+ * runqueue lock.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus, count, bestcount;
 
-	/* Attach the new thread to its process */
-	if (proc == NULL) {
-		proc = curthread->t_proc;
-	}
-	result = proc_addthread(proc, newthread);
-	if (result) {
-		/* thread_destroy will clean up the stack */
-		thread_destroy(newthread);
-		return result;
+	if (thread_cpu_ok(t, t->t_cpu)) {
+		return t->t_cpu;
 	}
 
-	/*
-	 * Because new threads come out holding the cpu runqueue lock
-	 * (see notes at bottom of thread_switch), we need to account
-	 * for the spllower() that will be done releasing it.
-	 */
-	newthread->t_iplhigh_count++;
-
-	/* Set up the switchframe so entrypoint() gets called */
-	switchframe_init(newthread, entrypoint, data1, data2);
-
-	/* Lock the current cpu's run queue and make the new thread runnable */
-	thread_make_runnable(newthread, false);
+	best = NULL;
+	bestcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!thread_cpu_ok(t, c)) {
+			continue;
+		}
+		ticketlock_acquire(&c->c_runqueue_lock);
+		count = runqueue_count(c);
+		ticketlock_release(&c->c_runqueue_lock);
+		if (best == NULL || count < bestcount) {
+			best = c;
+			bestcount = count;
+		}
+	}
 
-	return 0;
+	/* thread_setaffinity doesn't allow masks with no cpus */
+	KASSERT(best != NULL);
+	return best;
 }
 
 /*
- * High level, machine-independent context switch code.
- *
- * The current thread is queued appropriately and its state is changed
- * to NEWSTATE; another thread to run is selected and switched to.
+ * Thread T, which isn't running and is on no list, is about to be
+ * made runnable on a cpu it may not use; pick another. Then wait
+ * for the old cpu to finish switching away from T (it does that
+ * holding its runqueue lock), and move T while still holding that
+ * lock, so nobody who finds T through the old cpu sees it half
+ * moved. If the old cpu went idle instead, it's still running on T's
+ * stack, and T has to stay where it is for now.
  *
- * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
- * WC, protected by the spinlock LK. Otherwise WC and Lk should be
- * NULL.
+ * The pick is made first because thread_pickcpu takes runqueue locks
+ * itself.
  */
 static
 void
-thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
+thread_retarget(struct thread *t)
+{
+	struct cpu *old, *new;
+	bool stuck;
+
+	old = t->t_cpu;
+	new = thread_pickcpu(t);
+
+	ticketlock_acquire(&old->c_runqueue_lock);
+	stuck = (old->c_curthread == t);
+	if (!stuck) {
+		t->t_cpu = new;
+	}
+	ticketlock_release(&old->c_runqueue_lock);
+
+	if (!stuck) {
+		SCHEDTRACE(SCHEDTRACE_MIGRATE, t, old->c_number,
+			   t->t_cpu->c_number);
+		DEBUG(DB_THREADS, "Moved thread %s: cpu %u -> %u",
+		      t->t_name, old->c_number, t->t_cpu->c_number);
+	}
+}
+
+/*
+ * Placeholder thread forked by thread_setaffinity so the cpu has
+ * something to switch to.
+ */
+static
+void
+thread_affinity_helper(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+}
+
+int
+thread_setaffinity(struct thread *t, uint32_t mask)
+{
+	unsigned numcpus;
+	int result;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 32) {
+		mask &= CPUMASK_CPU(numcpus) - 1;
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	if (t != curthread || (mask & CPUMASK_CPU(curcpu->c_number))) {
+		/* Others move lazily; see above. */
+		t->t_affinity = mask;
+		return 0;
+	}
+
+	/*
+	 * We have to leave this cpu. Fork a thread pinned here so the
+	 * cpu will have something to run once we yield, rather than
+	 * going idle on our stack. If that fails, we'll just move later.
+	 */
+	t->t_affinity = mask;
+	result = thread_fork_mask("affinity", kproc,
+				  CPUMASK_CPU(curcpu->c_number),
+				  thread_affinity_helper, NULL, 0);
+	if (result == 0) {
+		thread_yield();
+	}
+	return 0;
+}
+
+/*
+ * Work stealing.
+ *
+ * When a cpu runs out of things to do, before going idle it looks for
+ * the busiest other cpu and takes a thread from its run queue.
+ *
+ * Moving a thread costs it its cache contents, so we'd rather take
+ * one that hasn't run for a while (whose cache lines have likely
+ * been evicted anyway) than one that just got off the cpu. We only
+ * take a cache-hot thread if the other cpu has a real backlog.
+ *
+ * We never take the other cpu's c_curthread: if it's idle, it is
+ * still running on that thread's stack (see the notes in
+ * thread_consider_migration).
+ */
+
+/*
+ * A thread that ran within this many nanoseconds is cache-hot. The
+ * times come from gettime_ns, so they compare across cpus.
+ */
+#define STEAL_HOT_NS (2 * (1000000000ULL / HZ))
+
+/*
+ * Pick a thread to steal from VICTIM's run queue, or NULL. Prefers
+ * low-priority cache-cold threads, then (if BACKLOG) any low-priority
+ * thread; skips threads that may not run here. NOW is the current
+ * time. Sets *PASSEDHOT if it passed over a cache-hot thread it
+ * could have taken. Must hold VICTIM's runqueue lock.
+ */
+static
+struct thread *
+thread_steal_pick(struct cpu *victim, bool backlog, uint64_t now,
+		  bool *passedhot)
+{
+	struct threadlistnode *tln;
+	struct thread *t, *fallback;
+	unsigned i;
+
+	KASSERT(ticketlock_do_i_hold(&victim->c_runqueue_lock));
+
+	fallback = NULL;
+	for (i=NPRIORITIES; i-- > 0; ) {
+		for (tln = victim->c_runqueue[i].tl_tail.tln_prev;
+		     tln->tln_prev != NULL;
+		     tln = tln->tln_prev) {
+			t = tln->tln_self;
+			if (t == victim->c_curthread ||
+			    !thread_cpu_ok(t, curcpu->c_self)) {
+				continue;
+			}
+			if (now - t->t_lastran >= STEAL_HOT_NS) {
+				return t;
+			}
+			if (fallback == NULL && backlog) {
+				fallback = t;
+			}
+			*passedhot = true;
+		}
+	}
+	return fallback;
+}
+
+/*
+ * Try to steal a thread from another cpu. Called with interrupts
+ * off and no runqueue lock held. Returns the thread, which is on no
+ * list and whose t_cpu is now curcpu, or NULL.
+ *
+ * If we came back empty-handed only because the candidates were
+ * cache-hot, sets *RETRY: they'll cool off shortly, but nobody will
+ * tell us when, so the caller should look again in a little while.
+ */
+static
+struct thread *
+thread_steal(bool *retry)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, count, best;
+	bool passedhot;
+
+	*retry = false;
+	numcpus = cpuarray_num(&allcpus);
+
+	/* Find the cpu with the most waiting threads. */
+	victim = NULL;
+	best = 0;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		ticketlock_acquire(&c->c_runqueue_lock);
+		/* An idle cpu is about to run its own threads itself. */
+		count = c->c_isidle ? 0 : runqueue_count(c);
+		ticketlock_release(&c->c_runqueue_lock);
+		if (count > best) {
+			best = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	/* Things may have changed since we looked; check again. */
+	ticketlock_acquire(&victim->c_runqueue_lock);
+	if (victim->c_isidle) {
+		ticketlock_release(&victim->c_runqueue_lock);
+		return NULL;
+	}
+	passedhot = false;
+	t = thread_steal_pick(victim, runqueue_count(victim) > 1,
+			      gettime_ns(), &passedhot);
+	if (t == NULL) {
+		*retry = passedhot;
+	}
+	else {
+		threadlist_remove(&victim->c_runqueue[t->t_priority], t);
+		SCHEDTRACE(SCHEDTRACE_DEQUEUE, t, victim->c_number,
+			   runqueue_count(victim));
+		t->t_cpu = curcpu->c_self;
+		SCHEDTRACE(SCHEDTRACE_MIGRATE, t, victim->c_number,
+			   curcpu->c_number);
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	ticketlock_release(&victim->c_runqueue_lock);
+	return t;
+}
+
+/*
+ * Wake one idle cpu other than BUSY, so it will try to steal work.
+ * This looks at c_isidle without locking; at worst we send a
+ * pointless IPI or miss a chance to steal.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * TARGET has just been put on TARGETCPU's run queue; make sure that
+ * cpu (or some other) gets around to running it. Must hold
+ * TARGETCPU's runqueue lock.
+ */
+static
+void
+thread_notify_cpu(struct cpu *targetcpu, struct thread *target)
+{
+	KASSERT(ticketlock_do_i_hold(&targetcpu->c_runqueue_lock));
+
+	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+	else if (!targetcpu->c_isidle && target != targetcpu->c_curthread) {
+		/*
+		 * Other processor is busy. If it's running something
+		 * less important, tell it to switch now rather than at
+		 * its next clock tick. Either way, since there's now
+		 * a thread waiting, wake up an idle cpu (if any) to
+		 * come and steal it. (Idle cpus don't take clock ticks,
+		 * so won't come looking by themselves.)
+		 */
+		if (targetcpu != curcpu->c_self &&
+		    target->t_priority <
+		    targetcpu->c_curthread->t_priority) {
+			ipi_send(targetcpu, IPI_RESCHED);
+		}
+		thread_kick_idle(targetcpu);
+	}
+}
+
+static void thread_boost(struct thread *t);
+
+/*
+ * Make a thread runnable. If WAKEUP is true it's waking up from
+ * wchan_sleep, and gets boosted for it.
+ *
+ * targetcpu might be curcpu; it might not be, too.
+ */
+static
+void
+thread_make_runnable(struct thread *target, bool already_have_lock,
+		     bool wakeup)
+{
+	struct cpu *targetcpu;
+
+	/* If it may not run where it was, move it if we can. */
+	if (!already_have_lock && !thread_cpu_ok(target, target->t_cpu)) {
+		thread_retarget(target);
+	}
+
+	/* Lock the run queue of the target thread's cpu. */
+	targetcpu = target->t_cpu;
+
+	if (already_have_lock) {
+		/* The target thread's cpu should be already locked. */
+		KASSERT(ticketlock_do_i_hold(&targetcpu->c_runqueue_lock));
+	}
+	else {
+		ticketlock_acquire(&targetcpu->c_runqueue_lock);
+	}
+
+	/* Target thread is now ready to run; put it on the run queue. */
+	if (wakeup) {
+		thread_boost(target);
+	}
+	target->t_state = S_READY;
+	runqueue_add(targetcpu, target);
+	if (target != curthread) {
+		SCHEDTRACE(SCHEDTRACE_WAKEUP, target, targetcpu->c_number,
+			   target->t_priority);
+	}
+	thread_notify_cpu(targetcpu, target);
+
+	if (!already_have_lock) {
+		ticketlock_release(&targetcpu->c_runqueue_lock);
+	}
+}
+
+/*
+ * Send threads that yielded on this cpu but may not run here to
+ * where they belong. Called after a context switch, once they're
+ * safely off the cpu; the list is only touched by this cpu, with
+ * interrupts off.
+ */
+static
+void
+thread_rehome(void)
+{
+	struct thread *t;
+
+	while ((t = threadlist_remhead(&curcpu->c_misplaced)) != NULL) {
+		KASSERT(t != curthread);
+		KASSERT(t->t_state == S_READY);
+		thread_make_runnable(t, false, false);
+	}
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_mask(name, proc, curthread->t_affinity,
+				entrypoint, data1, data2);
+}
+
+/*
+ * Same, but the new thread may only run on the cpus in MASK rather
+ * than inheriting the caller's affinity. It starts on one of them.
+ */
+static
+int
+thread_fork_mask(const char *name,
+		 struct proc *proc,
+		 uint32_t mask,
+		 void (*entrypoint)(void *data1, unsigned long data2),
+		 void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+	newthread = thread_create(name);
+	if (newthread == NULL) {
+		return ENOMEM;
+	}
+
+	/* Allocate a stack, unless we got a recycled one */
+	if (newthread->t_stack == NULL) {
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
+	}
+
+	/*
+	 * Now we clone various fields from the parent thread.
+	 */
+
+	/* Thread subsystem fields */
+	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = mask;
+	newthread->t_cpu = thread_pickcpu(newthread);
+
+	/* Attach the new thread to its process */
+	if (proc == NULL) {
+		proc = curthread->t_proc;
+	}
+	result = proc_addthread(proc, newthread);
+	if (result) {
+		/* thread_destroy will clean up the stack */
+		thread_destroy(newthread);
+		return result;
+	}
+
+	/*
+	 * Because new threads come out holding the cpu runqueue lock
+	 * (see notes at bottom of thread_switch), we need to account
+	 * for the spllower() that will be done releasing it.
+	 */
+	newthread->t_iplhigh_count++;
+
+	/* Set up the switchframe so entrypoint() gets called */
+	switchframe_init(newthread, entrypoint, data1, data2);
+
+	/* Lock the current cpu's run queue and make the new thread runnable */
+	thread_make_runnable(newthread, false, false);
+
+	return 0;
+}
+
+/*
+ * High level, machine-independent context switch code.
+ *
+ * The current thread is queued appropriately and its state is changed
+ * to NEWSTATE; another thread to run is selected and switched to.
+ *
+ * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
+ * WC, protected by the spinlock LK. Otherwise WC and Lk should be
+ * NULL.
+ */
+static
+void
+thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	bool tickless, stealretry;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -587,25 +1360,48 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/*
+	 * A thread that may no longer run here can only be sent to
+	 * another cpu once it's off this one, which takes some other
+	 * thread to switch to (see thread_rehome). Make sure there is
+	 * one, so it doesn't just carry on here.
+	 */
+	if (newstate == S_READY && !thread_cpu_ok(cur, curcpu->c_self)) {
+		thread_reaper_wake();
+	}
+
 	/* Lock the run queue. */
-	spinlock_acquire(&curcpu->c_runqueue_lock);
+	ticketlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
+		ticketlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Charge it for its time; the next thread starts from here. */
+	thread_charge(false);
+
+	/* Remember when it last ran (just now), for thread_steal. */
+	cur->t_lastran = curcpu->c_acctstamp;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (thread_cpu_ok(cur, curcpu->c_self)) {
+			thread_make_runnable(cur, true /*have lock*/, false);
+		}
+		else {
+			/* thread_rehome will move it once we're off it */
+			threadlist_addtail(&curcpu->c_misplaced, cur);
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		cur->t_wchan = wc;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -625,7 +1421,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to steal
+	 * one from another cpu, and failing that call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -641,17 +1438,52 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
-	/* The current cpu is now idle. */
+	/*
+	 * The current cpu is now idle. If we actually have to wait,
+	 * turn off the clock tick until there's something to do,
+	 * unless there are callouts pending that need it, or there's
+	 * a thread we could steal once it's no longer cache-hot. The
+	 * answers can change while we're idle (we get an IPI if a
+	 * callout or a new thread turns up; the tick, if any, wakes us
+	 * for the hot one), so check each time around.
+	 */
 	curcpu->c_isidle = true;
+	tickless = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
-			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
-			spinlock_acquire(&curcpu->c_runqueue_lock);
+			ticketlock_release(&curcpu->c_runqueue_lock);
+			next = thread_steal(&stealretry);
+			if (next == NULL && cur->t_state == S_READY &&
+			    !thread_cpu_ok(cur, curcpu->c_self)) {
+				/*
+				 * CUR is waiting on c_misplaced, but with
+				 * nothing else to run we'd be idling on
+				 * its stack and it would be stuck until
+				 * something else turned up. Keep running
+				 * it here for now instead. (With nothing
+				 * on the run queue we normally returned
+				 * early above; this is a backstop.)
+				 */
+				threadlist_remove(&curcpu->c_misplaced, cur);
+				next = cur;
+			}
+			if (next == NULL) {
+				if (tickless ==
+				    (stealretry || callout_needtick())) {
+					tickless = !tickless;
+					mainbus_idle_timer(tickless);
+				}
+				cpu_idle();
+			}
+			ticketlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
+	thread_charge(false);
 	curcpu->c_isidle = false;
+	if (tickless) {
+		mainbus_idle_timer(false);
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -660,6 +1492,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * assume the compiler will optimize one away if they're the
 	 * same.
 	 */
+	SCHEDTRACE(SCHEDTRACE_SWITCH, cur, next, newstate);
 	curcpu->c_curthread = next;
 	curthread = next;
 
@@ -718,13 +1551,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = S_RUN;
 
 	/* Unlock the run queue. */
-	spinlock_release(&curcpu->c_runqueue_lock);
+	ticketlock_release(&curcpu->c_runqueue_lock);
 
 	/* Activate our address space in the MMU. */
 	as_activate();
 
-	/* Clean up dead threads. */
-	exorcise();
+	/* Send away threads that can't stay on this cpu. */
+	thread_rehome();
 
 	/* Turn interrupts back on. */
 	splx(spl);
@@ -751,13 +1584,13 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	cur->t_state = S_RUN;
 
 	/* Release the runqueue lock acquired in thread_switch. */
-	spinlock_release(&curcpu->c_runqueue_lock);
+	ticketlock_release(&curcpu->c_runqueue_lock);
 
 	/* Activate our address space in the MMU. */
 	as_activate();
 
-	/* Clean up dead threads. */
-	exorcise();
+	/* Send away threads that can't stay on this cpu. */
+	thread_rehome();
 
 	/* Enable interrupts. */
 	spl0();
@@ -770,68 +1603,330 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 }
 
 /*
- * Cause the current thread to exit.
+ * Cause the current thread to exit.
+ *
+ * The parts of the thread structure we don't actually need to run
+ * should be cleaned up right away. The rest has to wait until
+ * thread_destroy is called from the reaper (see thread_reaper).
+ *
+ * Does not return.
+ */
+void
+thread_exit(void)
+{
+	struct thread *cur;
+
+	cur = curthread;
+
+	/* We should be attached only to the kernel process. */
+	KASSERT(cur->t_proc == kproc);
+
+	/* Detach from the kernel process. */
+	proc_remthread(cur);
+
+	/* Make sure we *are* detached. */
+	KASSERT(cur->t_proc == NULL);
+
+	/* Check the stack guard band. */
+	thread_checkstack(cur);
+
+	/* Interrupts off on this processor */
+        splhigh();
+
+	/* Have the zombie cleaned up. */
+	thread_reaper_wake();
+
+	/* This doesn't come back... */
+	thread_switch(S_ZOMBIE, NULL, NULL);
+
+	/* ...so if it does, something's wrong. */
+	panic("braaaaaaaiiiiiiiiiiinssssss\n");
+}
+
+/*
+ * Yield the cpu to another process, but stay runnable.
+ */
+void
+thread_yield(void)
+{
+	thread_switch(S_READY, NULL, NULL);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Scheduler.
+ *
+ * This is a multi-level feedback queue. Each thread has a priority
+ * level, 0 (highest) to NPRIORITIES-1, and each cpu has a run queue
+ * for each level; the highest-priority ready thread always runs
+ * next. The rules are:
+ *
+ *    - New threads start at the top.
+ *
+ *    - A thread that uses up its whole time slice (thread_quanta[]
+ *      hardclocks, longer at lower levels) drops one level. So
+ *      CPU-bound threads sink to the bottom and run in long slices.
+ *
+ *    - A thread that wakes up from wchan_sleep moves up one level
+ *      and gets a fresh time slice. So threads that mostly wait for
+ *      I/O stay near the top, and run promptly when their I/O
+ *      completes.
+ *
+ *    - If a thread becomes ready at a higher priority than the one
+ *      running, the running one is preempted at the next hardclock.
+ *
+ *    - Periodically (see schedule) every waiting thread moves up one
+ *      level, so nothing at the bottom starves.
+ */
+
+/*
+ * Move T up one priority level and give it a fresh time slice. T
+ * must not be on a run queue, and we must hold the runqueue lock of
+ * its cpu.
+ *
+ * These rules move a thread's own level, t_ownpriority. t_priority
+ * is what it actually runs at, which is the same unless it has been
+ * lent a higher one (see thread_lendpriority).
+ */
+static
+void
+thread_boost(struct thread *t)
+{
+	KASSERT(ticketlock_do_i_hold(&t->t_cpu->c_runqueue_lock));
+
+	if (t->t_ownpriority > 0) {
+		t->t_ownpriority--;
+	}
+	if (t->t_ownpriority < t->t_priority) {
+		t->t_priority = t->t_ownpriority;
+	}
+	t->t_quantum = thread_quanta[t->t_priority];
+}
+
+/*
+ * Called from hardclock() on every tick.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur = curthread;
+	bool preempt;
+
+	if (curcpu->c_isidle) {
+		/* The idle loop has nothing to charge. */
+		return;
+	}
+
+	if (cur->t_quantum > 0) {
+		cur->t_quantum--;
+	}
+
+	/* The runqueue lock also keeps priority loans out. */
+	ticketlock_acquire(&curcpu->c_runqueue_lock);
+	if (cur->t_quantum == 0) {
+		/*
+		 * Used up its slice: demote, and let someone else run.
+		 * A thread running on lent priority keeps it until the
+		 * loan ends, and only its own level drops.
+		 */
+		if (cur->t_ownpriority < NPRIORITIES - 1) {
+			cur->t_ownpriority++;
+		}
+		if (cur->t_loans == 0) {
+			cur->t_priority = cur->t_ownpriority;
+		}
+		cur->t_quantum = thread_quanta[cur->t_priority];
+		preempt = true;
+	}
+	else {
+		/* Still has time left; switch only for a more important one. */
+		preempt = runqueue_toppriority(curcpu) < cur->t_priority;
+	}
+	ticketlock_release(&curcpu->c_runqueue_lock);
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Priority inheritance.
  *
- * The parts of the thread structure we don't actually need to run
- * should be cleaned up right away. The rest has to wait until
- * thread_destroy is called from exorcise().
+ * A thread asleep waiting for a lock lends its priority to the
+ * holder (see lock_acquire), so a low-priority holder can't keep it
+ * waiting behind threads of middling priority. A loan lasts until
+ * the holder releases the lock it was made through; when its last
+ * loan ends the holder drops back to its own level, t_ownpriority,
+ * which the scheduler has gone on adjusting in the meantime.
  *
- * Does not return.
+ * t_priority, t_ownpriority, and t_loans all change only under the
+ * runqueue lock of the thread's cpu. Raising the priority of a
+ * thread that's on a run queue means moving it to the right queue;
+ * the cpu has to be rechecked once locked in case the thread was
+ * moved.
  */
 void
-thread_exit(void)
+thread_lendpriority(struct thread *t, unsigned prio, bool newloan)
 {
-	struct thread *cur;
+	struct cpu *c;
+	struct thread *t2;
+	bool queued;
+
+	while (1) {
+		c = t->t_cpu;
+		ticketlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		ticketlock_release(&c->c_runqueue_lock);
+	}
 
-	cur = curthread;
+	if (newloan) {
+		t->t_loans++;
+	}
+	if (prio >= t->t_priority) {
+		ticketlock_release(&c->c_runqueue_lock);
+		return;
+	}
 
-	/* We should be attached only to the kernel process. */
-	KASSERT(cur->t_proc == kproc);
+	/* Ready threads can also be on c_misplaced; check. */
+	queued = false;
+	if (t->t_state == S_READY) {
+		THREADLIST_FORALL(t2, c->c_runqueue[t->t_priority]) {
+			if (t2 == t) {
+				queued = true;
+				break;
+			}
+		}
+	}
 
-	/* Detach from the kernel process. */
-	proc_remthread(cur);
+	if (queued) {
+		threadlist_remove(&c->c_runqueue[t->t_priority], t);
+		t->t_priority = prio;
+		runqueue_add(c, t);
+		thread_notify_cpu(c, t);
+	}
+	else {
+		t->t_priority = prio;
+	}
+	ticketlock_release(&c->c_runqueue_lock);
+}
 
-	/* Make sure we *are* detached. */
-	KASSERT(cur->t_proc == NULL);
+void
+thread_unlendpriority(void)
+{
+	struct thread *cur = curthread;
+
+	/* Called holding the lock code's PI spinlock, so we can't move. */
+	ticketlock_acquire(&curcpu->c_runqueue_lock);
+	KASSERT(cur->t_loans > 0);
+	if (--cur->t_loans == 0 && cur->t_priority < cur->t_ownpriority) {
+		cur->t_priority = cur->t_ownpriority;
+		cur->t_quantum = thread_quanta[cur->t_priority];
+	}
+	ticketlock_release(&curcpu->c_runqueue_lock);
+}
 
-	/* Check the stack guard band. */
-	thread_checkstack(cur);
+/*
+ * CPU time accounting.
+ *
+ * Each cpu remembers in c_acctstamp when it last charged anyone, and
+ * at each boundary the time since then goes to whoever was running:
+ * to the current thread's user time on the way into the kernel from
+ * user mode, to its kernel time on the way back out or when it gives
+ * up the cpu, and to the cpu's idle time if it had nothing to run.
+ * Interrupts taken in the kernel are not boundaries; they are charged
+ * as kernel time to the thread they interrupt.
+ *
+ * The counters are only updated by the cpu the thread is running on.
+ * Other cpus may read them without locking (for ps or getrusage) and
+ * can see a torn 64-bit value now and then; that's tolerable for
+ * statistics.
+ */
+void
+thread_charge(bool user)
+{
+	struct cpu *c;
+	uint64_t now, delta;
+	int spl;
 
-	/* Interrupts off on this processor */
-        splhigh();
+	spl = splhigh();
+	c = curcpu->c_self;
 
-	/* This doesn't come back... */
-	thread_switch(S_ZOMBIE, NULL, NULL);
+	now = gettime_ns();
+	if (now == 0) {
+		/* No clock yet. */
+		splx(spl);
+		return;
+	}
+	delta = c->c_acctstamp == 0 ? 0 : now - c->c_acctstamp;
+	c->c_acctstamp = now;
 
-	/* ...so if it does, something's wrong. */
-	panic("braaaaaaaiiiiiiiiiiinssssss\n");
+	if (c->c_isidle) {
+		c->c_idletime += delta;
+	}
+	else if (user) {
+		curthread->t_utime += delta;
+	}
+	else {
+		curthread->t_stime += delta;
+	}
+	splx(spl);
 }
 
 /*
- * Yield the cpu to another process, but stay runnable.
+ * Print each cpu's idle time.
  */
 void
-thread_yield(void)
+thread_printidle(void)
 {
-	thread_switch(S_READY, NULL, NULL);
-}
+	struct cpu *c;
+	unsigned i;
 
-////////////////////////////////////////////////////////////
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %llu.%03llu s idle\n", c->c_number,
+			c->c_idletime / 1000000000ULL,
+			(c->c_idletime / 1000000ULL) % 1000);
+	}
+}
 
 /*
- * Scheduler.
- *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Act on IPI_RESCHED. Called at the end of interrupt handling, like
+ * the yield in hardclock.
  */
+void
+thread_check_resched(void)
+{
+	if (!curcpu->c_resched) {
+		return;
+	}
+	curcpu->c_resched = false;
+	thread_yield();
+}
 
+/*
+ * Age the run queues: move every waiting thread up one level. This
+ * is called periodically from hardclock().
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	ticketlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<NPRIORITIES; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			if (t->t_ownpriority > 0) {
+				t->t_ownpriority--;
+			}
+			t->t_priority = i - 1;
+			t->t_quantum = thread_quanta[i - 1];
+			threadlist_addtail(&curcpu->c_runqueue[i - 1], t);
+		}
+	}
+	ticketlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
@@ -864,12 +1959,12 @@ thread_consider_migration(void)
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		ticketlock_acquire(&c->c_runqueue_lock);
+		total_count += runqueue_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runqueue_count(c);
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		ticketlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -879,20 +1974,20 @@ thread_consider_migration(void)
 
 	to_send = my_count - one_share;
 	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
+	ticketlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	ticketlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		ticketlock_acquire(&c->c_runqueue_lock);
+		while (runqueue_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -922,8 +2017,19 @@ thread_consider_migration(void)
 				continue;
 			}
 
+			/*
+			 * Likewise skip threads that may not run on C.
+			 */
+			if (!thread_cpu_ok(t, c)) {
+				threadlist_addtail(&victims, t);
+				to_send--;
+				continue;
+			}
+
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
+			SCHEDTRACE(SCHEDTRACE_MIGRATE, t, curcpu->c_number,
+				   c->c_number);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -936,7 +2042,7 @@ thread_consider_migration(void)
 				ipi_send(c, IPI_UNIDLE);
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		ticketlock_release(&c->c_runqueue_lock);
 	}
 
 	/*
@@ -945,11 +2051,11 @@ thread_consider_migration(void)
 	 * Don't panic; just put them back on our own run queue.
 	 */
 	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
+		ticketlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		ticketlock_release(&curcpu->c_runqueue_lock);
 	}
 
 	KASSERT(threadlist_isempty(&victims));
@@ -1020,9 +2126,165 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * State for wchan_sleep_timeout, shared with its callout.
+ */
+struct wchan_timeout {
+	struct wchan *wt_wc;
+	struct spinlock *wt_lk;
+	struct thread *wt_thread;
+	bool wt_expired;
+};
+
+/*
+ * Callout function for wchan_sleep_timeout and wchan_sleep_intr: if
+ * the thread is still asleep on the channel, take it off and wake it.
+ */
+static
+void
+wchan_timeout_expire(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct thread *target = wt->wt_thread;
+
+	spinlock_acquire(wt->wt_lk);
+	if (target->t_wchan == wt->wt_wc) {
+		threadlist_remove(&wt->wt_wc->wc_threads, target);
+		target->t_wchan = NULL;
+		wt->wt_expired = true;
+		thread_make_runnable(target, false, false);
+	}
+	spinlock_release(wt->wt_lk);
+}
+
+/*
+ * Interruptible sleep. The interrupting thread can't just take us off
+ * the channel, as it doesn't hold LK and LK might be gone by the time
+ * it got it; so, as with wchan_sleep_timeout, a callout does that,
+ * and we stop the callout before returning. thread_intr_lock covers
+ * t_interrupted and t_intrco, and comes after wait channel spinlocks.
+ */
+static struct spinlock thread_intr_lock = SPINLOCK_INITIALIZER;
+
+int
+wchan_sleep_intr(struct wchan *wc, struct spinlock *lk)
+{
+	return wchan_sleep_timeout_intr(wc, lk, 0);
+}
+
+/*
+ * Both at once: the one callout serves for the timeout and for
+ * thread_interrupt, which just brings it forward, so which it was is
+ * told by t_interrupted. An interruption that comes as the time runs
+ * out counts as an interruption.
  */
+int
+wchan_sleep_timeout_intr(struct wchan *wc, struct spinlock *lk,
+			 unsigned ticks)
+{
+	struct thread *cur = curthread;
+	struct wchan_timeout wt;
+	struct callout co;
+	bool interrupted;
+
+	/* same rules as wchan_sleep */
+	KASSERT(!cur->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	wt.wt_wc = wc;
+	wt.wt_lk = lk;
+	wt.wt_thread = cur;
+	wt.wt_expired = false;
+	callout_init(&co, wchan_timeout_expire, &wt);
+
+	spinlock_acquire(&thread_intr_lock);
+	if (cur->t_interrupted) {
+		spinlock_release(&thread_intr_lock);
+		return EINTR;
+	}
+	cur->t_intrco = &co;
+	spinlock_release(&thread_intr_lock);
+
+	/* As for the timeout, the callout needs LK, which we hold. */
+	if (ticks > 0) {
+		callout_schedule(&co, ticks);
+	}
+	cur->t_timedsleep = true;
+	thread_switch(S_SLEEP, wc, lk);
+
+	spinlock_acquire(&thread_intr_lock);
+	cur->t_intrco = NULL;
+	interrupted = cur->t_interrupted;
+	spinlock_release(&thread_intr_lock);
+	callout_stop(&co);
+
+	spinlock_acquire(lk);
+	cur->t_timedsleep = false;
+	if (!wt.wt_expired) {
+		return 0;
+	}
+	return interrupted ? EINTR : ETIMEDOUT;
+}
+
 void
+thread_interrupt(struct thread *t)
+{
+	spinlock_acquire(&thread_intr_lock);
+	if (!t->t_interrupted) {
+		t->t_interrupted = true;
+		if (t->t_intrco != NULL) {
+			callout_schedule(t->t_intrco, 1);
+		}
+	}
+	spinlock_release(&thread_intr_lock);
+}
+
+/*
+ * Like wchan_sleep, but if nobody wakes us within TICKS hardclocks,
+ * wake up anyway. Returns 0 if woken normally and ETIMEDOUT if the
+ * time ran out.
+ *
+ * A timed-out thread does not get the priority boost a woken one
+ * does; it didn't get what it was waiting for.
+ */
+int
+wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk, unsigned ticks)
+{
+	struct wchan_timeout wt;
+	struct callout co;
+
+	/* same rules as wchan_sleep */
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	wt.wt_wc = wc;
+	wt.wt_lk = lk;
+	wt.wt_thread = curthread;
+	wt.wt_expired = false;
+
+	/*
+	 * The callout can't do anything until we're on the channel,
+	 * because it needs LK, which we hold until then.
+	 */
+	callout_init(&co, wchan_timeout_expire, &wt);
+	callout_schedule(&co, ticks);
+	curthread->t_timedsleep = true;
+	thread_switch(S_SLEEP, wc, lk);
+
+	/* Make sure it's done with WT before we return. */
+	callout_stop(&co);
+
+	spinlock_acquire(lk);
+	curthread->t_timedsleep = false;
+	return wt.wt_expired ? ETIMEDOUT : 0;
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel. Returns the thread,
+ * or NULL if there wasn't one.
+ */
+struct thread *
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
@@ -1034,8 +2296,9 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
+	target->t_wchan = NULL;
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1045,7 +2308,88 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	thread_make_runnable(target, false, true);
+	return target;
+}
+
+/*
+ * Return the highest priority (lowest number) of the threads asleep
+ * on a wait channel, or NPRIORITIES if there are none.
+ */
+unsigned
+wchan_toppriority(struct wchan *wc, struct spinlock *lk)
+{
+	struct thread *t;
+	unsigned prio;
+
+	KASSERT(spinlock_do_i_hold(lk));
+
+	prio = NPRIORITIES;
+	THREADLIST_FORALL(t, wc->wc_threads) {
+		if (t->t_priority < prio) {
+			prio = t->t_priority;
+		}
+	}
+	return prio;
+}
+
+/*
+ * Make all the threads on LIST runnable, boosting each as for a
+ * wakeup. Threads bound for the same cpu are put on its run queue
+ * together, taking the runqueue lock once and sending at most one
+ * notification, for the most important of them. LIST is left empty.
+ */
+static
+void
+thread_make_runnable_list(struct threadlist *list)
+{
+	struct threadlist rest;
+	struct thread *t, *best;
+	struct cpu *c;
+
+	threadlist_init(&rest);
+
+	while ((t = threadlist_remhead(list)) != NULL) {
+		if (!thread_cpu_ok(t, t->t_cpu)) {
+			/* needs to move; do it the slow way */
+			thread_make_runnable(t, false, true);
+			continue;
+		}
+
+		c = t->t_cpu;
+		ticketlock_acquire(&c->c_runqueue_lock);
+		thread_boost(t);
+		t->t_state = S_READY;
+		runqueue_add(c, t);
+		SCHEDTRACE(SCHEDTRACE_WAKEUP, t, c->c_number, t->t_priority);
+		best = t;
+
+		/* Take the rest of this cpu's threads along too. */
+		while ((t = threadlist_remhead(list)) != NULL) {
+			if (t->t_cpu != c || !thread_cpu_ok(t, c)) {
+				threadlist_addtail(&rest, t);
+				continue;
+			}
+			thread_boost(t);
+			t->t_state = S_READY;
+			runqueue_add(c, t);
+			SCHEDTRACE(SCHEDTRACE_WAKEUP, t, c->c_number,
+				   t->t_priority);
+			if (t->t_priority < best->t_priority) {
+				best = t;
+			}
+		}
+
+		thread_notify_cpu(c, best);
+		ticketlock_release(&c->c_runqueue_lock);
+
+		/* Put back the ones for other cpus for the next pass. */
+		while ((t = threadlist_remhead(&rest)) != NULL) {
+			threadlist_addtail(list, t);
+		}
+	}
+
+	threadlist_cleanup(&rest);
 }
 
 /*
@@ -1066,21 +2410,62 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * private list.
 	 */
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_wchan = NULL;
 		threadlist_addtail(&list, target);
 	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Make them runnable a cpu at a time, to cause fewer lock
+	 * ops and fewer IPIs.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
-	}
+	thread_make_runnable_list(&list);
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move up to MAX threads sleeping on FROM, whose spinlock is FROMLK,
+ * onto TO, whose spinlock is TOLK, without waking them. They will
+ * wake when TO is woken. Must hold both spinlocks. Returns the number
+ * moved.
+ *
+ * This is for wait morphing: when a CV is signalled while its lock is
+ * held, there's no point waking the waiters only for them to block
+ * on the lock; they go straight onto the lock's channel instead.
+ * When eventually woken they return from wchan_sleep as usual,
+ * reacquiring the spinlock they went to sleep with (FROMLK), not
+ * TOLK.
+ *
+ * Threads in a timed or interruptible sleep are left where they are:
+ * their callout looks for them on FROM, under FROMLK, and wouldn't
+ * find them anywhere else.
+ */
+unsigned
+wchan_requeue(struct wchan *from, struct spinlock *fromlk,
+	      struct wchan *to, struct spinlock *tolk, unsigned max)
+{
+	struct thread *target, *next;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	n = 0;
+	target = from->wc_threads.tl_head.tln_next->tln_self;
+	while (n < max && target != NULL) {
+		next = target->t_listnode.tln_next->tln_self;
+		if (!target->t_timedsleep) {
+			threadlist_remove(&from->wc_threads, target);
+			target->t_wchan = to;
+			target->t_wchan_name = to->wc_name;
+			threadlist_addtail(&to->wc_threads, target);
+			n++;
+		}
+		target = next;
+	}
+	return n;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1110,6 +2495,7 @@ ipi_send(struct cpu *target, int code)
 {
 	KASSERT(code >= 0 && code < 32);
 
+	SCHEDTRACE(SCHEDTRACE_IPISEND, target->c_number, code, 0);
 	spinlock_acquire(&target->c_ipi_lock);
 	target->c_ipi_pending |= (uint32_t)1 << code;
 	mainbus_send_ipi(target);
@@ -1134,37 +2520,109 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Queue N TLB shootdowns for TARGET and poke it. Returns a ticket:
+ * the requests have been done once TARGET's c_shootdown_done reaches
+ * it.
+ *
+ * If the requests won't fit, rather than panicking (or sleeping for
+ * space, which would interact awkwardly with VM system locking) we
+ * throw the queue away and have the target flush its whole TLB,
+ * which covers everything that was asked for.
  */
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+static
+unsigned
+ipi_tlbshootdown_queue(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
 {
-	unsigned n;
+	unsigned i, ticket;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+	if (target->c_shootdown_all ||
+	    target->c_numshootdown + n > TLBSHOOTDOWN_MAX) {
+		target->c_shootdown_all = true;
+		target->c_numshootdown = 0;
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		for (i=0; i<n; i++) {
+			target->c_shootdown[target->c_numshootdown++] =
+				mappings[i];
+		}
 	}
+	ticket = ++target->c_shootdown_seq;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+	SCHEDTRACE(SCHEDTRACE_IPISEND, target->c_number, IPI_TLBSHOOTDOWN, n);
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+/*
+ * Send a TLB shootdown IPI to the specified CPU.
+ */
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	(void)ipi_tlbshootdown_queue(target, mapping, 1);
+}
+
+/*
+ * Do the N shootdowns in MAPPINGS on every CPU in MASK and wait for
+ * them to finish. All the requests go to each CPU as one batch, with
+ * one IPI.
+ *
+ * The current CPU's share is done directly. We stay at splhigh while
+ * queueing so we can't migrate partway through and miss the CPU we
+ * end up on; but we must wait at spl0 with no spinlocks held, because
+ * the other CPUs may be busy waiting for us to answer them.
+ */
+void
+ipi_tlbshootdown_sync(uint32_t mask,
+		      const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned tickets[32];
+	unsigned i, num;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	num = cpuarray_num(&allcpus);
+	KASSERT(num <= 32);
+
+	spl = splhigh();
+	for (i=0; i<num; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((mask & CPUMASK_CPU(i)) == 0 || c == curcpu->c_self) {
+			continue;
+		}
+		tickets[i] = ipi_tlbshootdown_queue(c, mappings, n);
+	}
+	if (mask & CPUMASK_CPU(curcpu->c_number)) {
+		if (n > TLBSHOOTDOWN_MAX) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<n; i++) {
+				vm_tlbshootdown(&mappings[i]);
+			}
+		}
+	}
+	mask &= ~CPUMASK_CPU(curcpu->c_number);
+	splx(spl);
+
+	for (i=0; i<num; i++) {
+		if ((mask & CPUMASK_CPU(i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		while ((int)(c->c_shootdown_done - tickets[i]) < 0) {
+			membar_any_any();
+		}
+	}
 }
 
 /*
@@ -1173,11 +2631,14 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 void
 interprocessor_interrupt(void)
 {
+	struct tlbshootdown shootdown[TLBSHOOTDOWN_MAX];
+	unsigned i, numshootdown = 0, seq = 0;
+	bool shootdown_all = false;
 	uint32_t bits;
-	unsigned i;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
+	SCHEDTRACE(SCHEDTRACE_IPIRECV, bits, 0, 0);
 
 	if (bits & (1U << IPI_PANIC)) {
 		/* panic on another cpu - just stop dead */
@@ -1187,12 +2648,12 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_OFFLINE)) {
 		/* offline request */
 		spinlock_release(&curcpu->c_ipi_lock);
-		spinlock_acquire(&curcpu->c_runqueue_lock);
+		ticketlock_acquire(&curcpu->c_runqueue_lock);
 		if (!curcpu->c_isidle) {
 			kprintf("cpu%d: offline: warning: not idle\n",
 				curcpu->c_number);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		ticketlock_release(&curcpu->c_runqueue_lock);
 		kprintf("cpu%d: offline.\n", curcpu->c_number);
 		cpu_halt();
 	}
@@ -1202,18 +2663,43 @@ interprocessor_interrupt(void)
 		 * interrupt; don't need to do anything else.
 		 */
 	}
+	if (bits & (1U << IPI_RESCHED)) {
+		/*
+		 * Can't switch while holding the IPI lock (or before
+		 * the IPI is cleared); thread_check_resched does it.
+		 */
+		curcpu->c_resched = true;
+	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
-		 * Note: depending on your VM system locking you might
-		 * need to release the ipi lock while calling
-		 * vm_tlbshootdown.
+		 * Take the requests off the queue and do them after
+		 * releasing the ipi lock, so senders aren't held up
+		 * behind us. Anything queued after this point comes
+		 * with its own IPI.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		numshootdown = curcpu->c_numshootdown;
+		for (i=0; i<numshootdown; i++) {
+			shootdown[i] = curcpu->c_shootdown[i];
 		}
+		shootdown_all = curcpu->c_shootdown_all;
+		seq = curcpu->c_shootdown_seq;
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_all = false;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+		if (shootdown_all) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<numshootdown; i++) {
+				vm_tlbshootdown(&shootdown[i]);
+			}
+		}
+		membar_any_any();
+		curcpu->c_shootdown_done = seq;
+	}
 }
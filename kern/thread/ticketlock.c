@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <ticketlock.h>
+#include <membar.h>
+#include <current.h>	/* for curcpu */
+
+/*
+ * Ticket locks.
+ */
+
+/*
+ * While waiting, wait this many loop iterations for each cpu ahead
+ * of us in line before looking at tl_serving again. Every waiter
+ * polls the same word, so this keeps the traffic down when the line
+ * is long.
+ */
+#define TICKETLOCK_BACKOFF	32
+
+/*
+ * Wait for roughly N loop iterations.
+ */
+static
+void
+ticketlock_backoff(unsigned n)
+{
+	volatile unsigned i;
+
+	for (i=0; i<n; i++) {
+		/* nothing */
+	}
+}
+
+/*
+ * Initialize ticket lock.
+ */
+void
+ticketlock_init(struct ticketlock *tl)
+{
+	spinlock_data_set(&tl->tl_next, 0);
+	spinlock_data_set(&tl->tl_serving, 0);
+	tl->tl_holder = NULL;
+	HANGMAN_LOCKABLEINIT(&tl->tl_hangman, "ticketlock");
+}
+
+/*
+ * Clean up ticket lock.
+ */
+void
+ticketlock_cleanup(struct ticketlock *tl)
+{
+	KASSERT(tl->tl_holder == NULL);
+	KASSERT(spinlock_data_get(&tl->tl_next) ==
+		spinlock_data_get(&tl->tl_serving));
+}
+
+/*
+ * Get the lock.
+ *
+ * As with spinlocks, disable interrupts first. Then take a ticket
+ * and wait for our turn. The ticket counters wrap around, which is
+ * fine as long as there are fewer than 2^32 cpus.
+ */
+void
+ticketlock_acquire(struct ticketlock *tl)
+{
+	struct cpu *mycpu;
+	spinlock_data_t ticket, serving;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (tl->tl_holder == mycpu) {
+			panic("Deadlock on ticket lock %p\n", tl);
+		}
+		mycpu->c_spinlocks++;
+
+		HANGMAN_WAIT(&curcpu->c_hangman, &tl->tl_hangman);
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	ticket = spinlock_data_fetchinc(&tl->tl_next);
+	while (1) {
+		serving = spinlock_data_get(&tl->tl_serving);
+		if (serving == ticket) {
+			break;
+		}
+		ticketlock_backoff((ticket - serving) * TICKETLOCK_BACKOFF);
+	}
+
+	membar_any_any();
+	tl->tl_holder = mycpu;
+
+	if (CURCPU_EXISTS()) {
+		HANGMAN_ACQUIRE(&curcpu->c_hangman, &tl->tl_hangman);
+	}
+}
+
+/*
+ * Release the lock, by passing it to the next ticket. Only the
+ * holder writes tl_serving, so this needn't be atomic.
+ */
+void
+ticketlock_release(struct ticketlock *tl)
+{
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		KASSERT(tl->tl_holder == curcpu->c_self);
+		KASSERT(curcpu->c_spinlocks > 0);
+		curcpu->c_spinlocks--;
+		HANGMAN_RELEASE(&curcpu->c_hangman, &tl->tl_hangman);
+	}
+
+	tl->tl_holder = NULL;
+	membar_any_store();
+	spinlock_data_set(&tl->tl_serving,
+			  spinlock_data_get(&tl->tl_serving) + 1);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+/*
+ * Check if the current cpu holds the lock.
+ */
+bool
+ticketlock_do_i_hold(struct ticketlock *tl)
+{
+	if (!CURCPU_EXISTS()) {
+		return true;
+	}
+
+	return (tl->tl_holder == curcpu->c_self);
+}
@@ -33,6 +33,10 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>
+#include <wchan.h>
+#include <synch.h>
+#include <cpu.h>
+#include <thread.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -50,6 +54,13 @@
  *
  */
 
+/*
+ * Address space ids, for telling what a cpu's TLB holds. Id 0 means
+ * none, so they start at 1.
+ */
+static struct spinlock as_id_lock = SPINLOCK_INITIALIZER;
+static unsigned as_nextid = 1;
+
 struct addrspace *
 as_create(void)
 {
@@ -61,8 +72,19 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+
 	// Malloc memory for top level table
 	as->pt = kmalloc(FIRST_LEVEL_SIZE * sizeof(paddr_t **));
+	if (as->pt == NULL) {
+		lock_destroy(as->as_lock);
+		kfree(as);
+		return NULL;
+	}
 	for (int i = 0; i < FIRST_LEVEL_SIZE; i++) {
 		// Initialise first level to all NULL
 		as->pt[i] = NULL;
@@ -70,6 +92,13 @@ as_create(void)
 
 	// Initialise as regions as empty
 	as->regions = NULL;
+	as->reap_next = NULL;
+
+	spinlock_acquire(&as_id_lock);
+	as->as_id = as_nextid++;
+	spinlock_release(&as_id_lock);
+	as->as_cpumask = 0;
+	spinlock_init(&as->as_cpulock);
 	
 	
 	return as;
@@ -85,42 +114,55 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         return ENOMEM;
     }
 
-    // loop through old page table and hard copy contents to new address space
+    // Other threads in the process may be faulting pages in
+    lock_acquire(old->as_lock);
+
+    // loop through old page table and hard copy contents to new address space.
+    // Each table is cleared before it's filled in, so that if we run out
+    // of memory part way as_destroy only sees what was actually copied.
     for (int i = 0; i < FIRST_LEVEL_SIZE; i++) {
         if (!old->pt[i]) continue;
         newas->pt[i] = kmalloc(SECOND_LEVEL_SIZE * sizeof(paddr_t *));
         // return error if not enough memory
         if (newas->pt[i] == NULL) {
+            lock_release(old->as_lock);
+            as_destroy(newas);
             return ENOMEM;
         }
         for (int j = 0; j < SECOND_LEVEL_SIZE; j++) {
-            if (old->pt[i][j]) {
-                newas->pt[i][j] = kmalloc(THIRD_LEVEL_SIZE *sizeof(paddr_t));
+            newas->pt[i][j] = NULL;
+        }
+        for (int j = 0; j < SECOND_LEVEL_SIZE; j++) {
+            if (!old->pt[i][j]) continue;
+            newas->pt[i][j] = kmalloc(THIRD_LEVEL_SIZE *sizeof(paddr_t));
+            // return error if not enough memory
+            if (newas->pt[i][j] == NULL) {
+                lock_release(old->as_lock);
+                as_destroy(newas);
+                return ENOMEM;
+            }
+            for (int k = 0; k < THIRD_LEVEL_SIZE; k++) {
+                newas->pt[i][j][k] = 0;
+            }
+            for (int k = 0; k < THIRD_LEVEL_SIZE; k++) {
+                if (!old->pt[i][j][k]) continue;
+                int dirty_bit = old->pt[i][j][k] & TLBLO_DIRTY;
+                vaddr_t new_frame_addr = alloc_kpages(1);
                 // return error if not enough memory
-                if (newas->pt[i][j] == NULL) {
+                if (new_frame_addr == 0) {
+                    lock_release(old->as_lock);
+                    as_destroy(newas);
                     return ENOMEM;
                 }
-                for (int k = 0; k < THIRD_LEVEL_SIZE; k++) {
-                    if (old->pt[i][j][k]) {
-                        int dirty_bit = old->pt[i][j][k] & TLBLO_DIRTY;
-                        vaddr_t new_frame_addr = alloc_kpages(1);
-                        memcpy((void *)new_frame_addr, (const void *)PADDR_TO_KVADDR(old->pt[i][j][k] & PAGE_FRAME), PAGE_SIZE);
-                        newas->pt[i][j][k] = (KVADDR_TO_PADDR(new_frame_addr) & PAGE_FRAME) | dirty_bit | TLBLO_VALID;
-                    }
-                    else {
-                        newas->pt[i][j][k] = 0;
-                    }
-                }
+                memcpy((void *)new_frame_addr, (const void *)PADDR_TO_KVADDR(old->pt[i][j][k] & PAGE_FRAME), PAGE_SIZE);
+                newas->pt[i][j][k] = (KVADDR_TO_PADDR(new_frame_addr) & PAGE_FRAME) | dirty_bit | TLBLO_VALID;
             }
-            else {
-                newas->pt[i][j] = NULL;
-            }
-
         }
     }
 
 	// no regions
     if (old->regions == NULL) {
+        lock_release(old->as_lock);
         newas->regions = NULL;
         *ret = newas;
         return 0;
@@ -129,6 +171,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	// copy head of linked list
     struct region *reg = kmalloc(sizeof(struct region));
 	if (!reg) {
+		lock_release(old->as_lock);
 		as_destroy(newas);
 		return ENOMEM;
 	}
@@ -144,6 +187,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     while(list) {
         struct region *temp_reg = kmalloc(sizeof(struct region));
         if (!temp_reg) {
+            lock_release(old->as_lock);
             as_destroy(newas);
             return ENOMEM;
         }
@@ -156,14 +200,44 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		reg = reg->next;
         list = list->next;
     }
-    
+    lock_release(old->as_lock);
+
     *ret = newas;
 	return 0;
 }
 
-void
-as_destroy(struct addrspace *as)
-{	
+/*
+ * Address space reaper.
+ *
+ * Tearing down a big address space means freeing every frame and
+ * page-table page in it, which takes a while. Rather than make the
+ * exiting process (and its parent in waitpid) wait for that,
+ * as_destroy puts the address space on a list and the reaper thread
+ * frees it later. Frames are handed back AS_REAP_BATCH at a time, so
+ * the frame table lock is taken once per batch instead of once per
+ * frame.
+ *
+ * Before the reaper is started, address spaces are freed directly.
+ * When memory is short the reclaim code empties the list on the spot.
+ */
+
+#define AS_REAP_BATCH 32
+
+static struct spinlock as_reap_lock = SPINLOCK_INITIALIZER;
+static struct wchan *as_reap_wchan;		/* reaper sleeps here */
+static struct addrspace *as_reap_list;		/* waiting to be freed */
+
+/*
+ * Free everything in an address space. Returns the number of frames
+ * freed.
+ */
+static
+unsigned
+as_free(struct addrspace *as)
+{
+	vaddr_t batch[AS_REAP_BATCH];
+	unsigned nbatch = 0, nframes = 0;
+
 	// Free page table
 	for (int i = 0; i < FIRST_LEVEL_SIZE; i++) {
 		if (!as->pt[i]) continue;
@@ -171,13 +245,20 @@ as_destroy(struct addrspace *as)
 			if (!as->pt[i][j]) continue;
 			for (int k = 0; k < THIRD_LEVEL_SIZE; k++) {
 				if (!as->pt[i][j][k]) continue;
-				free_kpages(PADDR_TO_KVADDR(as->pt[i][j][k] & PAGE_FRAME));
+				batch[nbatch++] = PADDR_TO_KVADDR(as->pt[i][j][k] & PAGE_FRAME);
+				if (nbatch == AS_REAP_BATCH) {
+					free_kpages_batch(batch, nbatch);
+					nframes += nbatch;
+					nbatch = 0;
+				}
 			}
 			kfree(as->pt[i][j]);
 		}
 		kfree(as->pt[i]);
 	}
 	kfree(as->pt);
+	free_kpages_batch(batch, nbatch);
+	nframes += nbatch;
 
 	// Free region linked list
 	struct region *cur = as->regions;
@@ -188,17 +269,132 @@ as_destroy(struct addrspace *as)
 		kfree(tmp);
 	}
 
+	spinlock_cleanup(&as->as_cpulock);
+	lock_destroy(as->as_lock);
 	kfree(as);
 
-	as = NULL;
+	return nframes;
+}
+
+/*
+ * Take the whole reap list. Returns NULL if it's empty.
+ */
+static
+struct addrspace *
+as_reap_take(void)
+{
+	struct addrspace *list;
+
+	spinlock_acquire(&as_reap_lock);
+	list = as_reap_list;
+	as_reap_list = NULL;
+	spinlock_release(&as_reap_lock);
+	return list;
+}
+
+/*
+ * Free everything on LIST. Returns the number of frames freed.
+ */
+static
+unsigned
+as_reap_all(struct addrspace *list)
+{
+	struct addrspace *as;
+	unsigned nframes = 0;
+
+	while (list != NULL) {
+		as = list;
+		list = list->reap_next;
+		nframes += as_free(as);
+	}
+	return nframes;
 }
 
-// Put translations into TLB of current address space, flush TLB
+static
+void
+as_reaper_thread(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		spinlock_acquire(&as_reap_lock);
+		while (as_reap_list == NULL) {
+			wchan_sleep(as_reap_wchan, &as_reap_lock);
+		}
+		spinlock_release(&as_reap_lock);
+
+		as_reap_all(as_reap_take());
+	}
+}
+
+/*
+ * Reclaim hook: free whatever is waiting for the reaper right now.
+ */
+static
+unsigned
+as_reap_reclaim(unsigned npages)
+{
+	(void)npages;
+	return as_reap_all(as_reap_take());
+}
+
+/*
+ * Start the reaper. Called from vm_bootstrap.
+ */
+void
+as_reaper_bootstrap(void)
+{
+	int result;
+
+	as_reap_wchan = wchan_create("as reaper");
+	if (as_reap_wchan == NULL) {
+		panic("as_reaper_bootstrap: Out of memory\n");
+	}
+
+	result = thread_fork("as reaper", NULL, as_reaper_thread, NULL, 0);
+	if (result) {
+		panic("as_reaper_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+
+	result = reclaim_register("as reaper", as_reap_reclaim);
+	if (result) {
+		panic("as_reaper_bootstrap: reclaim_register: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+as_destroy(struct addrspace *as)
+{	
+	if (as_reap_wchan == NULL) {
+		/* Too early in boot; do it now. */
+		as_free(as);
+		return;
+	}
+
+	spinlock_acquire(&as_reap_lock);
+	as->reap_next = as_reap_list;
+	as_reap_list = as;
+	wchan_wakeone(as_reap_wchan, &as_reap_lock);
+	spinlock_release(&as_reap_lock);
+}
+
+/*
+ * Make curproc's address space the one in the TLB.
+ *
+ * The TLB only needs flushing if it holds some other address space's
+ * entries: switching between threads of one process, or to a kernel
+ * thread and back, leaves it alone. So that changes to the mappings
+ * still reach this cpu's TLB, we add ourselves to the address space's
+ * cpu mask; vm_tlbshootdown takes us out again once we've moved on.
+ */
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
+	int spl;
 
 	as = proc_getas();
 	if (as == NULL) {
@@ -208,8 +404,13 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if (curcpu->c_tlbasid != as->as_id) {
+		spinlock_acquire(&as->as_cpulock);
+		as->as_cpumask |= CPUMASK_CPU(curcpu->c_number);
+		spinlock_release(&as->as_cpulock);
+
+		vm_tlbflush();
+		curcpu->c_tlbasid = as->as_id;
 	}
 
 	splx(spl);
@@ -219,7 +420,12 @@ as_activate(void)
 void
 as_deactivate(void)
 {
-	/* nothing */
+	int spl;
+
+	spl = splhigh();
+	vm_tlbflush();
+	curcpu->c_tlbasid = 0;
+	splx(spl);
 }
 
 /*
@@ -259,7 +465,8 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 			cur = cur->next;
 		}
 		// At correct vadrr
-		prev->next = r;
+		if (prev == NULL) as->regions = r;
+		else prev->next = r;
 		r->next = cur;
 	}
 
@@ -297,7 +504,7 @@ as_complete_load(struct addrspace *as)
 	}
 
 	// flush TLB at end since TLB has writing enabled while loading segments
-	as_activate();
+	vm_tlbshootdown_as(as);
 
 	return 0;
 }
@@ -315,3 +522,98 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+
+/*
+ * User stacks for the threads of a multithreaded process. Slot 0 is
+ * the stack from as_define_stack; the others go below it, each with
+ * an unmapped guard page underneath so an overflow faults instead of
+ * running into the next one.
+ */
+#define THREADSTACK_SPACING (VIRTUAL_STACK_SIZE + PAGE_SIZE)
+
+int
+as_define_threadstack(struct addrspace *as, unsigned slot, vaddr_t *stackptr)
+{
+	vaddr_t top;
+	struct region *r;
+	int err;
+
+	top = USERSTACK - slot * THREADSTACK_SPACING;
+
+	lock_acquire(as->as_lock);
+	/* A forked child may have inherited the stack already. */
+	for (r = as->regions; r != NULL; r = r->next) {
+		if (r->start_vaddr == top - VIRTUAL_STACK_SIZE) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		err = as_define_region(as, top - VIRTUAL_STACK_SIZE,
+				       VIRTUAL_STACK_SIZE, 1, 1, 0);
+		if (err) {
+			lock_release(as->as_lock);
+			return err;
+		}
+	}
+	lock_release(as->as_lock);
+
+	*stackptr = top;
+	return 0;
+}
+
+void
+as_remove_threadstack(struct addrspace *as, unsigned slot)
+{
+	vaddr_t base, va, batch[VIRTUAL_STACK_SIZE / PAGE_SIZE];
+	vaddr_t unmapped[VIRTUAL_STACK_SIZE / PAGE_SIZE];
+	struct region *r, *prev;
+	unsigned nbatch, i, j, k;
+	paddr_t *pte;
+
+	base = USERSTACK - slot * THREADSTACK_SPACING - VIRTUAL_STACK_SIZE;
+
+	lock_acquire(as->as_lock);
+	prev = NULL;
+	for (r = as->regions; r != NULL; r = r->next) {
+		if (r->start_vaddr == base) {
+			break;
+		}
+		prev = r;
+	}
+	if (r == NULL) {
+		lock_release(as->as_lock);
+		return;
+	}
+	if (prev == NULL) {
+		as->regions = r->next;
+	}
+	else {
+		prev->next = r->next;
+	}
+
+	/* Unmap its pages, remembering the frames. */
+	nbatch = 0;
+	for (va = base; va < base + r->npages * PAGE_SIZE; va += PAGE_SIZE) {
+		i = va >> 24;
+		j = va << 8 >> 26;
+		k = va << 14 >> 26;
+		if (as->pt[i] == NULL || as->pt[i][j] == NULL) {
+			continue;
+		}
+		pte = &as->pt[i][j][k];
+		if (*pte != 0) {
+			unmapped[nbatch] = va;
+			batch[nbatch++] = PADDR_TO_KVADDR(*pte & PAGE_FRAME);
+			*pte = 0;
+		}
+	}
+
+	/* Nobody may still reach them when they're reused. */
+	if (nbatch > 0) {
+		vm_tlbshootdown_pages(as, unmapped, nbatch);
+		free_kpages_batch(batch, nbatch);
+	}
+	lock_release(as->as_lock);
+
+	kfree(r);
+}
@@ -31,6 +31,7 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include "opt-kmprof.h"
 
 /*
  * Kernel malloc.
@@ -102,6 +103,10 @@ fill_deadbeef(void *vptr, size_t len)
  * LABELS records the allocation site and a generation number for each
  * allocation and is useful for tracking down memory leaks.
  *
+ * The kmprof kernel config option (OPT_KMPROF) is independent of all
+ * of these. It tags each allocation with its call site and keeps
+ * per-site totals of live blocks and bytes; see below.
+ *
  * On top of these one can enable the following:
  *
  * CHECKBEEF checks that free blocks still contain 0xdeadbeef when
@@ -345,6 +350,9 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/* Number of pages held by the subpage allocator, now and at most. */
+static unsigned subpage_curpages, subpage_peakpages;
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -697,6 +705,319 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+////////////////////////////////////////
+
+#if OPT_KMPROF
+
+/*
+ * Call-site profiler.
+ *
+ * Every allocation carries a small tag recording which call site
+ * made it and how many bytes were asked for. The call sites live in
+ * a fixed-size open hash table keyed by return address, each with a
+ * count of live blocks, live bytes, and total allocations ever made.
+ * kfree reads the tag back and charges the free to the same site.
+ *
+ * Whole-page allocations are page-aligned and have no room for a
+ * tag, so they are recorded in a separate small table keyed by
+ * address instead.
+ *
+ * Sites that don't fit in the table, and big allocations that don't
+ * fit in theirs, are lumped into the overflow slot at the end of
+ * kmprof_sites[], which is printed as "(other)".
+ *
+ * All of this is protected by kmalloc_spinlock.
+ */
+
+#define KMPROF_NSITES 256	/* must be a power of 2 */
+#define KMPROF_OTHER KMPROF_NSITES
+#define KMPROF_NBIG 128		/* must be a power of 2 */
+
+#define KMPROF_PTROFFSET sizeof(struct kmprof_tag)
+#define KMPROF_OVERHEAD KMPROF_PTROFFSET
+
+struct kmprof_site {
+	vaddr_t ks_site;		/* return address in caller */
+	unsigned ks_live;		/* number of live blocks */
+	size_t ks_livebytes;		/* bytes requested by live blocks */
+	unsigned ks_total;		/* allocations ever made */
+};
+
+struct kmprof_tag {
+	uint32_t kt_site;		/* index into kmprof_sites[] */
+	uint32_t kt_size;		/* client size */
+};
+
+struct kmprof_big {
+	vaddr_t kb_addr;		/* 0 if slot unused */
+	uint32_t kb_site;
+	uint32_t kb_size;
+};
+
+static struct kmprof_site kmprof_sites[KMPROF_NSITES + 1];
+static struct kmprof_big kmprof_bigs[KMPROF_NBIG];
+
+/*
+ * Find (or create) the table slot for call site SITE.
+ */
+static
+unsigned
+kmprof_findsite(vaddr_t site)
+{
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	i = (site >> 2) & (KMPROF_NSITES - 1);
+	for (n=0; n<KMPROF_NSITES; n++) {
+		if (kmprof_sites[i].ks_site == site) {
+			return i;
+		}
+		if (kmprof_sites[i].ks_site == 0) {
+			kmprof_sites[i].ks_site = site;
+			return i;
+		}
+		i = (i + 1) & (KMPROF_NSITES - 1);
+	}
+	return KMPROF_OTHER;
+}
+
+/*
+ * Charge an allocation of SIZE bytes to SITE; return the slot used.
+ */
+static
+unsigned
+kmprof_alloc(vaddr_t site, size_t size)
+{
+	unsigned i;
+
+	i = kmprof_findsite(site);
+	kmprof_sites[i].ks_live++;
+	kmprof_sites[i].ks_livebytes += size;
+	kmprof_sites[i].ks_total++;
+	return i;
+}
+
+/*
+ * Credit a free of SIZE bytes back to slot I.
+ */
+static
+void
+kmprof_free(unsigned i, size_t size)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(i <= KMPROF_OTHER);
+	KASSERT(kmprof_sites[i].ks_live > 0);
+	KASSERT(kmprof_sites[i].ks_livebytes >= size);
+
+	kmprof_sites[i].ks_live--;
+	kmprof_sites[i].ks_livebytes -= size;
+}
+
+/*
+ * Tag a subpage block.
+ */
+static
+void *
+establishkmprof(void *block, vaddr_t site, size_t size)
+{
+	struct kmprof_tag *kt;
+
+	kt = block;
+	kt->kt_site = kmprof_alloc(site, size);
+	kt->kt_size = size;
+	kt++;
+	return kt;
+}
+
+/*
+ * Untag a subpage block, given the address of its tag.
+ */
+static
+void
+releasekmprof(vaddr_t tagaddr)
+{
+	struct kmprof_tag *kt;
+
+	kt = (struct kmprof_tag *)tagaddr;
+	kmprof_free(kt->kt_site, kt->kt_size);
+}
+
+/*
+ * Record a whole-page allocation.
+ */
+static
+void
+kmprof_bigalloc(vaddr_t addr, vaddr_t site, size_t size)
+{
+	unsigned i, n, slot;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	slot = kmprof_alloc(site, size);
+	i = (addr / PAGE_SIZE) & (KMPROF_NBIG - 1);
+	for (n=0; n<KMPROF_NBIG; n++) {
+		if (kmprof_bigs[i].kb_addr == 0) {
+			kmprof_bigs[i].kb_addr = addr;
+			kmprof_bigs[i].kb_site = slot;
+			kmprof_bigs[i].kb_size = size;
+			spinlock_release(&kmalloc_spinlock);
+			return;
+		}
+		i = (i + 1) & (KMPROF_NBIG - 1);
+	}
+
+	/*
+	 * No room; move the charge to the overflow slot. Since we
+	 * won't be able to find the size again at kfree time, count
+	 * the block but not its bytes.
+	 */
+	kmprof_free(slot, size);
+	kmprof_sites[slot].ks_total--;
+	kmprof_sites[KMPROF_OTHER].ks_live++;
+	kmprof_sites[KMPROF_OTHER].ks_total++;
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Forget a whole-page allocation.
+ */
+static
+void
+kmprof_bigfree(vaddr_t addr)
+{
+	unsigned i, j, n, home;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	i = (addr / PAGE_SIZE) & (KMPROF_NBIG - 1);
+	for (n=0; n<KMPROF_NBIG; n++) {
+		if (kmprof_bigs[i].kb_addr == addr) {
+			break;
+		}
+		if (kmprof_bigs[i].kb_addr == 0) {
+			n = KMPROF_NBIG;
+			break;
+		}
+		i = (i + 1) & (KMPROF_NBIG - 1);
+	}
+	if (n == KMPROF_NBIG) {
+		/* Must have been charged to the overflow slot. */
+		kmprof_free(KMPROF_OTHER, 0);
+		spinlock_release(&kmalloc_spinlock);
+		return;
+	}
+
+	kmprof_free(kmprof_bigs[i].kb_site, kmprof_bigs[i].kb_size);
+	kmprof_bigs[i].kb_addr = 0;
+
+	/*
+	 * Close up the hole so later probes don't stop short: re-home
+	 * any following entries in the same cluster.
+	 */
+	j = i;
+	while (1) {
+		j = (j + 1) & (KMPROF_NBIG - 1);
+		if (kmprof_bigs[j].kb_addr == 0) {
+			break;
+		}
+		home = (kmprof_bigs[j].kb_addr / PAGE_SIZE) & (KMPROF_NBIG - 1);
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && (home <= i && home > j))) {
+			kmprof_bigs[i] = kmprof_bigs[j];
+			kmprof_bigs[j].kb_addr = 0;
+			i = j;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Print one line of the profile.
+ */
+static
+void
+kmprof_printsite(unsigned i)
+{
+	const struct kmprof_site *ks = &kmprof_sites[i];
+
+	if (i == KMPROF_OTHER) {
+		kprintf("   (other)   ");
+	}
+	else {
+		kprintf("   0x%08lx  ", (unsigned long)ks->ks_site);
+	}
+	kprintf("%8lu %7u %9u\n", (unsigned long)ks->ks_livebytes,
+		ks->ks_live, ks->ks_total);
+}
+
+#else
+
+#define KMPROF_OVERHEAD 0
+
+#endif /* OPT_KMPROF */
+
+/*
+ * Print the call sites holding the most live heap, biggest first.
+ * If ALL is false, print only the top few.
+ */
+void
+kheap_profdump(bool all)
+{
+#if OPT_KMPROF
+	const unsigned maxshown = all ? KMPROF_NSITES + 1 : 20;
+	unsigned i, shown, best;
+	size_t bestbytes, lastbytes;
+	unsigned lastindex;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kprintf("Live kernel heap by call site:\n");
+	kprintf("   call site      bytes  blocks    allocs\n");
+
+	/*
+	 * Selection sort by (livebytes, index) descending, without
+	 * needing any scratch space.
+	 */
+	lastbytes = (size_t)-1;
+	lastindex = KMPROF_NSITES + 1;
+	for (shown = 0; shown < maxshown; shown++) {
+		best = KMPROF_NSITES + 1;
+		bestbytes = 0;
+		for (i=0; i<=KMPROF_NSITES; i++) {
+			const struct kmprof_site *ks = &kmprof_sites[i];
+
+			if (ks->ks_total == 0) {
+				continue;
+			}
+			if (ks->ks_livebytes > lastbytes ||
+			    (ks->ks_livebytes == lastbytes && i <= lastindex)) {
+				/* already printed */
+				continue;
+			}
+			if (best > KMPROF_NSITES ||
+			    ks->ks_livebytes > bestbytes) {
+				best = i;
+				bestbytes = ks->ks_livebytes;
+			}
+		}
+		if (best > KMPROF_NSITES) {
+			break;
+		}
+		if (bestbytes == 0 && !all) {
+			break;
+		}
+		kmprof_printsite(best);
+		lastbytes = bestbytes;
+		lastindex = best;
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+#else
+	(void)all;
+	kprintf("Enable the kmprof kernel option to use this functionality.\n");
+#endif
+}
+
 void
 kheap_nextgeneration(void)
 {
@@ -814,6 +1135,30 @@ kheap_printstats(void)
 	spinlock_release(&kmalloc_spinlock);
 }
 
+/*
+ * Report how many pages the subpage allocator holds now, and the
+ * most it has held since the last kheap_resetpeak.
+ */
+void
+kheap_getpages(unsigned *curpages, unsigned *peakpages)
+{
+	spinlock_acquire(&kmalloc_spinlock);
+	*curpages = subpage_curpages;
+	*peakpages = subpage_peakpages;
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Reset the peak page count to the current page count.
+ */
+void
+kheap_resetpeak(void)
+{
+	spinlock_acquire(&kmalloc_spinlock);
+	subpage_peakpages = subpage_curpages;
+	spinlock_release(&kmalloc_spinlock);
+}
+
 ////////////////////////////////////////
 
 /*
@@ -873,7 +1218,7 @@ int blocktype(size_t clientsz)
 static
 void *
 subpage_kmalloc(size_t sz
-#ifdef LABELS
+#if defined(LABELS) || OPT_KMPROF
 		, vaddr_t label
 #endif
 	)
@@ -890,7 +1235,13 @@ subpage_kmalloc(size_t sz
 #ifdef GUARDS
 	size_t clientsz;
 #endif
+#if OPT_KMPROF
+	size_t profsz;
+#endif
 
+#if OPT_KMPROF
+	profsz = sz;
+#endif
 #ifdef GUARDS
 	clientsz = sz;
 	sz += GUARD_OVERHEAD;
@@ -901,6 +1252,13 @@ subpage_kmalloc(size_t sz
 	clientsz += LABEL_PTROFFSET;
 #endif
 	sz += LABEL_PTROFFSET;
+#endif
+#if OPT_KMPROF
+#ifdef GUARDS
+	/* Likewise the profiler tag. */
+	clientsz += KMPROF_PTROFFSET;
+#endif
+	sz += KMPROF_PTROFFSET;
 #endif
 	blktype = blocktype(sz);
 #ifdef GUARDS
@@ -946,6 +1304,9 @@ subpage_kmalloc(size_t sz
 #ifdef LABELS
 			retptr = establishlabel(retptr, label);
 #endif
+#if OPT_KMPROF
+			retptr = establishkmprof(retptr, label, profsz);
+#endif
 
 			checksubpages();
 
@@ -989,6 +1350,11 @@ subpage_kmalloc(size_t sz
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
 
+	subpage_curpages++;
+	if (subpage_curpages > subpage_peakpages) {
+		subpage_peakpages = subpage_curpages;
+	}
+
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
 	 * using in spring 2001 attempted to optimize this loop and
@@ -1035,8 +1401,19 @@ subpage_kfree(void *ptr)
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
+#if OPT_KMPROF
+	vaddr_t tagaddr;	// address of profiler tag
+#endif
 
 	ptraddr = (vaddr_t)ptr;
+#if OPT_KMPROF
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* Tagged pointers are never page-aligned; see below. */
+		return -1;
+	}
+	ptraddr -= KMPROF_PTROFFSET;
+	tagaddr = ptraddr;
+#endif
 #ifdef GUARDS
 	if (ptraddr % PAGE_SIZE == 0) {
 		/*
@@ -1102,6 +1479,10 @@ subpage_kfree(void *ptr)
 	checkguardband(ptraddr, smallerblocksize, blocksize);
 #endif
 
+#if OPT_KMPROF
+	releasekmprof(tagaddr);
+#endif
+
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
@@ -1142,6 +1523,8 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+		KASSERT(subpage_curpages > 0);
+		subpage_curpages--;
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1170,19 +1553,19 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
-#ifdef LABELS
+#if defined(LABELS) || OPT_KMPROF
 	vaddr_t label;
 #endif
 
-#ifdef LABELS
+#if defined(LABELS) || OPT_KMPROF
 #ifdef __GNUC__
 	label = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
-#endif /* LABELS */
+#endif /* LABELS || OPT_KMPROF */
 
-	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
+	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD + KMPROF_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -1194,11 +1577,14 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+#if OPT_KMPROF
+		kmprof_bigalloc(address, label, sz);
+#endif
 
 		return (void *)address;
 	}
 
-#ifdef LABELS
+#if defined(LABELS) || OPT_KMPROF
 	return subpage_kmalloc(sz, label);
 #else
 	return subpage_kmalloc(sz);
@@ -1218,6 +1604,9 @@ kfree(void *ptr)
 		return;
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+#if OPT_KMPROF
+		kmprof_bigfree((vaddr_t)ptr);
+#endif
 		free_kpages((vaddr_t)ptr);
 	}
 }
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Physical memory watermarks and reclaim.
+ *
+ * The frame allocator keeps count of free frames (see ram_getstats)
+ * and tells us about it:
+ *
+ *    - after each allocation, via reclaim_check(). If the number of
+ *      free frames has dropped below the low watermark, we wake the
+ *      reclaim thread, which runs the reclaim hooks until free memory
+ *      is back above the high watermark or nothing more comes back.
+ *      If it has dropped below the min watermark, and the caller is
+ *      in a position to sleep, the caller runs the hooks itself.
+ *
+ *    - when an allocation fails, via reclaim_direct(). If possible
+ *      the hooks are run right away so the allocator can retry.
+ *
+ * A reclaim hook is a function that gives memory back (by shrinking
+ * a cache, say) and returns roughly how many pages it freed. Hooks
+ * are registered with reclaim_register and may be registered at any
+ * time, including before reclaim_bootstrap. Hooks may sleep; they
+ * are always called from thread context with reclaim_lock held, so
+ * only one reclaim runs at a time. But since direct reclaim happens
+ * inside whatever code was allocating memory, a hook must not wait
+ * for a lock that might be held across a kmalloc.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+
+#define RECLAIM_MAXHOOKS 8
+
+struct reclaim_hook {
+	const char *rh_name;
+	unsigned (*rh_func)(unsigned npages);
+	unsigned rh_calls;		/* times called */
+	unsigned rh_pages;		/* pages it said it freed */
+};
+
+/* The hooks. Protected by reclaim_spinlock; never removed. */
+static struct reclaim_hook reclaim_hooks[RECLAIM_MAXHOOKS];
+static unsigned reclaim_nhooks;
+
+/* Watermarks, in pages. Fixed by reclaim_bootstrap. */
+static unsigned reclaim_min, reclaim_low, reclaim_high;
+
+/* Statistics. Protected by reclaim_spinlock. */
+static unsigned reclaim_wakeups;	/* times the thread was woken */
+static unsigned reclaim_directs;	/* times callers reclaimed directly */
+static unsigned reclaim_failures;	/* reclaims that got nothing back */
+
+static struct spinlock reclaim_spinlock = SPINLOCK_INITIALIZER;
+static struct wchan *reclaim_wchan;	/* reclaim thread sleeps here */
+static bool reclaim_wanted;		/* reclaim thread has work */
+static struct lock *reclaim_lock;	/* held while running hooks */
+
+/*
+ * Register a reclaim hook. FUNC is asked to free NPAGES pages and
+ * returns the number it actually freed.
+ */
+int
+reclaim_register(const char *name, unsigned (*func)(unsigned npages))
+{
+	spinlock_acquire(&reclaim_spinlock);
+	if (reclaim_nhooks == RECLAIM_MAXHOOKS) {
+		spinlock_release(&reclaim_spinlock);
+		return ENOSPC;
+	}
+	reclaim_hooks[reclaim_nhooks].rh_name = name;
+	reclaim_hooks[reclaim_nhooks].rh_func = func;
+	reclaim_hooks[reclaim_nhooks].rh_calls = 0;
+	reclaim_hooks[reclaim_nhooks].rh_pages = 0;
+	reclaim_nhooks++;
+	spinlock_release(&reclaim_spinlock);
+	return 0;
+}
+
+/*
+ * Run the hooks until at least NPAGES come back or they've all been
+ * tried. Returns the number of pages freed. Must hold reclaim_lock.
+ */
+static
+unsigned
+reclaim_runhooks(unsigned npages)
+{
+	unsigned i, n, got, total;
+
+	KASSERT(lock_do_i_hold(reclaim_lock));
+
+	spinlock_acquire(&reclaim_spinlock);
+	n = reclaim_nhooks;
+	spinlock_release(&reclaim_spinlock);
+
+	total = 0;
+	for (i=0; i<n && total < npages; i++) {
+		got = reclaim_hooks[i].rh_func(npages - total);
+
+		spinlock_acquire(&reclaim_spinlock);
+		reclaim_hooks[i].rh_calls++;
+		reclaim_hooks[i].rh_pages += got;
+		spinlock_release(&reclaim_spinlock);
+
+		total += got;
+	}
+
+	if (total == 0) {
+		spinlock_acquire(&reclaim_spinlock);
+		reclaim_failures++;
+		spinlock_release(&reclaim_spinlock);
+	}
+	return total;
+}
+
+/*
+ * Check if it is safe for the current thread to run the hooks: it
+ * must be able to sleep, and must not already be reclaiming (hooks
+ * may well call kmalloc).
+ */
+static
+bool
+reclaim_cansleep(void)
+{
+	if (reclaim_lock == NULL) {
+		return false;
+	}
+	if (curthread->t_in_interrupt || curcpu->c_spinlocks > 0 ||
+	    curthread->t_curspl > 0) {
+		return false;
+	}
+	return !lock_do_i_hold(reclaim_lock);
+}
+
+/*
+ * Called by the frame allocator when an allocation of NPAGES has
+ * failed. Runs the hooks if we can; returns the number of pages
+ * freed, in which case the allocator should retry.
+ */
+unsigned
+reclaim_direct(unsigned npages)
+{
+	unsigned got;
+
+	if (!reclaim_cansleep()) {
+		return 0;
+	}
+
+	spinlock_acquire(&reclaim_spinlock);
+	reclaim_directs++;
+	spinlock_release(&reclaim_spinlock);
+
+	lock_acquire(reclaim_lock);
+	got = reclaim_runhooks(npages);
+	lock_release(reclaim_lock);
+	return got;
+}
+
+/*
+ * Called by the frame allocator after each successful allocation
+ * with the number of frames left free.
+ */
+void
+reclaim_check(unsigned freepages)
+{
+	if (freepages >= reclaim_low || reclaim_wchan == NULL) {
+		/* Plenty of memory, or too early in boot to care. */
+		return;
+	}
+
+	spinlock_acquire(&reclaim_spinlock);
+	if (!reclaim_wanted) {
+		reclaim_wanted = true;
+		reclaim_wakeups++;
+		wchan_wakeone(reclaim_wchan, &reclaim_spinlock);
+	}
+	spinlock_release(&reclaim_spinlock);
+
+	if (freepages < reclaim_min) {
+		reclaim_direct(reclaim_min - freepages);
+	}
+}
+
+/*
+ * Return true if free memory is below the low watermark. Caches can
+ * use this to avoid growing while memory is short.
+ */
+bool
+reclaim_lowmem(void)
+{
+	unsigned total, freepages;
+
+	ram_getstats(&total, &freepages);
+	return freepages < reclaim_low;
+}
+
+/*
+ * The reclaim thread. Waits to be woken by reclaim_check, then
+ * reclaims until free memory is above the high watermark or the hooks
+ * stop producing anything.
+ */
+static
+void
+reclaim_thread(void *junk1, unsigned long junk2)
+{
+	unsigned total, freepages;
+
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		spinlock_acquire(&reclaim_spinlock);
+		while (!reclaim_wanted) {
+			wchan_sleep(reclaim_wchan, &reclaim_spinlock);
+		}
+		spinlock_release(&reclaim_spinlock);
+
+		lock_acquire(reclaim_lock);
+		ram_getstats(&total, &freepages);
+		while (freepages < reclaim_high) {
+			if (reclaim_runhooks(reclaim_high - freepages) == 0) {
+				break;
+			}
+			ram_getstats(&total, &freepages);
+		}
+		lock_release(reclaim_lock);
+
+		spinlock_acquire(&reclaim_spinlock);
+		reclaim_wanted = false;
+		spinlock_release(&reclaim_spinlock);
+	}
+}
+
+/*
+ * Set the watermarks from the amount of memory we have, and start
+ * the reclaim thread. Called from boot() after vm_bootstrap.
+ */
+void
+reclaim_bootstrap(void)
+{
+	unsigned total, freepages;
+	int result;
+
+	ram_getstats(&total, &freepages);
+	reclaim_min = total / 64 < 4 ? 4 : total / 64;
+	reclaim_low = reclaim_min * 2;
+	reclaim_high = reclaim_min * 3;
+
+	reclaim_lock = lock_create("reclaim");
+	if (reclaim_lock == NULL) {
+		panic("reclaim_bootstrap: Out of memory\n");
+	}
+
+	reclaim_wchan = wchan_create("reclaim");
+	if (reclaim_wchan == NULL) {
+		panic("reclaim_bootstrap: Out of memory\n");
+	}
+
+	/*
+	 * If anyone calls reclaim_check before the thread first gets
+	 * to run, it will find reclaim_wanted set and start at once.
+	 */
+	result = thread_fork("reclaim", NULL, reclaim_thread, NULL, 0);
+	if (result) {
+		panic("reclaim_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Print the memory statistics.
+ */
+void
+reclaim_printstats(void)
+{
+	unsigned total, freepages, i;
+
+	ram_getstats(&total, &freepages);
+
+	kprintf("Physical memory: %u pages, %u free, %u used\n",
+		total, freepages, total - freepages);
+	kprintf("Watermarks: min %u, low %u, high %u\n",
+		reclaim_min, reclaim_low, reclaim_high);
+
+	spinlock_acquire(&reclaim_spinlock);
+	kprintf("Reclaim: %u wakeups, %u direct, %u with nothing freed\n",
+		reclaim_wakeups, reclaim_directs, reclaim_failures);
+	for (i=0; i<reclaim_nhooks; i++) {
+		kprintf("   %-16s %6u calls %8u pages\n",
+			reclaim_hooks[i].rh_name,
+			reclaim_hooks[i].rh_calls,
+			reclaim_hooks[i].rh_pages);
+	}
+	spinlock_release(&reclaim_spinlock);
+}
@@ -8,6 +8,9 @@
 #include <proc.h>
 #include <elf.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
 
 /* Page functions */
 int pt_insert_top(struct addrspace *as, uint32_t top_table_index);
@@ -43,6 +46,7 @@ void vm_bootstrap(void)
      * You may or may not need to add anything here depending what's
      * provided or required by the assignment spec.
      */
+    as_reaper_bootstrap();
 }
 
 int
@@ -76,10 +80,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 
+    // Other threads in the process may be faulting too
+    lock_acquire(as->as_lock);
+
     // If not in top level page table, add to page table
     if (!as->pt[top_table_index]) {
         int err = pt_insert_top(as, top_table_index);
         if (err) {
+            lock_release(as->as_lock);
             return err;
         }
     }
@@ -87,6 +95,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     if (!as->pt[top_table_index][second_table_index]) {
         int err = pt_insert_second(as, top_table_index, second_table_index);
         if (err) {
+            lock_release(as->as_lock);
             return err;
         }
     }
@@ -96,7 +105,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         // Get valid region
         while (cur_region != NULL) {
             vaddr_t cur_end_address = cur_region->start_vaddr + (cur_region->npages * PAGE_SIZE);
-            if (faultaddress >= cur_region->start_vaddr && faultaddress <= cur_end_address) {
+            if (faultaddress >= cur_region->start_vaddr && faultaddress < cur_end_address) {
                 // cur_region is now the region >:]
                 break;
             }
@@ -104,11 +113,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         }
         // if no valid region
         if (cur_region == NULL) {
+            lock_release(as->as_lock);
             return EFAULT;
         }
         // insert into page table
         vaddr_t vaddr = alloc_kpages(1);
         if (!vaddr) {
+            lock_release(as->as_lock);
             return ENOMEM;
         }
         bzero((void *)vaddr, PAGE_SIZE);
@@ -122,21 +133,155 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     
     uint32_t entry_lo = as->pt[top_table_index][second_table_index][third_table_index];
 
-    // Disable interrupts for tlb_random
+    // Disable interrupts for tlb_random. Keep holding as_lock until the
+    // entry is in: otherwise another thread could unmap the page and
+    // shoot down the TLBs before we load a stale entry into ours.
     int spl = splhigh();
     tlb_random(page_number, entry_lo);
-    splx(spl); 
+    splx(spl);
+    lock_release(as->as_lock);
     return 0;
 }
 
 /*
- * SMP-specific functions.  Unused in our UNSW configuration.
+ * Find the physical address behind user address VA in AS. The page
+ * must already be mapped (copyin from it first to fault it in).
+ */
+int
+vm_translate(struct addrspace *as, vaddr_t va, paddr_t *ret)
+{
+	uint32_t i, j, k;
+	paddr_t pte;
+
+	i = va >> 24;
+	j = va << 8 >> 26;
+	k = va << 14 >> 26;
+
+	lock_acquire(as->as_lock);
+	if (as->pt[i] == NULL || as->pt[i][j] == NULL) {
+		pte = 0;
+	}
+	else {
+		pte = as->pt[i][j][k];
+	}
+	lock_release(as->as_lock);
+
+	if (pte == 0) {
+		return EFAULT;
+	}
+	*ret = (pte & PAGE_FRAME) | (va & ~PAGE_FRAME);
+	return 0;
+}
+
+/*
+ * SMP-specific functions.
+ *
+ * Each address space keeps a mask of the cpus that have activated it
+ * (as_cpumask), and each cpu remembers which address space its TLB
+ * holds entries for (c_tlbasid); see as_activate. When mappings go
+ * away only the cpus in the mask are asked to drop them, one entry
+ * at a time if there are few enough, or by flushing their TLB if not.
+ * A cpu that gets asked about an address space it has since switched
+ * away from takes itself out of the mask, so the mask is trimmed
+ * lazily rather than on every context switch.
+ *
+ * The caller waits for all the cpus before freeing the frames, so
+ * nobody can reach a frame through a stale entry after it has been
+ * reused.
  */
 
+/*
+ * Flush the TLB on this cpu.
+ */
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	struct addrspace *as = ts->ts_as;
+	int index, spl;
+
+	spl = splhigh();
+	if (curcpu->c_tlbasid != as->as_id) {
+		/* Nothing of it here any more; stop asking us. */
+		spinlock_acquire(&as->as_cpulock);
+		as->as_cpumask &= ~CPUMASK_CPU(curcpu->c_number);
+		spinlock_release(&as->as_cpulock);
+	}
+	else if (ts->ts_vaddr == TLBSHOOTDOWN_ALL) {
+		vm_tlbflush();
+	}
+	else {
+		index = tlb_probe(ts->ts_vaddr & PAGE_FRAME, 0);
+		if (index >= 0) {
+			tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+		}
+	}
+	splx(spl);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlbflush();
+}
+
+/*
+ * Send TS to every cpu that might hold entries for its address space.
+ */
+static
+void
+vm_tlbshootdown_send(const struct tlbshootdown *ts, unsigned n)
+{
+	struct addrspace *as = ts[0].ts_as;
+	uint32_t mask;
+
+	spinlock_acquire(&as->as_cpulock);
+	mask = as->as_cpumask;
+	spinlock_release(&as->as_cpulock);
+
+	if (mask != 0) {
+		ipi_tlbshootdown_sync(mask, ts, n);
+	}
 }
 
+void
+vm_tlbshootdown_as(struct addrspace *as)
+{
+	struct tlbshootdown ts;
+
+	ts.ts_as = as;
+	ts.ts_vaddr = TLBSHOOTDOWN_ALL;
+	vm_tlbshootdown_send(&ts, 1);
+}
+
+void
+vm_tlbshootdown_pages(struct addrspace *as, const vaddr_t *vaddrs, unsigned n)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	unsigned i;
+
+	if (n == 0) {
+		return;
+	}
+	if (n > TLBSHOOTDOWN_MAX) {
+		/* Cheaper to flush than to probe for each one. */
+		vm_tlbshootdown_as(as);
+		return;
+	}
+	for (i=0; i<n; i++) {
+		ts[i].ts_as = as;
+		ts[i].ts_vaddr = vaddrs[i];
+	}
+	vm_tlbshootdown_send(ts, n);
+}
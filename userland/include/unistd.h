@@ -40,9 +40,11 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/prof.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* after kern/time.h */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -147,6 +149,16 @@ ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int setaffinity(pid_t pid, unsigned mask);
+int profctl(int op, void *buf, size_t len);
+int getrusage(int who, struct rusage *usage);
+int __threadfork(void (*entry)(void (*)(void *), void *),
+		 void (*func)(void *), void *arg);
+int threadjoin(int tid);
+__DEAD void threadexit(void);
+int futex_wait(volatile unsigned *addr, unsigned val);
+int futex_wake(volatile unsigned *addr, int n);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -158,6 +170,21 @@ ssize_t __getcwd(char *buf, size_t buflen);
 int execvp(const char *prog, char *const *args); /* calls execv */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int threadfork(void (*func)(void *), void *arg); /* calls __threadfork */
+
+/*
+ * Mutexes for threads. These only make system calls (futex_wait and
+ * futex_wake) when the mutex is contended.
+ */
+struct mutex {
+	volatile unsigned m_state;	/* 0 free, 1 held, 2 held & waiters */
+};
+#define MUTEX_INITIALIZER { 0 }
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+int mutex_trylock(struct mutex *m);		/* 0 if got it, else -1 */
+void mutex_unlock(struct mutex *m);
 
 /* UNSW versions of mmap() and munmap()
  * This are simplified compared to the standard version on UNIX
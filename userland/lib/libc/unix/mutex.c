@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+
+/*
+ * Mutexes for user-level threads.
+ *
+ * The mutex is a word that is 0 when free, 1 when held, and 2 when
+ * held and there may be threads waiting. Taking a free mutex and
+ * releasing one nobody is waiting for are each a single atomic swap;
+ * only a thread that finds the mutex held goes into the kernel, to
+ * sleep with futex_wait, and it marks the mutex 2 first so the thread
+ * that releases it knows to call futex_wake.
+ *
+ * Grabbing the mutex with a swap to 1 can overwrite a 2. That's all
+ * right: if the swap didn't get 0, we go on to swap in 2 again before
+ * sleeping, and if it did, we hold the mutex and whoever released it
+ * saw the 2 and woke someone, who will put the 2 back.
+ */
+
+/*
+ * Atomically store VAL in *P and return the old value, using LL/SC
+ * like the kernel's spinlock_data_testandset.
+ */
+static
+unsigned
+mutex_swap(volatile unsigned *p, unsigned val)
+{
+	unsigned x, y;
+
+	do {
+		y = val;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (p) : "memory");
+	} while (y == 0);
+
+	return x;
+}
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	if (mutex_swap(&m->m_state, 1) == 0) {
+		return;
+	}
+	while (mutex_swap(&m->m_state, 2) != 0) {
+		/* Fails at once if it's no longer 2; just try again. */
+		futex_wait(&m->m_state, 2);
+	}
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	unsigned old;
+
+	old = mutex_swap(&m->m_state, 1);
+	if (old == 2) {
+		/*
+		 * Put back the waiter mark we wrote over. If the mutex
+		 * was released meanwhile, this gets it for us.
+		 */
+		old = mutex_swap(&m->m_state, 2);
+	}
+	return old == 0 ? 0 : -1;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (mutex_swap(&m->m_state, 0) == 2) {
+		futex_wake(&m->m_state, 1);
+	}
+}
@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * kprof - profile a command with the kernel's sampling profiler.
+ * usage: kprof [-k kernel] [-n count] command [args...]
+ *
+ * Starts kernel profiling, runs the command, and when it exits
+ * prints where the time went: the kernel functions that were running
+ * (for all processes), and the command's own functions when it was
+ * running in user mode. Function names come from the symbol tables of
+ * the kernel image (default /kernel) and of the command's program
+ * file. Only the top COUNT functions of each are printed (default 20).
+ *
+ * Each cpu only keeps about ten seconds of samples, so we read them
+ * out as we go while waiting for the command.
+ *
+ * This program uses these system calls:
+ *    profctl fork execv waitpid nanosleep open read lseek close _exit
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+/*
+ * Just enough of ELF to find the symbol table. (The program runs on
+ * the same machine the files are for, so no byte swapping.)
+ */
+typedef struct {
+	unsigned char e_ident[16];
+	uint16_t e_type;
+	uint16_t e_machine;
+	uint32_t e_version;
+	uint32_t e_entry;
+	uint32_t e_phoff;
+	uint32_t e_shoff;
+	uint32_t e_flags;
+	uint16_t e_ehsize;
+	uint16_t e_phentsize;
+	uint16_t e_phnum;
+	uint16_t e_shentsize;
+	uint16_t e_shnum;
+	uint16_t e_shstrndx;
+} Elf32_Ehdr;
+
+typedef struct {
+	uint32_t sh_name;
+	uint32_t sh_type;
+	uint32_t sh_flags;
+	uint32_t sh_addr;
+	uint32_t sh_offset;
+	uint32_t sh_size;
+	uint32_t sh_link;
+	uint32_t sh_info;
+	uint32_t sh_addralign;
+	uint32_t sh_entsize;
+} Elf32_Shdr;
+
+typedef struct {
+	uint32_t st_name;
+	uint32_t st_value;
+	uint32_t st_size;
+	unsigned char st_info;
+	unsigned char st_other;
+	uint16_t st_shndx;
+} Elf32_Sym;
+
+#define SHT_SYMTAB	2
+#define STT_FUNC	2
+
+/* One function and the samples that landed in it. */
+struct func {
+	uint32_t addr;
+	uint32_t size;
+	const char *name;
+	unsigned count;
+};
+
+/* The functions from one program image, sorted by address. */
+struct image {
+	const char *path;
+	struct func *funcs;
+	unsigned nfuncs;
+	unsigned total;		/* samples in this image */
+	unsigned unknown;	/* ... that matched no function */
+};
+
+static struct image kernimage, userimage;
+static unsigned nsamples, otheruser;
+static pid_t childpid;
+
+static struct profsample samples[512];
+
+////////////////////////////////////////////////////////////
+// symbol tables
+
+/*
+ * Read exactly LEN bytes at offset POS.
+ */
+static
+int
+readat(int fd, off_t pos, void *buf, size_t len)
+{
+	ssize_t r;
+	size_t done;
+
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		return -1;
+	}
+	for (done = 0; done < len; done += r) {
+		r = read(fd, (char *)buf + done, len - done);
+		if (r <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static
+int
+func_byaddr(const void *a, const void *b)
+{
+	const struct func *fa = a, *fb = b;
+
+	if (fa->addr < fb->addr) {
+		return -1;
+	}
+	return fa->addr > fb->addr;
+}
+
+static
+int
+func_bycount(const void *a, const void *b)
+{
+	const struct func *fa = a, *fb = b;
+
+	if (fa->count > fb->count) {
+		return -1;
+	}
+	return fa->count < fb->count;
+}
+
+/*
+ * Load the function symbols from the ELF file at PATH into IM. If
+ * anything goes wrong, warn and leave IM with no functions; samples
+ * will then all be counted as unknown.
+ */
+static
+void
+loadimage(struct image *im, const char *path)
+{
+	Elf32_Ehdr eh;
+	Elf32_Shdr *sh;
+	Elf32_Sym *syms;
+	char *strs;
+	unsigned i, nsyms, symtab;
+	int fd;
+
+	im->path = path;
+	im->funcs = NULL;
+	im->nfuncs = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warn("%s", path);
+		return;
+	}
+	if (readat(fd, 0, &eh, sizeof(eh)) < 0 ||
+	    memcmp(eh.e_ident, "\177ELF", 4) != 0 ||
+	    eh.e_shentsize != sizeof(Elf32_Shdr)) {
+		warnx("%s: Not an ELF file", path);
+		close(fd);
+		return;
+	}
+
+	sh = malloc(eh.e_shnum * sizeof(*sh));
+	if (sh == NULL ||
+	    readat(fd, eh.e_shoff, sh, eh.e_shnum * sizeof(*sh)) < 0) {
+		warnx("%s: Cannot read section headers", path);
+		free(sh);
+		close(fd);
+		return;
+	}
+
+	for (symtab = 0; symtab < eh.e_shnum; symtab++) {
+		if (sh[symtab].sh_type == SHT_SYMTAB) {
+			break;
+		}
+	}
+	if (symtab == eh.e_shnum || sh[symtab].sh_link >= eh.e_shnum) {
+		warnx("%s: No symbol table", path);
+		free(sh);
+		close(fd);
+		return;
+	}
+
+	nsyms = sh[symtab].sh_size / sizeof(Elf32_Sym);
+	syms = malloc(nsyms * sizeof(*syms));
+	strs = malloc(sh[sh[symtab].sh_link].sh_size);
+	im->funcs = malloc(nsyms * sizeof(*im->funcs));
+	if (syms == NULL || strs == NULL || im->funcs == NULL ||
+	    readat(fd, sh[symtab].sh_offset, syms,
+		   nsyms * sizeof(*syms)) < 0 ||
+	    readat(fd, sh[sh[symtab].sh_link].sh_offset, strs,
+		   sh[sh[symtab].sh_link].sh_size) < 0) {
+		warnx("%s: Cannot read symbol table", path);
+		free(syms);
+		free(strs);
+		free(im->funcs);
+		im->funcs = NULL;
+		free(sh);
+		close(fd);
+		return;
+	}
+
+	for (i=0; i<nsyms; i++) {
+		if ((syms[i].st_info & 0xf) != STT_FUNC ||
+		    syms[i].st_value == 0) {
+			continue;
+		}
+		im->funcs[im->nfuncs].addr = syms[i].st_value;
+		im->funcs[im->nfuncs].size = syms[i].st_size;
+		im->funcs[im->nfuncs].name = strs + syms[i].st_name;
+		im->funcs[im->nfuncs].count = 0;
+		im->nfuncs++;
+	}
+	qsort(im->funcs, im->nfuncs, sizeof(*im->funcs), func_byaddr);
+
+	/* strs stays around; the function names point into it */
+	free(syms);
+	free(sh);
+	close(fd);
+}
+
+/*
+ * Charge a sample at PC to the function in IM that contains it.
+ */
+static
+void
+charge(struct image *im, uint32_t pc)
+{
+	unsigned lo, hi, mid;
+
+	im->total++;
+
+	/* find the last function starting at or before pc */
+	lo = 0;
+	hi = im->nfuncs;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (im->funcs[mid].addr <= pc) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo == 0 || (im->funcs[lo-1].size != 0 &&
+			pc >= im->funcs[lo-1].addr + im->funcs[lo-1].size)) {
+		im->unknown++;
+		return;
+	}
+	im->funcs[lo-1].count++;
+}
+
+static
+void
+printimage(const char *what, struct image *im, unsigned maxshown)
+{
+	unsigned i;
+
+	printf("%s: %u samples (%s)\n", what, im->total, im->path);
+	if (im->total == 0) {
+		return;
+	}
+	qsort(im->funcs, im->nfuncs, sizeof(*im->funcs), func_bycount);
+	for (i=0; i<im->nfuncs && i<maxshown; i++) {
+		if (im->funcs[i].count == 0) {
+			break;
+		}
+		printf("   %7u %3u%%  %s\n", im->funcs[i].count,
+		       im->funcs[i].count * 100 / im->total,
+		       im->funcs[i].name);
+	}
+	if (im->unknown > 0) {
+		printf("   %7u %3u%%  (unknown)\n", im->unknown,
+		       im->unknown * 100 / im->total);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// samples
+
+/*
+ * Read out whatever samples the kernel has and count them. Returns
+ * the number read.
+ */
+static
+unsigned
+drain(void)
+{
+	int n, i, total;
+
+	total = 0;
+	do {
+		n = profctl(PROF_READ, samples, sizeof(samples));
+		if (n < 0) {
+			err(1, "profctl");
+		}
+		for (i=0; i<n; i++) {
+			if ((samples[i].ps_flags & PROF_USER) == 0) {
+				charge(&kernimage, samples[i].ps_pc);
+			}
+			else if (samples[i].ps_pid == childpid) {
+				charge(&userimage, samples[i].ps_pc);
+			}
+			else {
+				otheruser++;
+			}
+		}
+		nsamples += n;
+		total += n;
+	} while (n > 0);
+	return total;
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: kprof [-k kernel] [-n count] command [args...]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *kernel = "/kernel";
+	unsigned maxshown = 20;
+	struct timespec pause;
+	int i, status;
+	pid_t pid;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-k") && i+1 < argc) {
+			kernel = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-n") && i+1 < argc) {
+			maxshown = atoi(argv[++i]);
+		}
+		else {
+			usage();
+		}
+	}
+	if (i == argc) {
+		usage();
+	}
+
+	loadimage(&kernimage, kernel);
+	loadimage(&userimage, argv[i]);
+
+	/* throw away anything left over from before */
+	profctl(PROF_STOP, NULL, 0);
+	while (profctl(PROF_READ, samples, sizeof(samples)) > 0) {
+		;
+	}
+	if (profctl(PROF_START, NULL, 0) < 0) {
+		err(1, "profctl");
+	}
+
+	childpid = fork();
+	if (childpid < 0) {
+		err(1, "fork");
+	}
+	if (childpid == 0) {
+		execv(argv[i], &argv[i]);
+		warn("%s", argv[i]);
+		_exit(1);
+	}
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = 500000000;
+	while (1) {
+		pid = waitpid(childpid, &status, WNOHANG);
+		if (pid < 0) {
+			err(1, "waitpid");
+		}
+		if (pid == childpid) {
+			break;
+		}
+		drain();
+		nanosleep(&pause, NULL);
+	}
+
+	profctl(PROF_STOP, NULL, 0);
+	drain();
+
+	printf("%u samples, %u in other processes' user code\n",
+	       nsamples, otheruser);
+	printimage("Kernel", &kernimage, maxshown);
+	printimage("User", &userimage, maxshown);
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test for the user-level mutexes in libc, which sleep and wake with
+ * futex_wait and futex_wake.
+ *
+ * Several threads each add to a shared counter many times, holding
+ * a mutex while doing it with an unlocked read and write-back, so
+ * that updates are lost if the mutex doesn't exclude. At the end the
+ * count must be exactly right.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define NTHREADS 4
+#define LOOPS    20000
+
+static struct mutex countlock = MUTEX_INITIALIZER;
+static volatile unsigned count;
+
+static
+void
+adder(void *junk)
+{
+	unsigned i, n;
+
+	(void)junk;
+
+	for (i=0; i<LOOPS; i++) {
+		mutex_lock(&countlock);
+		n = count;
+		if (i % 64 == 0) {
+			/* Encourage a switch while holding the mutex. */
+			putchar('.');
+		}
+		count = n + 1;
+		mutex_unlock(&countlock);
+	}
+}
+
+int
+main(void)
+{
+	int tids[NTHREADS];
+	int i;
+
+	for (i=0; i<NTHREADS; i++) {
+		tids[i] = threadfork(adder, NULL);
+		if (tids[i] < 0) {
+			err(1, "threadfork");
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (threadjoin(tids[i]) < 0) {
+			err(1, "threadjoin");
+		}
+	}
+
+	printf("\n");
+	if (count != NTHREADS * LOOPS) {
+		errx(1, "FAILED: count is %u, should be %u",
+		     count, NTHREADS * LOOPS);
+	}
+	if (mutex_trylock(&countlock) != 0) {
+		errx(1, "FAILED: mutex still held");
+	}
+	mutex_unlock(&countlock);
+	printf("mutextest: Passed.\n");
+	return 0;
+}
@@ -36,11 +36,15 @@
  *
  * The last part of the test will generally hang, sometimes in fork,
  * unless your filetable/open-file locking is just so.
+ *
+ * By default P and V are done with read and write. With -i they're
+ * done with the SEMIOC_P and SEMIOC_V ioctls instead.
  */
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <err.h>
@@ -51,6 +55,9 @@
 #define LOOPS (ONCELOOPS + 2*TWICELOOPS + 3*THRICELOOPS)
 #define NUMJOBS 4
 
+/* Use ioctl rather than read/write for P and V (-i) */
+static int use_ioctl;
+
 /*
  * Print to the console, one character at a time to encourage
  * interleaving if the semaphores aren't working.
@@ -164,6 +171,13 @@ P(struct usem *sem)
 	ssize_t r;
 	char c;
 
+	if (use_ioctl) {
+		if (ioctl(sem->fd, SEMIOC_P, (void *)1) < 0) {
+			err(1, "%s: ioctl P", sem->name);
+		}
+		return;
+	}
+
 	r = read(sem->fd, &c, 1);
 	if (r < 0) {
 		err(1, "%s: read", sem->name);
@@ -180,6 +194,13 @@ V(struct usem *sem)
 	ssize_t r;
 	char c;
 
+	if (use_ioctl) {
+		if (ioctl(sem->fd, SEMIOC_V, (void *)1) < 0) {
+			err(1, "%s: ioctl V", sem->name);
+		}
+		return;
+	}
+
 	r = write(sem->fd, &c, 1);
 	if (r < 0) {
 		err(1, "%s: write", sem->name);
@@ -380,8 +401,15 @@ conctest(void)
 // concurrent use test
 
 int
-main(void)
+main(int argc, char *argv[])
 {
+	if (argc == 2 && !strcmp(argv[1], "-i")) {
+		use_ioctl = 1;
+	}
+	else if (argc > 1) {
+		errx(1, "Usage: usemtest [-i]");
+	}
+
 	basetest();
 	conctest();
 	say("Passed.\n");
@@ -32,17 +32,11 @@
  * forks 3 threads off 2 to functions, each of which displays a string
  * every once in a while.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * Threads are created with threadfork(), which takes the function
+ * for the new thread to run and an argument for it, and returns a
+ * thread id; a thread that returns from its function exits. The
+ * parent waits for them with threadjoin() before returning, because
+ * exiting the process takes all its threads with it.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -61,22 +55,31 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+void ThreadRunner(void *);
+void BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
     int i;
+    int tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = threadfork(ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = threadfork(BladeRunner, NULL);
+	if (tids[i] < 0) {
+	    printf("threadfork failed\n");
+	    return 1;
+	}
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	threadjoin(tids[i]);
     }
 
     printf("Parent has left.\n");
@@ -89,8 +92,10 @@ main(int argc, char *argv[])
 */
 
 void
-BladeRunner()
+BladeRunner(void *junk)
 {
+    (void)junk;
+
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
@@ -99,8 +104,10 @@ BladeRunner()
 }
 
 void
-ThreadRunner()
+ThreadRunner(void *junk)
 {
+    (void)junk;
+
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");